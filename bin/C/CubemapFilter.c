@@ -18,37 +18,43 @@ typedef struct JobData_t
 } JobData;
 
 
-int UploadImageJob(JobData *data)
+int ProcessingDoneJob(JobData *data)
 {
-	SetEvaluationImage(data->targetIndex, &data->image);
-	FreeImage(&data->image);
 	SetProcessing(data->targetIndex, 0);
 	return EVAL_OK;
 }
 
 int FilterJob(JobData *data)
 {
-	if (CubemapFilter(&data->image, 32<<data->param.faceSize, data->param.lightingModel, data->param.excludeBase, data->param.glossScale, data->param.glossBias) == EVAL_OK)
-	{	
-		JobData dataUp = *data;
-		JobMain(UploadImageJob, &dataUp, sizeof(JobData));
+	// not queued, the bits are still ours
+	if (CubemapFilter(&data->image, 32<<data->param.faceSize, data->param.lightingModel, data->param.excludeBase, data->param.glossScale, data->param.glossBias) != EVAL_OK
+		|| SetEvaluationImageAsync(data->targetIndex, &data->image) != EVAL_OK)
+	{
+		FreeImage(&data->image);
 	}
+	JobMain(ProcessingDoneJob, data, sizeof(JobData));
 	return EVAL_OK;
 }		
 		
-int main(CubemapFilterData *param, Evaluation *evaluation)
+int ReadbackJob(Image *image, JobData *data)
 {
-	Image image;
-	
-	if (GetEvaluationImage(evaluation->inputIndices[0], &image) == EVAL_OK)
+	if (!image->bits)
 	{
-		JobData data;
-		data.image = image;
-		data.targetIndex = evaluation->targetIndex;
-		data.param = *param;
-		SetProcessing(evaluation->targetIndex, 1);
-		Job(FilterJob, &data, sizeof(JobData));
+		JobMain(ProcessingDoneJob, data, sizeof(JobData));
+		return EVAL_ERR;
 	}
+	data->image = *image;
+	return FilterJob(data);
+}
+
+int main(CubemapFilterData *param, Evaluation *evaluation)
+{
+	JobData data;
+	data.targetIndex = evaluation->targetIndex;
+	data.param = *param;
+	SetProcessing(evaluation->targetIndex, 1);
+	if (GetEvaluationImageAsync(evaluation->inputIndices[0], ReadbackJob, &data, sizeof(JobData)) != EVAL_OK)
+		SetProcessing(evaluation->targetIndex, 0);
 
 	return EVAL_ERR;
-}
\ No newline at end of file
+}
@@ -21,17 +21,8 @@ typedef struct JobData_t
 	Image image;
 } JobData;
 
-int UploadImageJob(JobData *data)
+int ProcessingDoneJob(JobData *data)
 {
-	if (data->isCube)
-	{
-		SetEvaluationImageCube(data->targetIndex, &data->image, data->face);
-	}
-	else
-	{
-		SetEvaluationImage(data->targetIndex, &data->image);
-	}
-	FreeImage(&data->image);
 	SetProcessing(data->targetIndex, 0);
 	return EVAL_OK;
 }
@@ -40,9 +31,20 @@ int ReadJob(JobData *data)
 {
 	if (ReadImage(data->filename, &data->image) == EVAL_OK)
 	{
-		JobData dataUp = *data;
-		JobMain(UploadImageJob, &dataUp, sizeof(JobData));
+		int res;
+		if (data->isCube)
+		{
+			res = SetEvaluationImageCubeAsync(data->targetIndex, &data->image, data->face);
+		}
+		else
+		{
+			res = SetEvaluationImageAsync(data->targetIndex, &data->image);
+		}
+		// not queued, the bits are still ours
+		if (res != EVAL_OK)
+			FreeImage(&data->image);
 	}
+	JobMain(ProcessingDoneJob, data, sizeof(JobData));
 	return EVAL_OK;
 }
 
@@ -26,6 +26,24 @@ int main(ImageWrite *param, Evaluation *evaluation)
 	if (!evaluation->forcedDirty)
 		return EVAL_OK;
 	
+	// bigger than a texture can be, tiles are streamed to a TGA file
+	int maxTextureSize = GetMaxTextureSize();
+	if ((256<<param->width) > maxTextureSize || (256<<param->height) > maxTextureSize)
+	{
+		if (param->format != 2)
+		{
+			Log("Images bigger than %d are only written as TGA : %s\n", maxTextureSize, param->filename);
+			return EVAL_ERR;
+		}
+		if (EvaluateTiled(evaluation->inputIndices[0], 256<<param->width, 256<<param->height, param->filename) == EVAL_OK)
+		{
+			Log("Image %s saved.\n", param->filename);
+			return EVAL_OK;
+		}
+		Log("Unable to write image : %s\n", param->filename);
+		return EVAL_ERR;
+	}
+	
 	if (Evaluate(evaluation->inputIndices[0], 256<<param->width, 256<<param->height, &image) == EVAL_OK)
 	//if (GetEvaluationImage(evaluation->inputIndices[0], &image) == EVAL_OK)
 	{
@@ -1,3 +1,5 @@
+// a node source containing #define IMOGEN_NATIVE is built by the system compiler instead of tcc, see README
+
 int Log(const char *szFormat, ...);
 char * strcpy ( char * destination, const char * source );
 int strlen ( const char * str );
@@ -23,6 +25,7 @@ typedef struct Evaluation_t
 	int padding;
 	float mouse[4];
 	int inputIndices[8];	
+	float tileRect[4];
 	
 	float viewport[2];
 } Evaluation;
@@ -83,21 +86,51 @@ int ReadImage(char *filename, Image *image);
 int WriteImage(char *filename, Image *image, int format, int quality);
 // call FreeImage when done
 int GetEvaluationImage(int target, Image *image);
+// non blocking GetEvaluationImage. readbackFunction is called in a job when the pixels are ready,
+// with a copy of ptr. Call FreeImage on the image when done. Image bits are NULL when the readback failed
+int GetEvaluationImageAsync(int target, int(*readbackFunction)(Image*, void*), void *ptr, unsigned int size);
 // 
 int SetEvaluationImage(int target, Image *image);
 int SetEvaluationImageCube(int target, Image *image, int cubeFace);
+// same as SetEvaluationImage, can be called from a job. When EVAL_OK is returned, the image bits are owned
+// by the upload: don't free them. The texture is filled over the next frames
+int SetEvaluationImageAsync(int target, Image *image);
+int SetEvaluationImageCubeAsync(int target, Image *image, int cubeFace);
 // call FreeImage when done
 // set the bits pointer with an allocated memory
 int AllocateImage(Image *image);
 int FreeImage(Image *image);
+// converts image bits to another ImageFormat. Float to 8 bits is clamped to [0,1]
+int ConvertImage(Image *image, int format);
+
+// native kernels, multithreaded. They work on RGBA8, BGRA8 and RGBA32F images (ConvertImage first),
+// on every face. Channels are in RGBA order whatever the format
+// box filter down to twice the size then bilinear. Mips are removed
+int ResizeImage(Image *image, int width, int height);
+// replaces the mips with a full chain of 2x2 box filtered levels
+int GenerateMips(Image *image);
+// operation is one of the Blend node operations (0 Add .. 12 Exclusion). Images have the same size and mips
+int BlendImage(Image *destination, const Image *source, int operation, float opacity);
+// kernelWidth x kernelHeight weights, centered. Borders are clamped
+int ConvolveImage(Image *image, const float *kernel, int kernelWidth, int kernelHeight);
+// histogram has 1024 bins: 256 for red, then green, blue and alpha. Mip 0 of every face
+int GetImageHistogram(const Image *image, unsigned int *histogram);
+// multiplies (or divides) rgb by alpha
+int PremultiplyImage(Image *image, int unpremultiply);
+// each channel gets the source channel: 0 red, 1 green, 2 blue, 3 alpha, 4 zero, 5 one
+int SwizzleImage(Image *image, int red, int green, int blue, int alpha);
 
-// Image resize
 // Image thumbnail
 int SetThumbnailImage(Image *image);
 
 // force evaluation of a target with a specified size
 // no guarantee that the resulting Image will have that size.
 int Evaluate(int target, int width, int height, Image *image);
+// same as Evaluate, for images bigger than a texture. Target is rendered tile by tile
+// and the tiles are written to a TGA file as they come.
+int EvaluateTiled(int target, int width, int height, const char *filename);
+// biggest size Evaluate can render, EvaluateTiled is needed above
+int GetMaxTextureSize();
 
 void SetBlendingMode(int target, int blendSrc, int blendDst);
 int GetEvaluationSize(int target, int *imageWidth, int *imageHeight);
@@ -107,6 +140,11 @@ int CubemapFilter(Image *image, int faceSize, int lightingModel, int excludeBase
 
 int Job(int(*jobFunction)(void*), void *ptr, unsigned int size);
 int JobMain(int(*jobMainFunction)(void*), void *ptr, unsigned int size);
+// calls chunkFunction(ptr, begin, end) on the workers for ranges covering [0, count), of grain items or more
+// (the last one can be smaller). ptr is copied once and shared by every chunk. Once all chunks are done,
+// completionFunction(ptr) (can be 0) runs in a job, or on the main thread when completionOnMain is not 0,
+// where it can call SetEvaluationImage and SetProcessing
+int JobParallelFor(int(*chunkFunction)(void*, unsigned int, unsigned int), unsigned int count, unsigned int grain, void *ptr, unsigned int size, int(*completionFunction)(void*), int completionOnMain);
 void SetProcessing(int target, int processing);
 
 #define EVAL_OK 0
@@ -1,5 +1,19 @@
 #include "Imogen.h"
 
+int SetThumbnailJob(Image *image)
+{
+	SetThumbnailImage(image);
+	FreeImage(image);
+	return EVAL_OK;
+}
+
+int ReadbackJob(Image *image, void *data)
+{
+	if (!image->bits)
+		return EVAL_ERR;
+	return JobMain(SetThumbnailJob, image, sizeof(Image));
+}
+
 int main(void *param, Evaluation *evaluation)
 {
 	Image image;
@@ -15,14 +29,5 @@ int main(void *param, Evaluation *evaluation)
 	if (!evaluation->forcedDirty)
 		return EVAL_OK;
 
-	if (GetEvaluationImage(evaluation->inputIndices[0], &image) == EVAL_OK)
-	{
-		if (SetThumbnailImage(&image) == EVAL_OK)
-		{	
-			FreeImage(&image);
-			return EVAL_OK;
-		}
-	}
-
-	return EVAL_ERR;
+	return GetEvaluationImageAsync(evaluation->inputIndices[0], ReadbackJob, 0, 0);
 }
@@ -3,35 +3,68 @@
 
 #define TwoPI (PI*2)
 
+layout (std140) uniform EvaluationBlock
+{
+#ifdef LAYERED
+	mat4 viewRot[6]; // one per cubemap face
+#else
+	mat4 viewRot;
+#endif
+
+	int targetIndex;
+	int forcedDirty;
+	int	uiPass;
+	int padding;
+	vec4 mouse; // x,y, lbut down, rbut down
+	ivec4 inputIndices[2];
+	vec4 tileRect; // uv offset and size covered by the target. Inputs cover the same rectangle
+	
+	vec2 viewport;
+} EvaluationParam;
+
 #ifdef VERTEX_SHADER
 
 layout(location = 0)in vec2 inUV;
+#ifdef LAYERED
+#define vUV vVertexUV
+#endif
 out vec2 vUV;
 
 void main()
 {
     gl_Position = vec4(inUV.xy*2.0-1.0,0.5,1.0); 
-	vUV = inUV;
+	vUV = EvaluationParam.tileRect.xy + inUV * EvaluationParam.tileRect.zw;
 }
 
 #endif
 
+#ifdef GEOMETRY_SHADER
 
-#ifdef FRAGMENT_SHADER
+// layered cubemap: the triangle is sent to the 6 faces
+layout(triangles, invocations = 6) in;
+layout(triangle_strip, max_vertices = 3) out;
+in vec2 vVertexUV[];
+out vec2 vUV;
 
-layout (std140) uniform EvaluationBlock
+void main()
 {
-	mat4 viewRot;
+	for (int i = 0; i < 3; i++)
+	{
+		gl_Layer = gl_InvocationID;
+		gl_Position = gl_in[i].gl_Position;
+		vUV = vVertexUV[i];
+		EmitVertex();
+	}
+	EndPrimitive();
+}
 
-	int targetIndex;
-	int forcedDirty;
-	int	uiPass;
-	int padding;
-	vec4 mouse; // x,y, lbut down, rbut down
-	int inputIndices[8];
-	
-	vec2 viewport;
-} EvaluationParam;
+#endif
+
+#ifdef FRAGMENT_SHADER
+
+#ifdef LAYERED
+#define viewRot viewRot[gl_Layer]
+#endif
 
 
 layout(location=0) out vec4 outPixDiffuse;
@@ -47,6 +80,21 @@ uniform sampler2D Sampler6;
 uniform sampler2D Sampler7;
 uniform samplerCube CubeSampler0;
 
+#ifdef TILED
+// tiled evaluation: uv are the ones of the whole image, inputs only hold the tile
+vec4 TileTexture(sampler2D tex, vec2 uv)
+{
+	return texture(tex, (uv - EvaluationParam.tileRect.xy) / EvaluationParam.tileRect.zw);
+}
+
+vec4 TileTexture(samplerCube tex, vec3 dir)
+{
+	return texture(tex, dir);
+}
+
+#define texture TileTexture
+#endif
+
 vec2 Rotate2D(vec2 v, float a) 
 {
 	float s = sin(a);
@@ -0,0 +1,453 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#include <SDL.h>
+#include "Bake.h"
+#include "Evaluation.h"
+#include "Library.h"
+#include "TaskScheduler.h"
+#include "stb_image.h"
+#include <vector>
+#include <algorithm>
+
+extern enki::TaskScheduler g_TS;
+
+// mirrors ImageWrite_t in C/ImageWrite.c
+struct ImageWriteParameters
+{
+	char mFilename[1024];
+	int mFormat;
+	int mQuality;
+	int mWidth, mHeight;
+};
+
+bool ParseBakeOptions(int argc, char** argv, BakeOptions& options)
+{
+	bool bake = false;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-bake"))
+		{
+			bake = true;
+		}
+		else if (!strcmp(argv[i], "-library") && (i + 1) < argc)
+		{
+			options.mLibraryFilename = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-size") && (i + 2) < argc)
+		{
+			options.mWidth = atoi(argv[++i]);
+			options.mHeight = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-cpu"))
+		{
+			options.mbCPU = true;
+		}
+		else if (!strcmp(argv[i], "-compare"))
+		{
+			options.mbCompare = true;
+		}
+		else if (!strcmp(argv[i], "-tolerance") && (i + 1) < argc)
+		{
+			options.mTolerance = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-serial"))
+		{
+			options.mbSerial = true;
+		}
+		else if (!strcmp(argv[i], "-nofusion"))
+		{
+			options.mbNoFusion = true;
+		}
+		else if (!strcmp(argv[i], "-poolbudget") && (i + 1) < argc)
+		{
+			options.mPoolBudget = std::max(atoi(argv[++i]), 0);
+		}
+		else if (!strcmp(argv[i], "-tile") && (i + 1) < argc)
+		{
+			options.mTileSize = std::max(atoi(argv[++i]), 0);
+		}
+		else if (!strcmp(argv[i], "-benchprecisions"))
+		{
+			bake = true;
+			options.mBenchPrecisionSize = ((i + 1) < argc && argv[i + 1][0] != '-') ? atoi(argv[++i]) : 2048;
+		}
+		else if (!strcmp(argv[i], "-benchbindings"))
+		{
+			bake = true;
+			options.mBenchBindingsDrawCount = ((i + 1) < argc && argv[i + 1][0] != '-') ? atoi(argv[++i]) : 10000;
+		}
+	}
+	return bake;
+}
+
+static size_t ComputeParametersSize(size_t nodeType)
+{
+	size_t res = 0;
+	for (auto& param : gMetaNodes[nodeType].mParams)
+		res += GetParameterTypeSize(param.mType);
+	return res;
+}
+
+static void RecurseBakeOrder(const Material& material, size_t nodeIndex, std::vector<bool>& visited, std::vector<size_t>& order)
+{
+	if (visited[nodeIndex])
+		return;
+	visited[nodeIndex] = true;
+	for (auto& connection : material.mMaterialConnections)
+	{
+		if (connection.mOutputNode == nodeIndex)
+			RecurseBakeOrder(material, connection.mInputNode, visited, order);
+	}
+	order.push_back(nodeIndex);
+}
+
+static bool BuildMaterialGraph(Material& material, Evaluation& evaluation, std::vector<std::vector<uint8_t> >& parameters)
+{
+	evaluation.Clear();
+	parameters.clear();
+	parameters.resize(material.mMaterialNodes.size());
+
+	for (size_t i = 0; i < material.mMaterialNodes.size(); i++)
+	{
+		MaterialNode& node = material.mMaterialNodes[i];
+		if (node.mType >= gMetaNodes.size())
+		{
+			Log("Unknown node type %s\n", node.mTypeName.c_str());
+			return false;
+		}
+		const MetaNode& metaNode = gMetaNodes[node.mType];
+		size_t target = evaluation.AddEvaluation(node.mType, metaNode.mName);
+		if (target == size_t(-1))
+			return false;
+
+		// parameters are referenced by the evaluation, keep them alive for the whole material bake
+		parameters[i] = node.mParameters;
+		parameters[i].resize(ComputeParametersSize(node.mType), 0);
+		std::vector<InputSampler> inputSamplers = node.mInputSamplers;
+		inputSamplers.resize(metaNode.mInputs.size());
+		evaluation.SetEvaluationParameters(target, parameters[i].data(), parameters[i].size());
+		evaluation.SetEvaluationSampler(target, inputSamplers);
+		evaluation.SetEvaluationPrecision(target, int(node.mPrecision));
+	}
+
+	for (auto& connection : material.mMaterialConnections)
+		evaluation.AddEvaluationInput(connection.mOutputNode, connection.mOutputSlot, connection.mInputNode);
+
+	std::vector<bool> visited(material.mMaterialNodes.size(), false);
+	std::vector<size_t> order;
+	for (size_t i = 0; i < material.mMaterialNodes.size(); i++)
+		RecurseBakeOrder(material, i, visited, order);
+	evaluation.SetEvaluationOrder(order);
+
+	// painted nodes get their texture back from the library, synchronously
+	for (size_t i = 0; i < material.mMaterialNodes.size(); i++)
+	{
+		MaterialNode& node = material.mMaterialNodes[i];
+		if (node.mImage.empty())
+			continue;
+		Image image;
+		int components;
+		unsigned char *data = stbi_load_from_memory(node.mImage.data(), int(node.mImage.size()), &image.mWidth, &image.mHeight, &components, 0);
+		if (!data)
+			continue;
+		image.mBits = data;
+		image.mDataSize = image.mWidth * image.mHeight * components;
+		image.mNumFaces = 1;
+		image.mNumMips = 1;
+		image.mFormat = (components == 3) ? TextureFormat::RGB8 : TextureFormat::RGBA8;
+		Evaluation::SetEvaluationImage(int(i), &image);
+		Evaluation::FreeImage(&image);
+	}
+	return true;
+}
+
+// runs the graph until no node is waiting for a job (file read, cubemap filtering,...)
+static void WaitForProcessingStages(Evaluation& evaluation, size_t stageCount)
+{
+	static const Uint32 timeout = 60000;
+	Uint32 startTime = SDL_GetTicks();
+	while (true)
+	{
+		g_TS.RunPinnedTasks();
+		evaluation.ProcessReadbacks(false);
+		evaluation.ProcessUploads(timeout);
+		evaluation.RunEvaluation(256, 256, false);
+
+		bool processing = false;
+		for (size_t i = 0; i < stageCount; i++)
+			processing |= evaluation.StageIsProcessing(i);
+		if (!processing)
+			break;
+
+		if (SDL_GetTicks() - startTime > timeout)
+		{
+			Log("Timeout waiting for processing nodes.\n");
+			break;
+		}
+		SDL_Delay(1);
+	}
+}
+
+struct BakeExport
+{
+	ImageWriteParameters mParameters;
+	Image mImage;
+	size_t mPlannedPeakBytes;
+	size_t mActualPeakBytes;
+	// written while evaluated, mImage only has the size
+	bool mbTiled;
+};
+
+static bool ConeSupportsCPU(const Material& material, Evaluation& evaluation, size_t nodeIndex)
+{
+	std::vector<bool> visited(material.mMaterialNodes.size(), false);
+	std::vector<size_t> cone;
+	RecurseBakeOrder(material, nodeIndex, visited, cone);
+	for (auto node : cone)
+	{
+		if (!evaluation.StageSupportsCPU(node))
+		{
+			printf("    %s has no CPU evaluation\n", gMetaNodes[material.mMaterialNodes[node].mType].mName.c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+// evaluates every ImageWrite node of the material. Images are not written.
+static bool EvaluateExports(Material& material, Evaluation& evaluation, const BakeOptions& options, EvaluationBackend backend, std::vector<BakeExport>& exports, int& failureCount)
+{
+	const size_t imageWriteType = GetMetaNodeIndex("ImageWrite");
+	exports.clear();
+
+	evaluation.Clear();
+	evaluation.SetBackend(backend);
+	std::vector<std::vector<uint8_t> > parameters;
+	if (!BuildMaterialGraph(material, evaluation, parameters))
+		return false;
+	WaitForProcessingStages(evaluation, material.mMaterialNodes.size());
+
+	for (size_t i = 0; i < material.mMaterialNodes.size(); i++)
+	{
+		if (material.mMaterialNodes[i].mType != imageWriteType || parameters[i].size() < sizeof(ImageWriteParameters))
+			continue;
+
+		int input = -1;
+		for (auto& connection : material.mMaterialConnections)
+		{
+			if (connection.mOutputNode == i && connection.mOutputSlot == 0)
+				input = int(connection.mInputNode);
+		}
+		BakeExport bakeExport;
+		bakeExport.mParameters = *(const ImageWriteParameters *)parameters[i].data();
+		memset(&bakeExport.mImage, 0, sizeof(Image));
+		if (input == -1)
+		{
+			Log("%s : ImageWrite %s has no input\n", material.mName.c_str(), bakeExport.mParameters.mFilename);
+			continue;
+		}
+		if (backend == BACKEND_CPU && !ConeSupportsCPU(material, evaluation, input))
+		{
+			printf("    unable to evaluate %s\n", bakeExport.mParameters.mFilename);
+			failureCount++;
+			continue;
+		}
+
+		int width = options.mWidth ? options.mWidth : (256 << bakeExport.mParameters.mWidth);
+		int height = options.mHeight ? options.mHeight : (256 << bakeExport.mParameters.mHeight);
+		bakeExport.mbTiled = options.mTileSize > 0 || width > Evaluation::GetMaxTextureSize() || height > Evaluation::GetMaxTextureSize();
+		if (bakeExport.mbTiled)
+		{
+			// the tiled export is compared by nobody, no need to write it twice
+			if (backend != (options.mbCPU ? BACKEND_CPU : BACKEND_GLSL))
+				continue;
+			if (bakeExport.mParameters.mFormat != 2)
+			{
+				printf("    %s : tiled exports are written as TGA only\n", bakeExport.mParameters.mFilename);
+				failureCount++;
+				continue;
+			}
+			evaluation.SetTileSize(options.mTileSize ? options.mTileSize : 1024);
+			if (Evaluation::EvaluateTiled(input, width, height, bakeExport.mParameters.mFilename) != EVAL_OK)
+			{
+				printf("    unable to evaluate %s by tiles\n", bakeExport.mParameters.mFilename);
+				failureCount++;
+				continue;
+			}
+			bakeExport.mImage.mWidth = width;
+			bakeExport.mImage.mHeight = height;
+		}
+		else
+			Evaluation::Evaluate(input, width, height, &bakeExport.mImage);
+		bakeExport.mPlannedPeakBytes = evaluation.GetPlannedPeakBytes();
+		bakeExport.mActualPeakBytes = evaluation.GetActualPeakBytes();
+		exports.push_back(bakeExport);
+	}
+	return true;
+}
+
+// 8 bits copy of an image, the precision of the CPU backend
+static bool CopyImageRGBA8(const Image& image, Image& copy)
+{
+	copy = image;
+	copy.mBits = malloc(image.mDataSize);
+	memcpy(copy.mBits, image.mBits, image.mDataSize);
+	return Evaluation::ConvertImage(&copy, TextureFormat::RGBA8) == EVAL_OK;
+}
+
+// biggest channel difference, -1 when images can't be compared
+static int CompareImages(const Image& imageA, const Image& imageB)
+{
+	if (imageA.mBits && imageB.mBits && imageA.mFormat != imageB.mFormat)
+	{
+		// float precision nodes are compared with 8 bits
+		Image copyA, copyB;
+		bool converted = CopyImageRGBA8(imageA, copyA);
+		converted = CopyImageRGBA8(imageB, copyB) && converted;
+		int difference = converted ? CompareImages(copyA, copyB) : -1;
+		free(copyA.mBits);
+		free(copyB.mBits);
+		return difference;
+	}
+	if (!imageA.mBits || !imageB.mBits || imageA.mWidth != imageB.mWidth || imageA.mHeight != imageB.mHeight
+		|| imageA.mFormat != imageB.mFormat || imageA.mDataSize != imageB.mDataSize)
+		return -1;
+	const uint8_t *a = (const uint8_t *)imageA.mBits;
+	const uint8_t *b = (const uint8_t *)imageB.mBits;
+	int maxDifference = 0;
+	for (uint32_t i = 0; i < imageA.mDataSize; i++)
+		maxDifference = std::max(maxDifference, abs(int(a[i]) - int(b[i])));
+	return maxDifference;
+}
+
+static void FreeExports(std::vector<BakeExport>& exports)
+{
+	for (auto& bakeExport : exports)
+	{
+		if (bakeExport.mImage.mBits)
+			Evaluation::FreeImage(&bakeExport.mImage);
+	}
+	exports.clear();
+}
+
+int BakeLibrary(Library& library, Evaluation& evaluation, const BakeOptions& options)
+{
+	const size_t imageWriteType = GetMetaNodeIndex("ImageWrite");
+	const EvaluationBackend backend = options.mbCPU ? BACKEND_CPU : BACKEND_GLSL;
+	const EvaluationBackend referenceBackend = options.mbCPU ? BACKEND_GLSL : BACKEND_CPU;
+	int bakedMaterialCount = 0;
+	int exportCount = 0;
+	int failureCount = 0;
+	size_t plannedPeakBytes = 0;
+	size_t actualPeakBytes = 0;
+	const double frequency = double(SDL_GetPerformanceFrequency());
+	Uint64 bakeStart = SDL_GetPerformanceCounter();
+	evaluation.SetParallelEvaluation(!options.mbSerial);
+	evaluation.SetShaderFusion(!options.mbNoFusion);
+	gRenderTargetPool.SetBudget(size_t(options.mPoolBudget) << 20);
+
+	for (auto& material : library.mMaterials)
+	{
+		bool hasExport = false;
+		for (auto& node : material.mMaterialNodes)
+			hasExport |= node.mType == imageWriteType;
+		if (!hasExport)
+			continue;
+
+		Uint64 materialStart = SDL_GetPerformanceCounter();
+		std::vector<BakeExport> exports;
+		if (!EvaluateExports(material, evaluation, options, backend, exports, failureCount))
+		{
+			printf("%s : unable to build graph\n", material.mName.c_str());
+			failureCount++;
+			continue;
+		}
+		double materialTime = double(SDL_GetPerformanceCounter() - materialStart) / frequency;
+
+		if (options.mbCompare)
+		{
+			std::vector<BakeExport> referenceExports;
+			int referenceFailureCount = 0;
+			EvaluateExports(material, evaluation, options, referenceBackend, referenceExports, referenceFailureCount);
+			for (auto& bakeExport : exports)
+			{
+				if (bakeExport.mbTiled)
+				{
+					printf("    %s : tiled, not compared\n", bakeExport.mParameters.mFilename);
+					continue;
+				}
+				int difference = -1;
+				for (auto& referenceExport : referenceExports)
+				{
+					if (!strcmp(referenceExport.mParameters.mFilename, bakeExport.mParameters.mFilename))
+						difference = CompareImages(bakeExport.mImage, referenceExport.mImage);
+				}
+				bool match = difference >= 0 && difference <= options.mTolerance;
+				printf("    %s : GLSL/CPU max difference %d/255 %s\n", bakeExport.mParameters.mFilename, difference, match ? "ok" : "MISMATCH");
+				if (!match)
+					failureCount++;
+			}
+			FreeExports(referenceExports);
+		}
+
+		int materialExportCount = 0;
+		for (auto& bakeExport : exports)
+		{
+			plannedPeakBytes = std::max(plannedPeakBytes, bakeExport.mPlannedPeakBytes);
+			actualPeakBytes = std::max(actualPeakBytes, bakeExport.mActualPeakBytes);
+			const ImageWriteParameters& param = bakeExport.mParameters;
+			if (bakeExport.mbTiled)
+			{
+				printf("    %s (%dx%d, tiled)\n", param.mFilename, bakeExport.mImage.mWidth, bakeExport.mImage.mHeight);
+				materialExportCount++;
+			}
+			else if (bakeExport.mImage.mBits && Evaluation::WriteImage(param.mFilename, &bakeExport.mImage, param.mFormat, param.mQuality) == EVAL_OK)
+			{
+				printf("    %s (%dx%d)\n", param.mFilename, bakeExport.mImage.mWidth, bakeExport.mImage.mHeight);
+				materialExportCount++;
+			}
+			else
+			{
+				printf("    unable to write %s\n", param.mFilename);
+				failureCount++;
+			}
+		}
+		FreeExports(exports);
+
+		printf("%s : %d export(s) in %.2f s\n", material.mName.c_str(), materialExportCount, materialTime);
+		exportCount += materialExportCount;
+		bakedMaterialCount++;
+	}
+	evaluation.Clear();
+	printf("Render targets : %d created, %d reused\n", int(gRenderTargetPool.GetCreatedCount()), int(gRenderTargetPool.GetReusedCount()));
+	printf("Render target peak memory : %.1f MB planned, %.1f MB actual\n", double(plannedPeakBytes) / (1024.0 * 1024.0), double(actualPeakBytes) / (1024.0 * 1024.0));
+	gRenderTargetPool.Clear();
+
+	double bakeTime = double(SDL_GetPerformanceCounter() - bakeStart) / frequency;
+	double materialsPerMinute = (bakeTime > 0.0) ? double(bakedMaterialCount) * 60.0 / bakeTime : 0.0;
+	printf("Baked %d material(s), %d export(s), %d failure(s) in %.2f s : %.1f materials/minute\n", bakedMaterialCount, exportCount, failureCount, bakeTime, materialsPerMinute);
+	return failureCount ? 1 : 0;
+}
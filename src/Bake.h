@@ -0,0 +1,65 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#pragma once
+
+#include <string>
+
+struct Library;
+struct Evaluation;
+
+// command line batch bake of every material in a library
+// no ImGui, no editor window. GL context is created hidden.
+struct BakeOptions
+{
+	BakeOptions() : mLibraryFilename("library.dat"), mWidth(0), mHeight(0), mbCPU(false), mbCompare(false), mTolerance(2), mbSerial(false), mbNoFusion(false), mPoolBudget(256), mTileSize(0), mBenchPrecisionSize(0), mBenchBindingsDrawCount(0) {}
+
+	std::string mLibraryFilename;
+	// 0 means use the size set in each ImageWrite node
+	int mWidth;
+	int mHeight;
+	// -cpu : GLSL nodes are evaluated with their CPU kernel. No GL context is created
+	bool mbCPU;
+	// -compare : every export is evaluated with both backends. Bake fails if a channel differs more than mTolerance (0..255)
+	bool mbCompare;
+	int mTolerance;
+	// -serial : stages are evaluated one after the other, in graph order
+	bool mbSerial;
+	// -nofusion : chains of per-pixel GLSL nodes get one pass and one target per node, like in the editor
+	bool mbNoFusion;
+	// -poolbudget : MB of released render targets kept for reuse between exports and materials
+	int mPoolBudget;
+	// -tile : exports are rendered by tiles of that size and streamed to TGA. Exports bigger than 4096 are always tiled
+	int mTileSize;
+	// -benchprecisions : no bake, prints memory and bandwidth of each node precision at that size
+	int mBenchPrecisionSize;
+	// -benchbindings : no bake, prints the per draw cost of the GLSL bindings over that many draws
+	int mBenchBindingsDrawCount;
+};
+
+// returns true when arguments ask for a bake. Unknown arguments are ignored.
+bool ParseBakeOptions(int argc, char** argv, BakeOptions& options);
+// evaluates all the ImageWrite nodes of every material. returns process exit code
+int BakeLibrary(Library& library, Evaluation& evaluation, const BakeOptions& options);
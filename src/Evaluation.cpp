@@ -24,48 +24,53 @@
 //
 
 #include "Evaluation.h"
+#include "TaskScheduler.h"
+#include "Trace.h"
+#include "ProgramCache.h"
 #include <vector>
 #include <algorithm>
 #include <map>
 
+extern enki::TaskScheduler g_TS;
 
 std::string Evaluation::GetEvaluator(const std::string& filename)
 {
 	return mEvaluatorScripts[filename].mText;
 }
 
-Evaluation::Evaluation() : mDirtyCount(0), mEvaluationMode(-1), mEvaluationStateGLSLBuffer(0), mProgressShader(0), mDisplayCubemapShader(0)
+Evaluation::Evaluation() : mDirtyCount(0), mEvaluationMode(0), mBackend(BACKEND_GLSL), mbParallelEvaluation(true), mbParallelShaderCompile(false), mEvaluatorsTicks(0), mbEvaluatorsReadyLogged(true), mBoundSamplerCount(0), mDirtyVisitStamp(0), mPlannedPeakBytes(0), mActualPeakBytes(0), mbShaderFusion(true), mTileSize(1024), mbTiling(false), mMaxTextureSize(4096), mbProfiling(false), mResultCacheBudget(128 << 20), mResultCacheBytes(0), mResultCacheHits(0), mResultCacheMisses(0), mResultCacheClock(0), mContentVersion(0), mbProgressive(true), mProgressiveShift(0), mLastEditTicks(0), mLastProgressiveTicks(0), mProgressiveFrameTime(0.f), mEvaluationBudget(0.f), mbDemandEvaluation(false), mProgressShader(0), mDisplayCubemapShader(0), mProgramCacheFilename("ProgramCache.bin")
 {
-	
+	mTileRect[0] = mTileRect[1] = 0.f;
+	mTileRect[2] = mTileRect[3] = 1.f;
+	memset(&mUniformRing, 0, sizeof(UniformRing));
 }
 
 void Evaluation::Init()
 {
-	APIInit();
+	if (mBackend == BACKEND_GLSL)
+	{
+		if (!mProgramCacheFilename.empty())
+			ProgramCacheOpen(mProgramCacheFilename.c_str());
+		APIInit();
+	}
 }
 
 void Evaluation::Finish()
 {
-
+	ClearReadbacks();
+	ClearUploads();
+	ClearGLSLBindings();
+	ClearResultCache();
+	ProgramCacheClose();
+	g_TS.WaitforAll();
+	ClearParallelForJobs();
 }
 
 size_t Evaluation::AddEvaluation(size_t nodeType, const std::string& nodeName)
 {
 	EvaluationStage evaluation;
-	evaluation.mTarget = NULL;
-	evaluation.mUseCountByOthers = 0;
-	evaluation.mbDirty = true;
-	evaluation.mbForceEval = false;
-	evaluation.mbProcessing = false;
-	evaluation.mbFreeSizing = true;
 	evaluation.mNodeType = nodeType;
-	evaluation.mParametersBuffer = 0;
-	evaluation.mEvaluationMask = 0;
-	evaluation.mBlendingSrc = ONE;
-	evaluation.mBlendingDst = ZERO;
-#ifdef _DEBUG
 	evaluation.mNodeTypename = nodeName;
-#endif
 
 	bool valid(false);
 	auto iter = mEvaluatorScripts.find(nodeName+".glsl");
@@ -73,9 +78,13 @@ size_t Evaluation::AddEvaluation(size_t nodeType, const std::string& nodeName)
 	{
 		evaluation.mEvaluationMask |= EvaluationGLSL;
 		iter->second.mNodeType = int(nodeType);
-		evaluation.mTarget = new RenderTarget;
-		mAllocatedRenderTargets.push_back(evaluation.mTarget);
+		// the first node of that type starts compiling the program
+		if (mBackend == BACKEND_GLSL && iter->second.mCompileState == ProgramNotCompiled)
+			BeginScriptProgram(iter->first, iter->second);
+		CreateStageTarget(evaluation);
 		mEvaluatorPerNodeType[nodeType].mGLSLProgram = iter->second.mProgram;
+		mEvaluatorPerNodeType[nodeType].mSamplerCount = iter->second.mSamplerCount;
+		mEvaluatorPerNodeType[nodeType].mCPUKernel = GetCPUKernel(nodeName);
 		valid = true;
 	}
 	iter = mEvaluatorScripts.find(nodeName + ".c");
@@ -101,8 +110,20 @@ size_t Evaluation::AddEvaluation(size_t nodeType, const std::string& nodeName)
 void Evaluation::DelEvaluationTarget(size_t target)
 {
 	SetTargetDirty(target);
+	if (IsResultCacheEnabled(EvaluationInfo()))
+		StoreResult(target, false);
 	EvaluationStage& ev = mEvaluationStages[target];
 	ev.Clear();
+	if (ev.mTarget)
+	{
+		auto iter = std::find(mAllocatedRenderTargets.begin(), mAllocatedRenderTargets.end(), ev.mTarget);
+		if (iter != mAllocatedRenderTargets.end())
+		{
+			mAllocatedRenderTargets.erase(iter);
+			ev.mTarget->Release();
+			delete ev.mTarget;
+		}
+	}
 	mEvaluationStages.erase(mEvaluationStages.begin() + target);
 
 	// shift all connections
@@ -114,6 +135,29 @@ void Evaluation::DelEvaluationTarget(size_t target)
 				inp--;
 		}
 	}
+	RebuildChildren();
+}
+
+void Evaluation::RemoveChild(size_t source, size_t child)
+{
+	auto& children = mEvaluationStages[source].mChildren;
+	auto iter = std::find(children.begin(), children.end(), child);
+	if (iter != children.end())
+		children.erase(iter);
+}
+
+void Evaluation::RebuildChildren()
+{
+	for (auto& evaluation : mEvaluationStages)
+		evaluation.mChildren.clear();
+	for (size_t i = 0; i < mEvaluationStages.size(); i++)
+	{
+		for (auto inp : mEvaluationStages[i].mInput.mInputs)
+		{
+			if (inp >= 0)
+				mEvaluationStages[inp].mChildren.push_back(i);
+		}
+	}
 }
 
 unsigned int Evaluation::GetEvaluationTexture(size_t target)
@@ -129,150 +173,746 @@ void Evaluation::SetEvaluationParameters(size_t target, void *parameters, size_t
 	stage.mParameters = parameters;
 	stage.mParametersSize = parametersSize;
 
-	if (stage.mEvaluationMask&EvaluationGLSL)
-		BindGLSLParameters(stage);
-
 	SetTargetDirty(target);
 }
 
 void Evaluation::PerformEvaluationForNode(size_t index, int width, int height, bool force, EvaluationInfo& evaluationInfo)
 {
 	EvaluationStage& evaluation = mEvaluationStages[index];
+	evaluation.mbDeferred = false;
 	
 	if (force)
 	{
 		evaluation.mbForceEval = true;
 		SetTargetDirty(index);
 	}
+	// a fused chain reads the inputs of its first stage
+	const FusedChain *fusedChain = GetFusedChain(index);
+	const Input& input = fusedChain ? mEvaluationStages[fusedChain->mStages[0]].mInput : evaluation.mInput;
 	// check processing 
-	for (auto& inp : evaluation.mInput.mInputs)
+	for (auto& inp : input.mInputs)
 	{
 		if (inp >= 0)
 		{
 			if (mEvaluationStages[inp].mbProcessing)
 			{
 				evaluation.mbProcessing = true;
+				// an input waiting for its program is evaluated in a next frame, so is this stage
+				evaluation.mbDeferred = mEvaluationStages[inp].mbDeferred;
 				return;
 			}
 		}
 	}
 
+	// program still compiling, the node shows the processing animation until a next frame.
+	// Baking, forced and ui evaluations wait for it
+	if ((evaluation.mEvaluationMask&EvaluationGLSL) && mBackend == BACKEND_GLSL && !fusedChain
+		&& !PrepareNodeProgram(evaluation.mNodeType, force || mEvaluationMode == 1 || evaluationInfo.uiPass != 0))
+	{
+		evaluation.mbProcessing = true;
+		evaluation.mbDeferred = true;
+		return;
+	}
+
 	evaluation.mbProcessing = false;
 
 	// good to go
+	TRACE_SCOPE(evaluation.mNodeTypename.c_str(), "evaluation", int(index));
+	if (IsResultCacheEnabled(evaluationInfo) && BeginCachedEvaluation(index, width, height))
+		return;
+	uint64_t startTicks = 0;
+	if (mbProfiling)
+	{
+		startTicks = GetProfilerTicks();
+		if (evaluation.mEvaluationMask&EvaluationC)
+		{
+			std::lock_guard<std::mutex> lock(mJobTimesMutex);
+			mJobTimes[index] = 0.f;
+		}
+	}
 	if (evaluation.mEvaluationMask&EvaluationC)
+	{
+		// jobs started by the node are timed for it
+		int jobStage = GetJobStage();
+		SetJobStage(int(index));
 		EvaluateC(evaluation, index, evaluationInfo);
+		SetJobStage(jobStage);
+	}
 	if (evaluation.mEvaluationMask&EvaluationGLSL)
-		EvaluateGLSL(evaluation, evaluationInfo);
+	{
+		if (mBackend == BACKEND_CPU)
+			EvaluateCPU(evaluation, evaluationInfo);
+		else
+		{
+			// GPU time is also the cost estimate of budgeted evaluation
+			bool timed = (mbProfiling || mEvaluationBudget > 0.f) && !evaluationInfo.uiPass && BeginGPUTimer(evaluation);
+			EvaluateGLSL(evaluation, evaluationInfo, fusedChain);
+			if (timed)
+				EndGPUTimer(evaluation);
+		}
+	}
+	if (mbProfiling)
+		evaluation.mTimings.mCPUTime = GetProfilerTime(startTicks);
 }
 
-void Evaluation::SetEvaluationMemoryMode(int evaluationMode)
+void Evaluation::SetBackend(EvaluationBackend backend)
 {
-	if (evaluationMode == mEvaluationMode)
+	if (backend == mBackend)
 		return;
+	mBackend = backend;
 
-	mEvaluationMode = evaluationMode;
-	// free previously allocated RT
-
+	// targets content belongs to the previous backend
 	for (auto* rt : mAllocatedRenderTargets)
+		rt->Release();
+	for (size_t i = 0; i < mEvaluationStages.size(); i++)
+	{
+		EvaluationStage& evaluation = mEvaluationStages[i];
+		if (evaluation.mTarget)
+			evaluation.mTarget->Release();
+		evaluation.mContentHash = 0;
+		SetTargetDirty(i);
+	}
+	// CPU stages release and trim the pool from workers, that have no GL context
+	if (mBackend == BACKEND_CPU)
+		gRenderTargetPool.ClearGLSurfaces();
+	ClearResultCache();
+}
+
+bool Evaluation::StageSupportsCPU(size_t target) const
+{
+	const EvaluationStage& evaluation = mEvaluationStages[target];
+	if (!(evaluation.mEvaluationMask&EvaluationGLSL))
+		return true;
+	return mEvaluatorPerNodeType[evaluation.mNodeType].mCPUKernel != NULL;
+}
+
+void Evaluation::InitTarget(RenderTarget *target, int width, int height, uint8_t format)
+{
+	if (mBackend == BACKEND_CPU)
+		target->InitCPUBuffer(width, height);
+	else
+		target->InitBuffer(width, height, format);
+}
+
+RenderTarget *Evaluation::CreateStageTarget(EvaluationStage& evaluationStage)
+{
+	std::lock_guard<std::mutex> lock(mTargetMutex);
+	evaluationStage.mTarget = new RenderTarget;
+	if (mEvaluationMode != 1)
+		mAllocatedRenderTargets.push_back(evaluationStage.mTarget);
+	else
+		mBakingRenderTargets.push_back(evaluationStage.mTarget);
+	return evaluationStage.mTarget;
+}
+
+void Evaluation::ReleaseRenderTargets(std::vector<RenderTarget*>& renderTargets)
+{
+	for (auto* rt : renderTargets)
 	{
-		rt->Destroy();
+		rt->Release();
 		delete rt;
 	}
-	mAllocatedRenderTargets.clear();
+	renderTargets.clear();
+}
+
+void Evaluation::SetEvaluationMemoryMode(int evaluationMode, int width, int height)
+{
+	if (evaluationMode == mEvaluationMode)
+		return;
+
+	mEvaluationMode = evaluationMode;
 
 	if (evaluationMode == 0) // edit mode
 	{
+		// baking surfaces go back to the pool. Edit targets were not touched
+		ReleaseRenderTargets(mBakingRenderTargets);
+		for (size_t i = 0; i < mEvaluationStages.size() && i < mEditRenderTargets.size(); i++)
+			mEvaluationStages[i].mTarget = mEditRenderTargets[i];
+		mEditRenderTargets.clear();
+		mBakingSizes.clear();
+		mBakingReleases.clear();
+		mFusedChains.clear();
+		mFusedStages.clear();
+	}
+	else // baking mode
+	{
+		mEditRenderTargets.resize(mEvaluationStages.size());
 		for (size_t i = 0; i < mEvaluationStages.size(); i++)
+			mEditRenderTargets[i] = mEvaluationStages[i].mTarget;
+
+		PlanFusedChains();
+		PlanBakingTargets(width, height);
+	}
+	//Log("Using %d allocated buffers.\n", mBakingRenderTargets.size());
+}
+
+// EvaluationBlock and 1 parameter block per stage: 9 blocks, GL 4.3 guarantees 12 to a fragment shader
+// (GL_MAX_FRAGMENT_UNIFORM_BLOCKS), so a chain can't go past 11 stages
+static const size_t MaxFusedStages = 8;
+
+void Evaluation::PlanFusedChains()
+{
+	mFusedChains.clear();
+	mFusedStages.assign(mEvaluationStages.size(), -1);
+	// fused programs don't have the tiled variant
+	if (!mbShaderFusion || mBackend != BACKEND_GLSL || mbTiling)
+		return;
+
+	// readers of each stage in this run
+	std::vector<int> readers(mEvaluationStages.size(), 0);
+	for (auto index : mEvaluationOrderList)
+	{
+		for (auto input : mEvaluationStages[index].mInput.mInputs)
 		{
-			EvaluationStage& evaluation = mEvaluationStages[i];
-			if (evaluation.mEvaluationMask&EvaluationGLSL)
-			{
-				evaluation.mTarget = new RenderTarget;
-				mAllocatedRenderTargets.push_back(evaluation.mTarget);
-			}
-			if (evaluation.mEvaluationMask&EvaluationC)
+			if (input >= 0)
+				readers[input]++;
+		}
+	}
+
+	// free sized GLSL stages all get the baking size, a fused read is the same texel
+	auto fusable = [&](size_t index) {
+		const EvaluationStage& evaluation = mEvaluationStages[index];
+		return evaluation.mEvaluationMask == EvaluationGLSL && evaluation.mbFreeSizing && mFusedStages[index] == -1;
+	};
+
+	// chains are built upward from their last stage
+	for (auto iter = mEvaluationOrderList.rbegin(); iter != mEvaluationOrderList.rend(); ++iter)
+	{
+		const size_t index = *iter;
+		if (!fusable(index))
+			continue;
+		std::vector<size_t> stages(1, index);
+		while (stages.size() < MaxFusedStages)
+		{
+			const EvaluationStage& evaluation = mEvaluationStages[stages.front()];
+			if (!IsPointwiseNode(evaluation.mNodeType))
+				break;
+			const int source = evaluation.mInput.mInputs[0];
+			bool otherInputs = false;
+			for (size_t i = 1; i < 8; i++)
+				otherInputs |= evaluation.mInput.mInputs[i] >= 0;
+			if (source < 0 || otherInputs || readers[source] != 1 || !fusable(source))
+				break;
+			// only the last stage can blend with the target content
+			const EvaluationStage& sourceEvaluation = mEvaluationStages[source];
+			if (sourceEvaluation.mBlendingSrc != ONE || sourceEvaluation.mBlendingDst != ZERO)
+				break;
+			// generated functions and blocks are named after the node types
+			bool sameType = false;
+			for (auto stage : stages)
+				sameType |= mEvaluationStages[stage].mNodeType == sourceEvaluation.mNodeType;
+			if (sameType)
+				break;
+			stages.insert(stages.begin(), size_t(source));
+		}
+
+		FusedChain chain;
+		if (stages.size() < 2 || !GetFusedProgram(stages, chain.mProgram))
+			continue;
+		chain.mStages = stages;
+		for (size_t i = 0; i < stages.size() - 1; i++)
+			mFusedStages[stages[i]] = FusedAway;
+		mFusedStages[index] = int(mFusedChains.size());
+		mFusedChains.push_back(chain);
+	}
+}
+
+const Evaluation::FusedChain* Evaluation::GetFusedChain(size_t index) const
+{
+	if (index >= mFusedStages.size() || mFusedStages[index] < 0)
+		return NULL;
+	return &mFusedChains[mFusedStages[index]];
+}
+
+void Evaluation::PlanBakingTargets(int width, int height)
+{
+	const int orderCount = int(mEvaluationOrderList.size());
+
+	// stages of a fused chain read their inputs when the last stage of the chain is evaluated
+	std::vector<int> readPosition(orderCount);
+	for (int i = 0; i < orderCount; i++)
+		readPosition[i] = i;
+	for (auto& chain : mFusedChains)
+	{
+		for (auto stage : chain.mStages)
+			readPosition[mEvaluationStages[stage].mOrderPosition] = mEvaluationStages[chain.mStages.back()].mOrderPosition;
+	}
+
+	// last order position reading each stage. Stages nobody reads, like the evaluated one, live until the end
+	std::vector<int> lastUse(mEvaluationStages.size(), -1);
+	for (int i = 0; i < orderCount; i++)
+	{
+		size_t index = mEvaluationOrderList[i];
+		lastUse[index] = std::max(lastUse[index], i);
+		for (auto input : mEvaluationStages[index].mInput.mInputs)
+		{
+			if (input >= 0)
+				lastUse[input] = std::max(lastUse[input], readPosition[i]);
+		}
+	}
+
+	mBakingSizes.resize(mEvaluationStages.size());
+	for (int i = 0; i < orderCount; i++)
+	{
+		size_t index = mEvaluationOrderList[i];
+		if (lastUse[index] == i)
+			lastUse[index] = orderCount;
+
+		BakingSize& size = mBakingSizes[index];
+		size.mWidth = width;
+		size.mHeight = height;
+		size.mFaces = 1;
+		size.mFormat = (mBackend == BACKEND_CPU) ? int(TextureFormat::RGBA8) : int(mEvaluationStages[index].mOutputFormat);
+		const RenderTarget* editTarget = mEvaluationStages[index].mTarget;
+		if (!mEvaluationStages[index].mbFreeSizing && editTarget && editTarget->mImage.mWidth)
+		{
+			size.mWidth = editTarget->mImage.mWidth;
+			size.mHeight = editTarget->mImage.mHeight;
+			size.mFaces = editTarget->mImage.mNumFaces;
+			size.mFormat = editTarget->mImage.mFormat;
+		}
+	}
+
+	// a buffer is reused by a stage of the same size once its last reader is evaluated. Reuse follows
+	// the order list, so only the serial evaluation can share
+	struct PlannedBuffer
+	{
+		RenderTarget *mTarget;
+		BakingSize mSize;
+		size_t mBytes;
+		int mFirstUse;
+		int mLastUse;
+	};
+	std::vector<PlannedBuffer> buffers;
+	const bool shareTargets = !(mbParallelEvaluation && mBackend == BACKEND_CPU);
+	for (int i = 0; i < orderCount; i++)
+	{
+		size_t index = mEvaluationOrderList[i];
+		EvaluationStage& evaluation = mEvaluationStages[index];
+		const BakingSize& size = mBakingSizes[index];
+		// no target, the stage is evaluated by its chain
+		if (IsFusedAway(index))
+		{
+			evaluation.mTarget = NULL;
+			continue;
+		}
+
+		PlannedBuffer *buffer = NULL;
+		for (auto& candidate : buffers)
+		{
+			if (shareTargets && candidate.mLastUse < i && candidate.mSize == size)
 			{
-				evaluation.mTarget = 0;
+				buffer = &candidate;
+				break;
 			}
 		}
+		if (buffer)
+		{
+			evaluation.mTarget = buffer->mTarget;
+		}
+		else
+		{
+			PlannedBuffer newBuffer;
+			newBuffer.mTarget = CreateStageTarget(evaluation);
+			newBuffer.mSize = size;
+			newBuffer.mBytes = size_t(size.mWidth) * size.mHeight * size.mFaces * GetTexelSize(uint8_t(size.mFormat));
+			newBuffer.mFirstUse = i;
+			buffers.push_back(newBuffer);
+			buffer = &buffers.back();
+		}
+		// parallel evaluation keeps every buffer until the end of the run
+		buffer->mLastUse = shareTargets ? lastUse[index] : orderCount;
 	}
-	else // baking mode
+
+	mBakingReleases.clear();
+	mBakingReleases.resize(orderCount);
+	mPlannedPeakBytes = 0;
+	mActualPeakBytes = 0;
+	for (int i = 0; i < orderCount; i++)
 	{
-		std::vector<RenderTarget*> freeRenderTargets;
-		std::vector<int> useCount(mEvaluationStages.size(), 0);
-		for (size_t i = 0; i < mEvaluationStages.size(); i++)
+		size_t liveBytes = 0;
+		for (auto& buffer : buffers)
 		{
-			useCount[i] = mEvaluationStages[i].mUseCountByOthers;
+			if (buffer.mFirstUse <= i && i <= buffer.mLastUse)
+				liveBytes += buffer.mBytes;
 		}
+		mPlannedPeakBytes = std::max(mPlannedPeakBytes, liveBytes);
+	}
+	for (auto& buffer : buffers)
+	{
+		if (buffer.mLastUse < orderCount)
+			mBakingReleases[buffer.mLastUse].push_back(buffer.mTarget);
+	}
+}
+
+std::vector<uint8_t> Evaluation::GetDirtyStates() const
+{
+	std::vector<uint8_t> dirtyStates(mEvaluationStages.size());
+	for (size_t i = 0; i < dirtyStates.size(); i++)
+	{
+		const EvaluationStage& evaluation = mEvaluationStages[i];
+		dirtyStates[i] = (evaluation.mbDirty ? 1 : 0) | (evaluation.mbForceEval ? 2 : 0);
+	}
+	return dirtyStates;
+}
 
-		for (size_t i = 0; i < mEvaluationOrderList.size(); i++)
+void Evaluation::SetDirtyStates(const std::vector<uint8_t>& dirtyStates)
+{
+	mDirtyCount = 0;
+	for (size_t i = 0; i < dirtyStates.size() && i < mEvaluationStages.size(); i++)
+	{
+		EvaluationStage& evaluation = mEvaluationStages[i];
+		evaluation.mbDirty = (dirtyStates[i] & 1) != 0;
+		evaluation.mbForceEval = (dirtyStates[i] & 2) != 0;
+		if (evaluation.mbDirty)
+			mDirtyCount++;
+	}
+}
+
+void Evaluation::UpdateBakingPeak()
+{
+	size_t bytes = 0;
+	for (auto* rt : mBakingRenderTargets)
+		bytes += rt->GetSurfaceSize();
+	mActualPeakBytes = std::max(mActualPeakBytes, bytes);
+}
+
+void Evaluation::ReleaseBakingTargets(size_t orderPosition)
+{
+	UpdateBakingPeak();
+	if (orderPosition >= mBakingReleases.size())
+		return;
+	for (auto* rt : mBakingReleases[orderPosition])
+		rt->Release();
+}
+
+void Evaluation::AllocateStageTarget(size_t index, int width, int height)
+{
+	EvaluationStage& evaluationStage = mEvaluationStages[index];
+	RenderTarget *target = evaluationStage.mTarget;
+	if (!target)
+		return;
+	if (mEvaluationMode == 1 && index < mBakingSizes.size())
+	{
+		// shared baking buffers get the planned size back, a node may have resized it
+		const BakingSize& size = mBakingSizes[index];
+		if (size.mFaces == 6 && mBackend == BACKEND_GLSL)
+			target->InitCube(size.mWidth, uint8_t(size.mFormat));
+		else
+			InitTarget(target, size.mWidth, size.mHeight, uint8_t(size.mFormat));
+		return;
+	}
+	if (!target->mGLTexID && !target->mImage.mBits)
+	{
+		InitTarget(target, width, height, evaluationStage.mOutputFormat);
+	}
+	else if (evaluationStage.mbFreeSizing && (target->mImage.mWidth != width || target->mImage.mHeight != height))
+	{
+		// progressive preview changed the size. The content is kept by the result cache
+		if (IsResultCacheEnabled(EvaluationInfo()))
+			StoreResult(index, false);
+		evaluationStage.mContentHash = 0;
+		InitTarget(target, width, height, evaluationStage.mOutputFormat);
+	}
+	evaluationStage.mResolutionShift = evaluationStage.mbFreeSizing ? mProgressiveShift : 0;
+}
+
+bool Evaluation::StageRunsOnWorker(const EvaluationStage& evaluationStage, bool forceEvaluation) const
+{
+	if (mBackend != BACKEND_CPU)
+		return false;
+	// forced C nodes evaluate other nodes or edit the library (ImageWrite, Thumbnail)
+	if (evaluationStage.mEvaluationMask&EvaluationC)
+		return !forceEvaluation && !evaluationStage.mbForceEval;
+	return true;
+}
+
+struct StageTaskSet final : enki::ITaskSet
+{
+	StageTaskSet(Evaluation& evaluation, size_t index, int width, int height, const EvaluationInfo& evaluationInfo) : enki::ITaskSet()
+		, mEvaluation(evaluation)
+		, mIndex(index)
+		, mWidth(width)
+		, mHeight(height)
+		, mEvaluationInfo(evaluationInfo)
+	{
+	}
+	virtual void    ExecuteRange(enki::TaskSetPartition, uint32_t)
+	{
+		mEvaluation.PerformEvaluationForNode(mIndex, mWidth, mHeight, false, mEvaluationInfo);
+	}
+	Evaluation& mEvaluation;
+	size_t mIndex;
+	int mWidth;
+	int mHeight;
+	EvaluationInfo mEvaluationInfo;
+};
+
+void Evaluation::RunEvaluationParallel(int width, int height, bool forceEvaluation, const EvaluationInfo& evaluationInfo)
+{
+	// stages evaluated by this run and the count of their inputs not evaluated yet. -1 for the others.
+	std::vector<int> pendingInputs(mEvaluationStages.size(), -1);
+	std::vector<size_t> stages;
+	for (auto index : mEvaluationOrderList)
+	{
+		if (mEvaluationStages[index].mbDirty || forceEvaluation)
+		{
+			pendingInputs[index] = 0;
+			stages.push_back(index);
+		}
+	}
+	std::vector<size_t> readyStages;
+	for (auto index : stages)
+	{
+		for (auto inp : mEvaluationStages[index].mInput.mInputs)
 		{
-			size_t index = mEvaluationOrderList[i];
+			if (inp >= 0 && pendingInputs[inp] >= 0)
+				pendingInputs[index]++;
+		}
+		if (!pendingInputs[index])
+			readyStages.push_back(index);
+	}
 
-			EvaluationStage& evaluation = mEvaluationStages[index];
-			if (!evaluation.mUseCountByOthers)
-				continue;
+	std::vector<size_t> mainThreadStages;
+	std::vector<StageTaskSet*> runningTasks;
+	size_t remaining = stages.size();
+	auto completeStage = [&](size_t index)
+	{
+		remaining--;
+		for (auto child : mEvaluationStages[index].mChildren)
+		{
+			if (pendingInputs[child] > 0 && !--pendingInputs[child])
+				readyStages.push_back(child);
+		}
+	};
 
-			if (freeRenderTargets.empty())
+	while (remaining)
+	{
+		for (auto index : readyStages)
+		{
+			EvaluationStage& evaluation = mEvaluationStages[index];
+			if (!StageRunsOnWorker(evaluation, forceEvaluation))
 			{
-				evaluation.mTarget = new RenderTarget();
-				mAllocatedRenderTargets.push_back(evaluation.mTarget);
+				mainThreadStages.push_back(index);
+				continue;
 			}
-			else
+			AllocateStageTarget(index, width, height);
+			StageTaskSet *task = new StageTaskSet(*this, index, width, height, evaluationInfo);
+			runningTasks.push_back(task);
+			g_TS.AddTaskSetToPipe(task);
+		}
+		readyStages.clear();
+
+		if (!mainThreadStages.empty())
+		{
+			size_t index = mainThreadStages.front();
+			mainThreadStages.erase(mainThreadStages.begin());
+			AllocateStageTarget(index, width, height);
+			EvaluationInfo mainEvaluationInfo = evaluationInfo;
+			PerformEvaluationForNode(index, width, height, false, mainEvaluationInfo);
+			completeStage(index);
+			continue;
+		}
+
+		bool progress = false;
+		for (size_t i = 0; i < runningTasks.size();)
+		{
+			StageTaskSet *task = runningTasks[i];
+			if (!task->GetIsComplete())
 			{
-				evaluation.mTarget = freeRenderTargets.back();
-				freeRenderTargets.pop_back();
+				i++;
+				continue;
 			}
+			completeStage(task->mIndex);
+			delete task;
+			runningTasks.erase(runningTasks.begin() + i);
+			progress = true;
+		}
+		if (progress)
+			continue;
 
-			const Input& input = evaluation.mInput;
-			for (size_t inputIndex = 0; inputIndex < 8; inputIndex++)
+		if (runningTasks.empty())
+		{
+			// order list is not a valid topological order. Go on with the first stage left, like the serial order would
+			for (auto index : stages)
 			{
-				int targetIndex = input.mInputs[inputIndex];
-				if (targetIndex == -1)
-					continue;
-				
-				useCount[targetIndex]--;
-				if (!useCount[targetIndex])
+				if (pendingInputs[index] > 0)
 				{
-					freeRenderTargets.push_back(mEvaluationStages[targetIndex].mTarget);
+					pendingInputs[index] = 0;
+					readyStages.push_back(index);
+					break;
 				}
 			}
 		}
-		
+		else
+		{
+			// help the workers while waiting
+			g_TS.WaitforTask(NULL);
+		}
+	}
+}
+
+void Evaluation::GetUpstreamStages(const std::vector<size_t>& targets, std::vector<uint8_t>& upstream) const
+{
+	upstream.assign(mEvaluationStages.size(), 0);
+	std::vector<size_t> stack;
+	for (auto target : targets)
+	{
+		if (target < mEvaluationStages.size())
+			stack.push_back(target);
+	}
+	while (!stack.empty())
+	{
+		size_t index = stack.back();
+		stack.pop_back();
+		if (upstream[index])
+			continue;
+		upstream[index] = 1;
+		for (auto input : mEvaluationStages[index].mInput.mInputs)
+		{
+			if (input >= 0)
+				stack.push_back(input);
+		}
+	}
+}
+
+void Evaluation::RunEvaluationBudgeted(int width, int height, EvaluationInfo& evaluationInfo, const std::vector<uint8_t>& demanded)
+{
+	std::vector<uint8_t> priority;
+	GetUpstreamStages(mPriorityTargets, priority);
+
+	// both passes keep the evaluation order. Priority stages only depend on priority stages
+	std::vector<size_t> stages;
+	for (int pass = 1; pass >= 0; pass--)
+	{
+		for (auto index : mEvaluationOrderList)
+		{
+			if (!mEvaluationStages[index].mbDirty || priority[index] != pass)
+				continue;
+			if (!demanded.empty() && !demanded[index])
+				mEvaluationStages[index].mbDeferred = true;
+			else
+				stages.push_back(index);
+		}
+	}
+
+	// at least one stage is evaluated per call, the graph goes on even if a stage is over the budget
+	const uint64_t startTicks = GetProfilerTicks();
+	float gpuTime = 0.f;
+	bool outOfBudget = false;
+	for (auto index : stages)
+	{
+		EvaluationStage& evaluation = mEvaluationStages[index];
+		if (outOfBudget)
+		{
+			evaluation.mbDeferred = true;
+			continue;
+		}
+		AllocateStageTarget(index, width, height);
+		PerformEvaluationForNode(index, width, height, false, evaluationInfo);
+		gpuTime += evaluation.mTimings.mGPUTime;
+		outOfBudget = (GetProfilerTime(startTicks) + gpuTime) >= mEvaluationBudget;
+	}
+}
+
+// ms without edit before stages are evaluated at full size
+static const float ProgressiveRefineDelay = 250.f;
+// slower frames while editing use 1/8 of the size
+static const float ProgressiveFrameBudget = 33.f;
+
+void Evaluation::MarkInteractiveEdit()
+{
+	if (mbProgressive)
+		mLastEditTicks = GetProfilerTicks();
+}
+
+void Evaluation::UpdateProgressiveShift(bool forceEvaluation)
+{
+	mProgressiveShift = 0;
+	if (!mLastEditTicks || mEvaluationMode != 0 || forceEvaluation)
+		return;
+	if (GetProfilerTime(mLastEditTicks) < ProgressiveRefineDelay)
+	{
+		// frame time includes the wait for the GPU at swap, it's what the user sees
+		if (mLastProgressiveTicks)
+			mProgressiveFrameTime = GetProfilerTime(mLastProgressiveTicks);
+		mLastProgressiveTicks = GetProfilerTicks();
+		mProgressiveShift = (mProgressiveFrameTime > ProgressiveFrameBudget) ? 3 : 2;
+		return;
+	}
+	// edits are done, reduced stages are evaluated again at full size
+	mLastEditTicks = 0;
+	mLastProgressiveTicks = 0;
+	mProgressiveFrameTime = 0.f;
+	for (size_t i = 0; i < mEvaluationStages.size(); i++)
+	{
+		if (mEvaluationStages[i].mResolutionShift)
+			SetTargetDirty(i);
 	}
-	//Log("Using %d allocated buffers.\n", mAllocatedRenderTargets.size());
 }
 
 void Evaluation::RunEvaluation(int width, int height, bool forceEvaluation)
 {
+	TRACE_SCOPE("RunEvaluation", "evaluation");
+	if (mbProfiling || mEvaluationBudget > 0.f)
+		CollectGPUTimings();
+	if (!mPendingDiskResults.empty())
+		WritePendingDiskResults();
 	if (mEvaluationOrderList.empty())
 		return;
+	UpdateProgressiveShift(forceEvaluation);
 	if (!mDirtyCount && !forceEvaluation)
 		return;
+	width = std::max(width >> mProgressiveShift, 8);
+	height = std::max(height >> mProgressiveShift, 8);
 
 	EvaluationInfo evaluationInfo;
 	evaluationInfo.forcedDirty = forceEvaluation ? 1 : 0;
 	evaluationInfo.uiPass = 0;
-	for (size_t i = 0; i < mEvaluationOrderList.size(); i++)
+	memcpy(evaluationInfo.tileRect, mTileRect, sizeof(mTileRect));
+	if (mbParallelEvaluation && mBackend == BACKEND_CPU)
 	{
-		size_t index = mEvaluationOrderList[i];
-
-		EvaluationStage& evaluation = mEvaluationStages[index];
-		if (!evaluation.mbDirty && !forceEvaluation)
-			continue;
+		RunEvaluationParallel(width, height, forceEvaluation, evaluationInfo);
+		if (mEvaluationMode == 1)
+			UpdateBakingPeak();
+	}
+	else
+	{
+		// demand mode, stages not used by a sink stay dirty
+		std::vector<uint8_t> demanded;
+		if (mbDemandEvaluation && mEvaluationMode == 0 && !forceEvaluation)
+			GetUpstreamStages(mSinkTargets, demanded);
 
-		if (evaluation.mTarget && !evaluation.mTarget->mGLTexID)
+		if (mEvaluationBudget > 0.f && mEvaluationMode == 0 && !forceEvaluation)
+			RunEvaluationBudgeted(width, height, evaluationInfo, demanded);
+		else
 		{
-			evaluation.mTarget->InitBuffer(width, height);
-		}
+			for (size_t i = 0; i < mEvaluationOrderList.size(); i++)
+			{
+				size_t index = mEvaluationOrderList[i];
 
-		PerformEvaluationForNode(index, width, height, false, evaluationInfo);
+				EvaluationStage& evaluation = mEvaluationStages[index];
+				if (!evaluation.mbDirty && !forceEvaluation)
+					continue;
+				if (!demanded.empty() && !demanded[index])
+				{
+					evaluation.mbDeferred = true;
+					continue;
+				}
+				if (IsFusedAway(index))
+					continue;
+
+				AllocateStageTarget(index, width, height);
+				PerformEvaluationForNode(index, width, height, false, evaluationInfo);
+				if (mEvaluationMode == 1)
+					ReleaseBakingTargets(i);
+			}
+		}
 	}
 
 	for (auto& evaluation : mEvaluationStages)
 	{
-		if (evaluation.mbDirty)
+		if (evaluation.mbDirty && !evaluation.mbDeferred)
 		{
 			evaluation.mbDirty = false;
 			evaluation.mbForceEval = false;
@@ -280,7 +920,8 @@ void Evaluation::RunEvaluation(int width, int height, bool forceEvaluation)
 		}
 	}
 
-	FinishEvaluation();
+	if (mBackend == BACKEND_GLSL)
+		FinishEvaluation();
 }
 
 void Evaluation::SetEvaluationSampler(size_t target, const std::vector<InputSampler>& inputSamplers)
@@ -289,16 +930,35 @@ void Evaluation::SetEvaluationSampler(size_t target, const std::vector<InputSamp
 	SetTargetDirty(target);
 }
 
+void Evaluation::SetEvaluationPrecision(size_t target, int precision)
+{
+	EvaluationStage& stage = mEvaluationStages[target];
+	uint8_t format = GetPrecisionFormat(precision);
+	if (stage.mOutputFormat == format)
+		return;
+	stage.mOutputFormat = format;
+	// the surface is allocated again with the new format by the next evaluation
+	if (stage.mTarget && mBackend == BACKEND_GLSL)
+		stage.mTarget->Release();
+	SetTargetDirty(target);
+}
+
 void Evaluation::AddEvaluationInput(size_t target, int slot, int source)
 {
+	int previousSource = mEvaluationStages[target].mInput.mInputs[slot];
+	if (previousSource >= 0)
+		RemoveChild(previousSource, target);
 	mEvaluationStages[target].mInput.mInputs[slot] = source;
+	mEvaluationStages[source].mChildren.push_back(target);
 	mEvaluationStages[source].mUseCountByOthers++;
 	SetTargetDirty(target);
 }
 
 void Evaluation::DelEvaluationInput(size_t target, int slot)
 {
-	mEvaluationStages[mEvaluationStages[target].mInput.mInputs[slot]].mUseCountByOthers--;
+	int source = mEvaluationStages[target].mInput.mInputs[slot];
+	mEvaluationStages[source].mUseCountByOthers--;
+	RemoveChild(source, target);
 	mEvaluationStages[target].mInput.mInputs[slot] = -1;
 	SetTargetDirty(target);
 }
@@ -306,35 +966,55 @@ void Evaluation::DelEvaluationInput(size_t target, int slot)
 void Evaluation::SetEvaluationOrder(const std::vector<size_t> nodeOrderList)
 {
 	mEvaluationOrderList = nodeOrderList;
+	for (auto& evaluation : mEvaluationStages)
+		evaluation.mOrderPosition = -1;
+	for (size_t i = 0; i < mEvaluationOrderList.size(); i++)
+	{
+		if (mEvaluationOrderList[i] < mEvaluationStages.size())
+			mEvaluationStages[mEvaluationOrderList[i]].mOrderPosition = int(i);
+	}
 }
 
 void Evaluation::SetTargetDirty(size_t target, bool onlyChild)
 {
+	std::lock_guard<std::mutex> lock(mDirtyMutex);
+	if (onlyChild)
+		SetContentWritten(target);
 	if (!mEvaluationStages[target].mbDirty)
 	{
 		if (!onlyChild)
 			mDirtyCount++;
 		mEvaluationStages[target].mbDirty = true;
 	}
-	for (size_t i = 0; i < mEvaluationOrderList.size(); i++)
+
+	// walk the downstream cone. Only stages after the target in the evaluation order are dirtied
+	const int targetPosition = mEvaluationStages[target].mOrderPosition;
+	if (targetPosition >= 0)
 	{
-		if (mEvaluationOrderList[i] != target)
-			continue;
-		
-		for (i++; i < mEvaluationOrderList.size(); i++)
+		if (!++mDirtyVisitStamp)
 		{
-			EvaluationStage& currentEvaluation = mEvaluationStages[mEvaluationOrderList[i]];
-			if (currentEvaluation.mbDirty)
-				continue;
-
-			for (auto inp : currentEvaluation.mInput.mInputs)
+			for (auto& evaluation : mEvaluationStages)
+				evaluation.mDirtyVisit = 0;
+			mDirtyVisitStamp = 1;
+		}
+		mDirtyStack.clear();
+		mDirtyStack.push_back(target);
+		while (!mDirtyStack.empty())
+		{
+			size_t index = mDirtyStack.back();
+			mDirtyStack.pop_back();
+			for (auto child : mEvaluationStages[index].mChildren)
 			{
-				if (inp >= 0 && mEvaluationStages[inp].mbDirty)
+				EvaluationStage& childEvaluation = mEvaluationStages[child];
+				if (childEvaluation.mDirtyVisit == mDirtyVisitStamp || childEvaluation.mOrderPosition <= targetPosition)
+					continue;
+				childEvaluation.mDirtyVisit = mDirtyVisitStamp;
+				if (!childEvaluation.mbDirty)
 				{
 					mDirtyCount++;
-					currentEvaluation.mbDirty = true;
-					break; // at least 1 dirty
+					childEvaluation.mbDirty = true;
 				}
+				mDirtyStack.push_back(child);
 			}
 		}
 	}
@@ -344,9 +1024,19 @@ void Evaluation::SetTargetDirty(size_t target, bool onlyChild)
 
 void Evaluation::Clear()
 {
+	// results of the material stay available for the next one, or when it's selected again
+	if (IsResultCacheEnabled(EvaluationInfo()))
+	{
+		for (size_t i = 0; i < mEvaluationStages.size(); i++)
+			StoreResult(i, false);
+	}
 	for (auto& ev : mEvaluationStages)
 		ev.Clear();
 
+	ReleaseRenderTargets(mBakingRenderTargets);
+	ReleaseRenderTargets(mAllocatedRenderTargets);
+	mEditRenderTargets.clear();
+	mEvaluationMode = 0;
 	mEvaluationStages.clear();
 	mEvaluationOrderList.clear();
 }
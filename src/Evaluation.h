@@ -27,9 +27,11 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <mutex>
 #include "Library.h"
 #include "libtcc/libtcc.h"
 #include "Imogen.h"
+#include "EvaluationCPU.h"
 #include <string.h>
 #include <stdio.h>
 
@@ -65,8 +67,20 @@ enum EvaluationStatus
 	EVAL_ERR,
 };
 
+enum EvaluationBackend
+{
+	BACKEND_GLSL,
+	BACKEND_CPU, // no GL context needed. GLSL nodes use their CPU kernel
+};
+
+// std140 layout of EvaluationBlock in Shader.glsl
 struct EvaluationInfo
 {
+	EvaluationInfo()
+	{
+		memset(this, 0, sizeof(EvaluationInfo));
+		tileRect[2] = tileRect[3] = 1.f;
+	}
 	float viewRot[16];
 
 	int targetIndex;
@@ -75,7 +89,8 @@ struct EvaluationInfo
 	int padding;
 	float mouse[4];
 	int inputIndices[8];
-	float pad2[4];
+	// uv rectangle covered by the target and its inputs. (0,0,1,1) unless evaluation is tiled
+	float tileRect[4];
 	
 	float viewport[2];
 };
@@ -104,6 +119,19 @@ struct TextureFormat
 	};
 };
 
+unsigned int GetTexelSize(uint8_t fmt);
+
+// output precision of a node, as stored in the library
+enum EvaluationPrecision
+{
+	PRECISION_8,
+	PRECISION_16F,
+	PRECISION_32F,
+	PRECISION_COUNT
+};
+// TextureFormat of a precision
+uint8_t GetPrecisionFormat(int precision);
+
 typedef struct Image_t
 {
 	void *mBits;
@@ -123,12 +151,21 @@ public:
 		memset(&mImage, 0, sizeof(Image_t));
 	}
 
-	void InitBuffer(int width, int height);
-	void InitCube(int width);
+	void InitBuffer(int width, int height, uint8_t format = TextureFormat::RGBA8);
+	void InitCube(int width, uint8_t format = TextureFormat::RGBA8);
+	// CPU backend, RGBA8 bits in mImage
+	void InitCPUBuffer(int width, int height);
+	int CopyToCPUBuffer(const Image_t *image);
 	void BindAsTarget() const;
 	void BindAsCubeTarget() const;
 	void BindCubeFace(size_t face);
+	// the 6 faces attached at once, gl_Layer selects the face
+	void BindAsLayeredCubeTarget();
 	void Destroy();
+	// surface goes back to gRenderTargetPool for another target to reuse
+	void Release();
+	// bytes used by the texture or the CPU bits, 0 when nothing is allocated
+	size_t GetSurfaceSize() const;
 	void CheckFBO();
 
 
@@ -138,6 +175,50 @@ public:
 	int mRefCount;
 };
 
+// recycles render target surfaces (texture and FBO, or CPU bits) between stages, memory modes and materials.
+// Surfaces are keyed on size, faces, format and backend. Released surfaces are kept while the pooled size
+// stays under the budget, least recently released ones are destroyed first.
+class RenderTargetPool
+{
+public:
+	RenderTargetPool() : mBudget(256 << 20), mPooledBytes(0), mReleaseIndex(0), mReusedCount(0), mCreatedCount(0) {}
+
+	// gives a matching pooled surface to an empty target. false when the caller has to create it
+	bool Acquire(RenderTarget& target, int width, int height, int faces, int format, bool cpu);
+	void Release(RenderTarget& target);
+	void SetBudget(size_t bytes);
+	size_t GetBudget() const { return mBudget; }
+	size_t GetPooledBytes() const { return mPooledBytes; }
+	size_t GetReusedCount() const { return mReusedCount; }
+	size_t GetCreatedCount() const { return mCreatedCount; }
+	// destroys every pooled surface
+	void Clear();
+	// destroys the pooled GL surfaces. main thread only, CPU workers can't delete them
+	void ClearGLSurfaces();
+
+protected:
+	struct Surface
+	{
+		Image_t mImage;
+		unsigned int mGLTexID;
+		TextureID mFbo;
+		size_t mBytes;
+		unsigned int mReleaseIndex;
+	};
+	std::vector<Surface> mSurfaces;
+	size_t mBudget;
+	size_t mPooledBytes;
+	unsigned int mReleaseIndex;
+	size_t mReusedCount;
+	size_t mCreatedCount;
+	// CPU stages allocate from workers
+	std::mutex mMutex;
+
+	void Trim();
+};
+
+extern RenderTargetPool gRenderTargetPool;
+
 
 // simple API
 struct Evaluation
@@ -147,7 +228,23 @@ struct Evaluation
 	void Init();
 	void Finish();
 
+	// backend must be set before Init. Changing it afterward reallocates targets and dirties every node
+	void SetBackend(EvaluationBackend backend);
+	EvaluationBackend GetBackend() const { return mBackend; }
+	// independent stages run concurrently on enkiTS workers. Only the CPU backend benefits: with GLSL,
+	// every stage needs the GL context of the main thread
+	void SetParallelEvaluation(bool parallel) { mbParallelEvaluation = parallel; }
+	// baking mode: chains of per-pixel GLSL nodes are evaluated by one generated program, without intermediate targets
+	void SetShaderFusion(bool fusion) { mbShaderFusion = fusion; }
+	// output tile size of EvaluateTiled, halos not included
+	void SetTileSize(int tileSize) { mTileSize = tileSize; }
+
+	// GL program binaries are kept in that file between sessions. Empty to compile every program. Set before Init
+	void SetProgramCacheFile(const std::string& filename) { mProgramCacheFilename = filename; }
 	void SetEvaluators(const std::vector<EvaluatorFile>& evaluatorfilenames);
+	// recompiles one evaluator, every GLSL program for Shader.glsl, and dirties the nodes using it.
+	// Programs with errors keep the previous version
+	void ReloadEvaluator(const EvaluatorFile& file);
 	std::string GetEvaluator(const std::string& filename);
 
 	size_t AddEvaluation(size_t nodeType, const std::string& nodeName);
@@ -157,28 +254,95 @@ struct Evaluation
 	void SetEvaluationParameters(size_t target, void *parameters, size_t parametersSize);
 	void PerformEvaluationForNode(size_t index, int width, int height, bool force, EvaluationInfo& evaluationInfo);
 	void SetEvaluationSampler(size_t target, const std::vector<InputSampler>& inputSamplers);
+	// GLSL targets of the node are allocated with that precision. CPU targets are always 8 bits
+	void SetEvaluationPrecision(size_t target, int precision);
 	void AddEvaluationInput(size_t target, int slot, int source);
 	void DelEvaluationInput(size_t target, int slot);
 	void RunEvaluation(int width, int height, bool forceEvaluation);
 	void SetEvaluationOrder(const std::vector<size_t> nodeOrderList);
 	void SetTargetDirty(size_t target, bool onlyChild = false);
 	void SetMouse(int target, float rx, float ry, bool lButDown, bool rButDown);
+	// C nodes are compiled by tcc. Sources with #define IMOGEN_NATIVE are built by the system compiler
+	// into a cached shared object instead, tcc is used when that fails
+	enum CompilerTier
+	{
+		CompilerTCC,
+		CompilerNative,
+		CompilerFromSource,
+	};
+	struct CCompilation
+	{
+		CCompilation() : mTier(CompilerFromSource), mCFunction(0), mMem(0), mbLoaded(false) {}
+		std::string mDirectory;
+		std::string mFilename;
+		// read from mDirectory + mFilename when empty
+		std::string mText;
+		// requested tier, then the one used
+		int mTier;
+		int(*mCFunction)(void *parameters, void *evaluationInfo);
+		void *mMem;
+		bool mbLoaded;
+	};
+	static void CompileC(CCompilation& compilation);
+	static bool CompileNativeC(CCompilation& compilation, const std::vector<std::pair<const char*, void*> >& apiFunctions);
+	// synthetic graph timing of SetTargetDirty against the previous order list scan
+	static int BenchmarkDirtyPropagation(int nodeCount);
+	// wide synthetic graph evaluated with the CPU backend, serial order against parallel scheduling
+	static int BenchmarkParallelEvaluation(int branchCount, int size);
+	// memory, copy, readback and upload cost of each precision. Needs a GL context
+	static int BenchmarkPrecisions(int size);
+	// per draw cost of the GLSL bindings, with uniform lookups and buffer reallocations against the cached ones
+	static int BenchmarkGLSLBindings(int drawCount);
+	// pixel loop C node compiled by tcc and by the system compiler
+	static int BenchmarkNativeC(int size);
+	// timing of the C API image kernels, and a check of the mipmapped cubemap resize
+	static int BenchmarkImageKernels(int size);
 	void Clear();
-	bool StageIsProcessing(size_t target) { return mEvaluationStages[target].mbProcessing; }
+	bool StageIsProcessing(size_t target) { return mEvaluationStages[target].mbProcessing || mEvaluationStages[target].mbDeferred || IsUploading(target); }
 	void StageSetProcessing(size_t target, bool processing) { mEvaluationStages[target].mbProcessing = processing; }
+	// true when the node can be evaluated with BACKEND_CPU
+	bool StageSupportsCPU(size_t target) const;
+	// render target memory of the last Evaluate, as planned before the run and as measured during it
+	size_t GetPlannedPeakBytes() const { return mPlannedPeakBytes; }
+	size_t GetActualPeakBytes() const { return mActualPeakBytes; }
 
 	// API
 	static int ReadImage(const char *filename, Image *image);
 	static int ReadImageMem(unsigned char *data, size_t dataSize, Image *image);
 	static int WriteImage(const char *filename, Image *image, int format, int quality);
 	static int GetEvaluationImage(int target, Image *image);
+	// readback without stall. readbackFunction runs as a job once the pixels are on the CPU, with the image
+	// (free it with FreeImage) and a copy of ptr. Image bits are NULL when the readback failed
+	static int GetEvaluationImageAsync(int target, int(*readbackFunction)(Image*, void*), void *ptr, unsigned int size);
 	static int SetEvaluationImage(int target, Image *image);
 	static int SetEvaluationImageCube(int target, Image *image, int cubeFace);
+	// SetEvaluationImage from any thread. The upload owns the image bits. They are copied to a PBO by a job
+	// and sent to the texture over the next frames, coarsest mip first
+	static int SetEvaluationImageAsync(int target, Image *image);
+	static int SetEvaluationImageCubeAsync(int target, Image *image, int cubeFace);
 	static int SetThumbnailImage(Image *image);
 	static int AllocateImage(Image *image);
 	static int FreeImage(Image *image);
+	// converts bits to another TextureFormat. Float to 8 bits is clamped to [0,1]
+	static int ConvertImage(Image *image, int format);
+	// native kernels for C nodes. RGBA8, BGRA8 and RGBA32F images, pixels are processed in RGBA order
+	static int ResizeImage(Image *image, int width, int height);
+	static int GenerateMips(Image *image);
+	// operation is one of the Blend node operations, destination = mix(destination, blend, opacity)
+	static int BlendImage(Image *destination, const Image *source, int operation, float opacity);
+	static int ConvolveImage(Image *image, const float *kernel, int kernelWidth, int kernelHeight);
+	// 256 bins for red, then green, blue and alpha
+	static int GetImageHistogram(const Image *image, unsigned int *histogram);
+	static int PremultiplyImage(Image *image, int unpremultiply);
+	static int SwizzleImage(Image *image, int red, int green, int blue, int alpha);
+	// false when one of the formats has no kernel
+	static bool ConvertKernelImage(Image *image, int format);
 	static unsigned int UploadImage(Image *image, unsigned int textureId, int cubeFace = -1);
 	static int Evaluate(int target, int width, int height, Image *image);
+	// renders target tile by tile and streams the tiles to a TGA file. For outputs bigger than a texture
+	static int EvaluateTiled(int target, int width, int height, const char *filename);
+	// bigger outputs need EvaluateTiled
+	static int GetMaxTextureSize();
 	static void SetBlendingMode(int target, int blendSrc, int blendDst);
 	static int EncodePng(Image *image, std::vector<unsigned char> &pngImage);
 	static int SetNodeImage(int target, Image *image);
@@ -188,17 +352,115 @@ struct Evaluation
 	static int CubemapFilter(Image *image, int faceSize, int lightingModel, int excludeBase, int glossScale, int glossBias);
 	static int Job(int(*jobFunction)(void*), void *ptr, unsigned int size);
 	static int JobMain(int(*jobMainFunction)(void*), void *ptr, unsigned int size);
+	// chunkFunction(ptr, begin, end) over [0, count) on the workers, then completionFunction(ptr) in a job or on the main thread
+	static int JobParallelFor(int(*chunkFunction)(void*, unsigned int, unsigned int), unsigned int count, unsigned int grain, void *ptr, unsigned int size, int(*completionFunction)(void*), int completionOnMain);
+	// frees the completed JobParallelFor sets. Called once the scheduler has no more tasks
+	static void ClearParallelForJobs();
 	static void SetProcessing(int target, int processing);
 
 	static void NodeUICallBack(const ImDrawList* parent_list, const ImDrawCmd* cmd);
 	// synchronous texture cache
 	// use for simple textures(stock) or to replace with a more efficient one
 	unsigned int GetTexture(const std::string& filename);
+	// starts the jobs of the asynchronous readbacks that are done. Called once per frame.
+	// waitAll blocks until every pending readback is done
+	void ProcessReadbacks(bool waitAll);
+	// sends pending asynchronous uploads to their textures until budgetMs is spent. Called once per frame.
+	void ProcessUploads(unsigned int budgetMs);
+
+	// per node timings. Off by default, it costs a test per evaluated node when off.
+	// GPU time is read back without stall: it comes one or two evaluations late
+	void SetProfiling(bool profiling);
+	bool IsProfiling() const { return mbProfiling; }
+	float GetStageGPUTime(size_t target) const { return mEvaluationStages[target].mTimings.mGPUTime; }
+	float GetStageCPUTime(size_t target) const { return mEvaluationStages[target].mTimings.mCPUTime; }
+	// jobs started by the C function of the node, and by those jobs, since its last evaluation
+	float GetStageJobTime(size_t target);
+	void AddJobTime(int target, float time);
+	// scope of a job started by a C node. Times it for the stage and lets the jobs it starts inherit the stage
+	struct JobTimer
+	{
+		JobTimer(int stage);
+		~JobTimer();
+		int mStage;
+		int mPreviousStage;
+		uint64_t mStart;
+	};
+	// stage evaluated by the calling thread, -1 when none
+	static int GetJobStage();
+	static void SetJobStage(int target);
+
+	// results kept by content hash: node, parameters, samplers, size and the hashes of the inputs. A stage whose
+	// hash is cached takes the cached surface instead of being evaluated. Edit mode with GLSL backend only.
+	// Least recently used results go back to gRenderTargetPool when the cache is over budget. 0 disables it
+	void SetResultCacheBudget(size_t bytes);
+	size_t GetResultCacheBudget() const { return mResultCacheBudget; }
+	size_t GetResultCacheBytes() const { return mResultCacheBytes; }
+	size_t GetResultCacheHits() const { return mResultCacheHits; }
+	size_t GetResultCacheMisses() const { return mResultCacheMisses; }
+	// existing directory where results of expensive C nodes (CubemapFilter) are also written. Empty disables it
+	void SetResultCacheDirectory(const std::string& directory) { mResultCacheDirectory = directory; }
+
+	// progressive preview. While a parameter is dragged, free sized stages are evaluated at 1/4 of the size,
+	// 1/8 when frames get too slow. They are evaluated again at full size once edits stop
+	void SetProgressiveEvaluation(bool progressive) { mbProgressive = progressive; }
+	void MarkInteractiveEdit();
+	// size of the target content as a right shift of the evaluation size. 0 is full size
+	int GetStageResolutionShift(size_t target) const { return mEvaluationStages[target].mResolutionShift; }
+
+	// edit mode evaluation stops once that many ms are spent, dirty stages left are evaluated by the next
+	// RunEvaluation calls. Cost of a stage is its CPU time and its last measured GPU time. 0 for no limit
+	void SetEvaluationBudget(float budgetMs) { mEvaluationBudget = budgetMs; }
+	// stages needed by these targets (preview, extracted views) are evaluated first when evaluation is budgeted
+	void SetPriorityTargets(const std::vector<size_t>& targets) { mPriorityTargets = targets; }
+	// demand mode: in edit mode, only stages upstream of the sink targets (preview, views, visible thumbnails,
+	// exports) are evaluated. The other ones stay dirty until a sink needs them
+	void SetDemandEvaluation(bool demand) { mbDemandEvaluation = demand; }
+	void SetSinkTargets(const std::vector<size_t>& targets) { mSinkTargets = targets; }
 protected:
 	void APIInit();
+
+	// SetEvaluationImageAsync. Jobs push to mIncomingUploads, the main thread moves them to mUploads
+	struct ImageUpload;
+	std::vector<ImageUpload*> mUploads;
+	std::vector<ImageUpload*> mIncomingUploads;
+	std::mutex mUploadMutex;
+	static int QueueUpload(int target, Image *image, int cubeFace);
+	bool IsUploading(size_t target);
+	bool StartUpload(ImageUpload *upload);
+	bool ContinueUpload(ImageUpload *upload, unsigned int startTime, unsigned int budgetMs);
+	void CancelUpload(ImageUpload *upload);
+	void ClearUploads();
+	// target storage for an image, mips included. Pixels are not set
+	void InitImageTarget(size_t target, const Image *image, int cubeFace);
+
+	// GetEvaluationImageAsync. Pixels are packed in a PBO, fence tells when they can be mapped
+	struct Readback
+	{
+		unsigned int mBuffer;
+		size_t mBufferSize;
+		void *mFence;
+		Image mImage;
+		int(*mFunction)(Image*, void*);
+		std::vector<uint8_t> mData;
+		int mStage; // see JobTimer
+	};
+	std::vector<Readback> mReadbacks;
+	// PBO ring, buffers of completed readbacks are used again by the next ones
+	struct ReadbackBuffer
+	{
+		unsigned int mBuffer;
+		size_t mSize;
+	};
+	std::vector<ReadbackBuffer> mReadbackBuffers;
+	void AcquireReadbackBuffer(size_t size, unsigned int& buffer, size_t& bufferSize);
+	void ReleaseReadbackBuffer(unsigned int buffer, size_t bufferSize);
+	void ClearReadbacks();
 	std::map<std::string, unsigned int> mSynchronousTextureCache;
 
 	int mEvaluationMode;
+	EvaluationBackend mBackend;
+	bool mbParallelEvaluation;
 	//int mAllocatedTargets;
 	unsigned int equiRectTexture;
 	int mDirtyCount;
@@ -206,20 +468,46 @@ protected:
 	void ClearEvaluators();
 	struct Evaluator
 	{
-		Evaluator() : mGLSLProgram(0), mCFunction(0), mMem(0) {}
+		Evaluator() : mGLSLProgram(0), mSamplerCount(0), mbProgramReady(false), mGLSLLayeredProgram(0), mbLayeredCompiled(false), mGLSLTiledProgram(0), mbTiledCompiled(false), mCFunction(0), mMem(0), mCPUKernel(0), mCodeHash(0) {}
 		unsigned int mGLSLProgram;
+		// samplers found in the program. Units are set once when the program is linked
+		unsigned int mSamplerCount;
+		// program and sampler count are the ones of the compiled script. See PrepareNodeProgram
+		bool mbProgramReady;
+		// cubemap targets, compiled the first time one is rendered. 0 when layered rendering is not supported
+		unsigned int mGLSLLayeredProgram;
+		bool mbLayeredCompiled;
+		// tiled evaluation, samples inputs in the tile. Compiled the first time a tile is rendered
+		unsigned int mGLSLTiledProgram;
+		bool mbTiledCompiled;
 		int(*mCFunction)(void *parameters, void *evaluationInfo);
 		void *mMem;
+		CPUKernelFunction mCPUKernel;
+		// hash of the evaluator sources, part of the result cache keys. 0 until computed
+		uint64_t mCodeHash;
 	};
 
 	std::vector<Evaluator> mEvaluatorPerNodeType;
 
+	enum ProgramCompileState
+	{
+		ProgramNotCompiled,
+		ProgramCompiling,
+		// without parallel compilation: one frame was drawn with the processing animation, the link is waited for next
+		ProgramCompilingShown,
+		ProgramCompiled,
+	};
+
 	struct EvaluatorScript
 	{
-		EvaluatorScript() : mProgram(0), mCFunction(0), mMem(0), mNodeType(-1) {}
-		EvaluatorScript(const std::string & text) : mText(text), mProgram(0), mCFunction(0), mMem(0), mNodeType(-1) {}
+		EvaluatorScript() : mProgram(0), mSamplerCount(0), mCompileState(ProgramNotCompiled), mCacheHash(0), mCFunction(0), mMem(0), mNodeType(-1) {}
+		EvaluatorScript(const std::string & text) : mText(text), mProgram(0), mSamplerCount(0), mCompileState(ProgramNotCompiled), mCacheHash(0), mCFunction(0), mMem(0), mNodeType(-1) {}
 		std::string mText;
 		unsigned int mProgram;
+		unsigned int mSamplerCount;
+		int mCompileState;
+		// program cache entry written when the compilation ends, 0 for a program loaded from the cache
+		uint64_t mCacheHash;
 		int(*mCFunction)(void *parameters, void *evaluationInfo);
 		void *mMem;
 		int mNodeType;
@@ -227,6 +515,22 @@ protected:
 
 	std::map<std::string, EvaluatorScript> mEvaluatorScripts;
 
+	// GLSL programs are started when their node type is first added, or all at once when the driver compiles
+	// in parallel. Evaluations wait for them, or show the processing animation in edit mode
+	bool mbParallelShaderCompile;
+	// startup time, from SetEvaluators to every program of the used node types linked. Logged once as cold
+	// (programs compiled from source) or warm (all from the program cache)
+	uint64_t mEvaluatorsTicks;
+	bool mbEvaluatorsReadyLogged;
+	void LogEvaluatorsReady();
+	void BeginScriptProgram(const std::string& filename, EvaluatorScript& shader);
+	// false while the program is compiling and wait is false
+	bool PrepareNodeProgram(size_t nodeType, bool wait);
+	void ReloadNodeProgram(const std::string& filename, EvaluatorScript& shader);
+	void SetNodeTypeDirty(int nodeType);
+	// C code replaced by a reload. Jobs started before may still run it, it's freed with the evaluators
+	std::vector<void*> mRetiredCode;
+
 	struct Input
 	{
 		Input()
@@ -243,12 +547,15 @@ protected:
 	};
 	struct EvaluationStage
 	{
-#ifdef _DEBUG
+		EvaluationStage() : mTarget(NULL), mNodeType(0), mParameters(NULL), mParametersSize(0), mbDirty(true), mbForceEval(false), mbProcessing(false)
+			, mbFreeSizing(true), mOutputFormat(TextureFormat::RGBA8), mEvaluationMask(0), mUseCountByOthers(0), mBlendingSrc(ONE), mBlendingDst(ZERO)
+			, mRx(-9999.f), mRy(-9999.f), mLButDown(false), mRButDown(false), mOrderPosition(-1), mDirtyVisit(0), mContentHash(0)
+			, mResolutionShift(0), mbDeferred(false)
+		{
+		}
 		std::string mNodeTypename;
-#endif
 		RenderTarget *mTarget;
 		size_t mNodeType;
-		unsigned int mParametersBuffer;
 		void *mParameters;
 		size_t mParametersSize;
 		Input mInput;
@@ -257,6 +564,7 @@ protected:
 		bool mbForceEval;
 		bool mbProcessing;
 		bool mbFreeSizing;
+		uint8_t mOutputFormat; // see SetEvaluationPrecision
 		int mEvaluationMask; // see EvaluationMask
 		int mUseCountByOthers;
 		int mBlendingSrc;
@@ -266,25 +574,209 @@ protected:
 		float mRy;
 		bool mLButDown;
 		bool mRButDown;
+		// stages using this one as input, one entry per input slot
+		std::vector<size_t> mChildren;
+		// position in mEvaluationOrderList, -1 when not evaluated
+		int mOrderPosition;
+		unsigned int mDirtyVisit;
+		// hash of the target content, see SetResultCacheBudget. 0 when unknown
+		uint64_t mContentHash;
+		int mResolutionShift; // see GetStageResolutionShift
+		bool mbDeferred; // dirty and left for the next RunEvaluation, see SetEvaluationBudget
+		// profiling, see SetProfiling
+		struct Timings
+		{
+			Timings() : mGPUTime(0.f), mCPUTime(0.f), mQueryIndex(0)
+			{
+				mQueries[0] = mQueries[1] = 0;
+				mbQueryPending[0] = mbQueryPending[1] = false;
+			}
+			float mGPUTime;
+			float mCPUTime;
+			// double buffered time queries. A stage whose both queries are still running is not timed
+			unsigned int mQueries[2];
+			bool mbQueryPending[2];
+			int mQueryIndex;
+		};
+		Timings mTimings;
 		void Clear();
 	};
 
-	unsigned int mEvaluationStateGLSLBuffer;
+	// EvaluationInfo and parameter blocks of the draws, written one after the other. The ring is cut in
+	// quarters, a fence is put when a quarter is left and waited for before the quarter is written again
+	struct UniformRing
+	{
+		unsigned int mBuffer;
+		size_t mSize;
+		size_t mAlignment;
+		size_t mHead;
+		int mQuarter;
+		void *mFences[4];
+	};
+	UniformRing mUniformRing;
+	void InitUniformRing();
+	// offset of the data in the ring buffer
+	size_t WriteUniforms(const void *data, size_t size);
+	// sampler objects per InputSampler, see GetSamplerKey
+	std::map<uint32_t, unsigned int> mSamplerObjects;
+	unsigned int mBoundSamplerCount;
+	unsigned int GetSamplerObject(const InputSampler& inputSampler);
+	void UnbindSamplers();
+	void ClearGLSLBindings();
 	std::vector<EvaluationStage> mEvaluationStages;
 	std::vector<size_t> mEvaluationOrderList;
+	// dirty propagation walk
+	std::vector<size_t> mDirtyStack;
+	unsigned int mDirtyVisitStamp;
+	// C nodes running on workers can set their image and dirty their children
+	std::mutex mDirtyMutex;
+	void RemoveChild(size_t source, size_t child);
+	void RebuildChildren();
 
 	void SetMouseInfos(EvaluationInfo &evaluationInfo, EvaluationStage &evaluationStage) const;
-	void BindGLSLParameters(EvaluationStage& evaluationStage);
-	void EvaluateGLSL(EvaluationStage& evaluationStage, EvaluationInfo& evaluationInfo);
+	struct FusedChain;
+	void EvaluateGLSL(EvaluationStage& evaluationStage, EvaluationInfo& evaluationInfo, const FusedChain *fusedChain = NULL);
+	unsigned int GetLayeredProgram(size_t nodeType);
+	unsigned int GetTiledProgram(size_t nodeType);
 	void EvaluateC(EvaluationStage& evaluationStage, size_t index, EvaluationInfo& evaluationInfo);
+	void EvaluateCPU(EvaluationStage& evaluationStage, EvaluationInfo& evaluationInfo);
+	void InitTarget(RenderTarget *target, int width, int height, uint8_t format);
+	void AllocateStageTarget(size_t index, int width, int height);
+	void RunEvaluationParallel(int width, int height, bool forceEvaluation, const EvaluationInfo& evaluationInfo);
+	bool StageRunsOnWorker(const EvaluationStage& evaluationStage, bool forceEvaluation) const;
 	void FinishEvaluation();
 
 	std::vector<RenderTarget*> mAllocatedRenderTargets;
-	void SetEvaluationMemoryMode(int mode);
+	// baking mode targets. Edit targets are put aside and given back, with their content, in edit mode
+	std::vector<RenderTarget*> mBakingRenderTargets;
+	std::vector<RenderTarget*> mEditRenderTargets;
+	std::mutex mTargetMutex;
+	RenderTarget *CreateStageTarget(EvaluationStage& evaluationStage);
+	void ReleaseRenderTargets(std::vector<RenderTarget*>& renderTargets);
+	void SetEvaluationMemoryMode(int mode, int width, int height);
+
+	// baking mode memory plan. Every stage size is known before the run: nodes sizing their own target
+	// (SetEvaluationSize, SetEvaluationCubeSize, SetEvaluationImage) keep their edit size.
+	struct BakingSize
+	{
+		int mWidth, mHeight, mFaces, mFormat;
+		bool operator == (const BakingSize& other) const
+		{
+			return mWidth == other.mWidth && mHeight == other.mHeight && mFaces == other.mFaces && mFormat == other.mFormat;
+		}
+	};
+	std::vector<BakingSize> mBakingSizes;
+	// targets to release once the stage at that order position is evaluated
+	std::vector<std::vector<RenderTarget*> > mBakingReleases;
+	size_t mPlannedPeakBytes;
+	size_t mActualPeakBytes;
+	void PlanBakingTargets(int width, int height);
+
+	// shader fusion. Every stage of a chain but the first one is a per-pixel function of the previous one:
+	// its only input is read by texture(Sampler0, vUV). The first stage reads the inputs of the chain
+	struct FusedProgram
+	{
+		unsigned int mProgram;
+		unsigned int mSamplerCount;
+	};
+	struct FusedChain
+	{
+		std::vector<size_t> mStages;
+		FusedProgram mProgram;
+	};
+	bool mbShaderFusion;
+	std::vector<FusedChain> mFusedChains;
+	// per stage: chain index for the last stage of a chain, FusedAway for the other stages of the chain, -1 otherwise
+	enum { FusedAway = -2 };
+	std::vector<int> mFusedStages;
+	// by node type names. A program of 0 is a chain that doesn't compile, its stages are evaluated one by one
+	std::map<std::string, FusedProgram> mFusedPrograms;
+	void PlanFusedChains();
+	const FusedChain* GetFusedChain(size_t index) const;
+	bool IsFusedAway(size_t index) const { return index < mFusedStages.size() && mFusedStages[index] == FusedAway; }
+	bool IsPointwiseNode(size_t nodeType) const;
+	bool GetFusedProgram(const std::vector<size_t>& stages, FusedProgram& fusedProgram);
+	void ClearFusedPrograms();
+
+	// tiled evaluation
+	int mTileSize;
+	bool mbTiling;
+	// GL_MAX_TEXTURE_SIZE, a GLSL target can't be bigger. Set by APIInit
+	int mMaxTextureSize;
+	float mTileRect[4];
+	bool GetTileMargins(size_t target, const std::vector<size_t>& stages, int width, int height, int& marginX, int& marginY);
+	std::vector<uint8_t> GetDirtyStates() const;
+	void SetDirtyStates(const std::vector<uint8_t>& dirtyStates);
+	void UpdateBakingPeak();
+	void ReleaseBakingTargets(size_t orderPosition);
 	void RecurseGetUse(size_t target, std::vector<size_t>& usedNodes);
 
+	// profiling
+	bool mbProfiling;
+	std::map<size_t, float> mJobTimes;
+	std::mutex mJobTimesMutex;
+	bool BeginGPUTimer(EvaluationStage& evaluationStage);
+	void EndGPUTimer(EvaluationStage& evaluationStage);
+	void CollectGPUTimings();
+	static void ClearGPUTimer(EvaluationStage& evaluationStage);
+	static uint64_t GetProfilerTicks();
+	static float GetProfilerTime(uint64_t startTicks);
+
+	// result cache
+	struct CachedResult
+	{
+		uint64_t mHash;
+		RenderTarget mTarget; // surface owned by the cache
+		unsigned int mLastUse;
+	};
+	std::vector<CachedResult> mCachedResults;
+	size_t mResultCacheBudget;
+	size_t mResultCacheBytes;
+	size_t mResultCacheHits;
+	size_t mResultCacheMisses;
+	unsigned int mResultCacheClock;
+	// hash of stages whose content can't be known from their parameters and inputs
+	uint64_t mContentVersion;
+	std::string mResultCacheDirectory;
+	// disk results written once their stage is done processing
+	std::vector<uint64_t> mPendingDiskResults;
+	bool IsResultCacheEnabled(const EvaluationInfo& evaluationInfo) const;
+	uint64_t GetCodeHash(size_t nodeType, const std::string& nodeName);
+	uint64_t ComputeContentHash(size_t index, int width, int height);
+	// true when the content of the stage was taken from the cache and evaluation is not needed
+	bool BeginCachedEvaluation(size_t index, int width, int height);
+	// current content of the stage goes to the cache. reallocate gives the target a new surface like the previous one
+	void StoreResult(size_t index, bool reallocate);
+	void TrimResultCache();
+	void ClearResultCache();
+	// target content written outside of an evaluation
+	void SetContentWritten(size_t target);
+	std::string GetDiskResultPath(uint64_t hash) const;
+	bool LoadDiskResult(size_t index, uint64_t hash);
+	void WritePendingDiskResults();
+
+	// progressive preview
+	bool mbProgressive;
+	int mProgressiveShift; // shift of the running evaluation
+	uint64_t mLastEditTicks; // 0 when edits are done and stages are at full size
+	uint64_t mLastProgressiveTicks;
+	float mProgressiveFrameTime;
+	void UpdateProgressiveShift(bool forceEvaluation);
+
+	// budgeted evaluation
+	float mEvaluationBudget;
+	std::vector<size_t> mPriorityTargets;
+	void RunEvaluationBudgeted(int width, int height, EvaluationInfo& evaluationInfo, const std::vector<uint8_t>& demanded);
+	// demand mode
+	bool mbDemandEvaluation;
+	std::vector<size_t> mSinkTargets;
+	// 1 for the targets and every stage they use
+	void GetUpstreamStages(const std::vector<size_t>& targets, std::vector<uint8_t>& upstream) const;
+
 	// ui callback shaders
 	unsigned int mProgressShader;
 	unsigned int mDisplayCubemapShader;
 
+	// program binaries
+	std::string mProgramCacheFilename;
 };
@@ -43,10 +43,15 @@
 #include "TaskScheduler.h"
 #include "NodesDelegate.h"
 #include "cmft/print.h"
+#include "Trace.h"
+#include "ProgramCache.h"
 
 extern enki::TaskScheduler g_TS;
 
 static const int SemUV0 = 0;
+#ifndef GL_COMPLETION_STATUS_ARB
+#define GL_COMPLETION_STATUS_ARB 0x91B1
+#endif
 static const unsigned int wrap[] = { GL_REPEAT, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_BORDER, GL_MIRRORED_REPEAT };
 static const unsigned int filter[] = { GL_LINEAR, GL_NEAREST };
 static const char* samplerName[] = { "Sampler0", "Sampler1", "Sampler2", "Sampler3", "Sampler4", "Sampler5", "Sampler6", "Sampler7", "CubeSampler0" };
@@ -55,35 +60,52 @@ static const unsigned int GLBlends[] = { GL_ZERO, GL_ONE, GL_SRC_COLOR, GL_ONE_M
 static const unsigned int glInputFormats[] = {
 		GL_BGR,
 		GL_RGB,
-		GL_RGB16,
-		GL_RGB16F,
-		GL_RGB32F,
+		GL_RGB,
+		GL_RGB,
+		GL_RGB,
 		GL_RGBA, // RGBE
 
 		GL_BGRA,
 		GL_RGBA,
-		GL_RGBA16,
-		GL_RGBA16F,
-		GL_RGBA32F,
+		GL_RGBA,
+		GL_RGBA,
+		GL_RGBA,
 
 		GL_RGBA, // RGBM
 };
+static const unsigned int glInputTypes[] = {
+	GL_UNSIGNED_BYTE,
+	GL_UNSIGNED_BYTE,
+	GL_UNSIGNED_SHORT,
+	GL_HALF_FLOAT,
+	GL_FLOAT,
+	GL_UNSIGNED_BYTE, // RGBE
+
+	GL_UNSIGNED_BYTE,
+	GL_UNSIGNED_BYTE,
+	GL_UNSIGNED_SHORT,
+	GL_HALF_FLOAT,
+	GL_FLOAT,
+
+	GL_UNSIGNED_BYTE, // RGBM
+};
 static const unsigned int glInternalFormats[] = {
-	GL_RGB,
-	GL_RGB,
+	GL_RGB8,
+	GL_RGB8,
 	GL_RGB16,
 	GL_RGB16F,
 	GL_RGB32F,
-	GL_RGBA, // RGBE
+	GL_RGBA8, // RGBE
 
-	GL_RGBA,
-	GL_RGBA,
+	GL_RGBA8,
+	GL_RGBA8,
 	GL_RGBA16,
 	GL_RGBA16F,
 	GL_RGBA32F,
 
-	GL_RGBA, // RGBM
+	GL_RGBA8, // RGBM
 };
+static const uint8_t precisionFormats[] = { TextureFormat::RGBA8, TextureFormat::RGBA16F, TextureFormat::RGBA32F };
 static const unsigned int glCubeFace[] = {
 	GL_TEXTURE_CUBE_MAP_POSITIVE_X,
 	GL_TEXTURE_CUBE_MAP_NEGATIVE_X,
@@ -139,6 +161,13 @@ unsigned int GetTexelSize(uint8_t fmt)
 	return textureFormatSize[fmt];
 }
 
+uint8_t GetPrecisionFormat(int precision)
+{
+	if (precision < 0 || precision >= PRECISION_COUNT)
+		return TextureFormat::RGBA8;
+	return precisionFormats[precision];
+}
+
 inline void TexParam(TextureID MinFilter, TextureID MagFilter, TextureID WrapS, TextureID WrapT, TextureID texMode)
 {
 	glTexParameteri(texMode, GL_TEXTURE_MIN_FILTER, MinFilter);
@@ -165,28 +194,51 @@ void RenderTarget::BindCubeFace(size_t face)
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GLenum(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face), mGLTexID, 0);
 }
 
+void RenderTarget::BindAsLayeredCubeTarget()
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, mFbo);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, mGLTexID, 0);
+	glViewport(0, 0, mImage.mWidth, mImage.mHeight);
+}
+
 void RenderTarget::Destroy()
 {
 	if (mGLTexID)
 		glDeleteTextures(1, &mGLTexID);
 	if (mFbo)
 		glDeleteFramebuffers(1, &mFbo);
+	if (mImage.mBits)
+		free(mImage.mBits);
+	mImage.mBits = NULL;
 	mFbo = 0;
 	mImage.mWidth = mImage.mHeight = 0;
 	mGLTexID = 0;
 }
 
-void RenderTarget::InitBuffer(int width, int height)
+void RenderTarget::Release()
 {
-	if ((width == mImage.mWidth) && (mImage.mHeight == height) && mImage.mNumFaces == 1)
+	gRenderTargetPool.Release(*this);
+}
+
+void RenderTarget::InitBuffer(int width, int height, uint8_t format)
+{
+	if ((width == mImage.mWidth) && (mImage.mHeight == height) && mImage.mNumFaces == 1 && mImage.mFormat == format)
+		return;
+	Release();
+	if (gRenderTargetPool.Acquire(*this, width, height, 1, format, false))
+	{
+		BindAsTarget();
+		glClearColor(0, 0, 0, 0);
+		glClear(GL_COLOR_BUFFER_BIT);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 		return;
-	Destroy();
+	}
 
 	mImage.mWidth = width;
 	mImage.mHeight = height;
 	mImage.mNumMips = 1;
 	mImage.mNumFaces = 1;
-	mImage.mFormat = TextureFormat::RGBA8;
+	mImage.mFormat = format;
 
 	glGenFramebuffers(1, &mFbo);
 	glBindFramebuffer(GL_FRAMEBUFFER, mFbo);
@@ -194,7 +246,7 @@ void RenderTarget::InitBuffer(int width, int height)
 	// diffuse
 	glGenTextures(1, &mGLTexID);
 	glBindTexture(GL_TEXTURE_2D, mGLTexID);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexImage2D(GL_TEXTURE_2D, 0, glInternalFormats[format], width, height, 0, glInputFormats[format], glInputTypes[format], NULL);
 	TexParam(GL_NEAREST, GL_NEAREST, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_TEXTURE_2D);
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, mGLTexID, 0);
 
@@ -210,17 +262,19 @@ void RenderTarget::InitBuffer(int width, int height)
 
 }
 
-void RenderTarget::InitCube(int width)
+void RenderTarget::InitCube(int width, uint8_t format)
 {
-	if ( (width == mImage.mWidth) && (mImage.mHeight == width) && mImage.mNumFaces == 6)
+	if ( (width == mImage.mWidth) && (mImage.mHeight == width) && mImage.mNumFaces == 6 && mImage.mFormat == format)
+		return;
+	Release();
+	if (gRenderTargetPool.Acquire(*this, width, width, 6, format, false))
 		return;
-	Destroy();
 
 	mImage.mWidth = width;
 	mImage.mHeight = width;
 	mImage.mNumMips = 1;
 	mImage.mNumFaces = 6;
-	mImage.mFormat = TextureFormat::RGBA8;
+	mImage.mFormat = format;
 
 	glGenFramebuffers(1, &mFbo);
 	glBindFramebuffer(GL_FRAMEBUFFER, mFbo);
@@ -229,7 +283,7 @@ void RenderTarget::InitCube(int width)
 	glBindTexture(GL_TEXTURE_CUBE_MAP, mGLTexID);
 	
 	for (int i = 0; i < 6; i++)
-		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGBA8, width, width, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, glInternalFormats[format], width, width, 0, glInputFormats[format], glInputTypes[format], NULL);
 		
 
 	TexParam(GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_TEXTURE_CUBE_MAP);
@@ -239,6 +293,127 @@ void RenderTarget::InitCube(int width)
 	CheckFBO();
 }
 
+RenderTargetPool gRenderTargetPool;
+
+static size_t GetImageSurfaceSize(const Image_t& image)
+{
+	size_t size = size_t(image.mWidth) * image.mHeight * image.mNumFaces * GetTexelSize(image.mFormat);
+	if (image.mNumMips > 1)
+		size += size / 3;
+	return size;
+}
+
+size_t RenderTarget::GetSurfaceSize() const
+{
+	if (!mGLTexID && !mImage.mBits)
+		return 0;
+	return GetImageSurfaceSize(mImage);
+}
+
+bool RenderTargetPool::Acquire(RenderTarget& target, int width, int height, int faces, int format, bool cpu)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	for (size_t i = 0; i < mSurfaces.size(); i++)
+	{
+		const Surface& surface = mSurfaces[i];
+		const Image_t& image = surface.mImage;
+		if (image.mWidth != width || image.mHeight != height || image.mNumFaces != faces || image.mFormat != format
+			|| image.mNumMips != 1 || (surface.mGLTexID == 0) != cpu)
+			continue;
+
+		target.mImage = image;
+		target.mGLTexID = surface.mGLTexID;
+		target.mFbo = surface.mFbo;
+		mPooledBytes -= surface.mBytes;
+		mSurfaces[i] = mSurfaces.back();
+		mSurfaces.pop_back();
+		mReusedCount++;
+		return true;
+	}
+	mCreatedCount++;
+	return false;
+}
+
+void RenderTargetPool::Release(RenderTarget& target)
+{
+	if (!target.mGLTexID && !target.mImage.mBits)
+		return;
+
+	Surface surface;
+	surface.mImage = target.mImage;
+	surface.mGLTexID = target.mGLTexID;
+	surface.mFbo = target.mFbo;
+	surface.mBytes = GetImageSurfaceSize(target.mImage);
+
+	target.mGLTexID = 0;
+	target.mFbo = 0;
+	target.mImage.mBits = NULL;
+	target.mImage.mWidth = target.mImage.mHeight = 0;
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	surface.mReleaseIndex = mReleaseIndex++;
+	mSurfaces.push_back(surface);
+	mPooledBytes += surface.mBytes;
+	Trim();
+}
+
+void RenderTargetPool::SetBudget(size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	mBudget = bytes;
+	Trim();
+}
+
+void RenderTargetPool::Clear()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	size_t budget = mBudget;
+	mBudget = 0;
+	Trim();
+	mBudget = budget;
+}
+
+void RenderTargetPool::ClearGLSurfaces()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	for (size_t i = 0; i < mSurfaces.size();)
+	{
+		if (!mSurfaces[i].mGLTexID)
+		{
+			i++;
+			continue;
+		}
+		RenderTarget renderTarget;
+		renderTarget.mImage = mSurfaces[i].mImage;
+		renderTarget.mGLTexID = mSurfaces[i].mGLTexID;
+		renderTarget.mFbo = mSurfaces[i].mFbo;
+		renderTarget.Destroy();
+		mPooledBytes -= mSurfaces[i].mBytes;
+		mSurfaces[i] = mSurfaces.back();
+		mSurfaces.pop_back();
+	}
+}
+
+void RenderTargetPool::Trim()
+{
+	while (mPooledBytes > mBudget && !mSurfaces.empty())
+	{
+		size_t oldest = 0;
+		for (size_t i = 1; i < mSurfaces.size(); i++)
+		{
+			if (mSurfaces[i].mReleaseIndex < mSurfaces[oldest].mReleaseIndex)
+				oldest = i;
+		}
+		RenderTarget renderTarget;
+		renderTarget.mImage = mSurfaces[oldest].mImage;
+		renderTarget.mGLTexID = mSurfaces[oldest].mGLTexID;
+		renderTarget.mFbo = mSurfaces[oldest].mFbo;
+		renderTarget.Destroy();
+		mPooledBytes -= mSurfaces[oldest].mBytes;
+		mSurfaces.erase(mSurfaces.begin() + oldest);
+	}
+}
+
 void RenderTarget::CheckFBO()
 {
 	glBindFramebuffer(GL_FRAMEBUFFER, mFbo);
@@ -327,82 +502,96 @@ void FullScreenTriangle::Render()
 	glBindVertexArray(0);
 }
 
-unsigned int LoadShader(const std::string &shaderString, const char *fileName)
+// compile and link are only started, drivers with parallel compilation build the program on their threads
+// until EndShader checks it. cacheHash is 0 for a program loaded from the program cache, it's already linked.
+// layered programs render the 6 faces of a cubemap in one draw. A geometry shader sets gl_Layer
+static unsigned int BeginShader(const std::string &shaderString, const char *fileName, bool layered, uint64_t& cacheHash)
 {
+	TRACE_SCOPE(fileName, "compile");
+	cacheHash = ProgramCacheHash(shaderString, layered);
+	TextureID cachedProgram = ProgramCacheLoad(cacheHash);
+	if (cachedProgram)
+	{
+		cacheHash = 0;
+		return cachedProgram;
+	}
+
 	TextureID programObject = glCreateProgram();
 	if (programObject == 0)
 		return 0;
 
-	GLint compiled;
 	const char *shaderTypeStrings[] = { "\n#version 430 core\n#define VERTEX_SHADER\n", "\n#version 430 core\n#define FRAGMENT_SHADER\n" };
-	TextureID shaderTypes[] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
-	TextureID compiledShader[2];
+	const char *layeredShaderTypeStrings[] = { "\n#version 430 core\n#define LAYERED\n#define VERTEX_SHADER\n", "\n#version 430 core\n#define LAYERED\n#define FRAGMENT_SHADER\n", "\n#version 430 core\n#define LAYERED\n#define GEOMETRY_SHADER\n" };
+	TextureID shaderTypes[] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER, GL_GEOMETRY_SHADER };
+	const int shaderCount = layered ? 3 : 2;
+	const char **typeStrings = layered ? layeredShaderTypeStrings : shaderTypeStrings;
 
-	for (int i = 0; i<2; i++)
+	for (int i = 0; i<shaderCount; i++)
 	{
 		// Create the shader object
 		int shader = glCreateShader(shaderTypes[i]);
 
 		if (shader == 0)
-			return false;
+		{
+			glDeleteProgram(programObject);
+			return 0;
+		}
 
-		int stringsCount = 2;
-		const char ** strings = (const char**)malloc(sizeof(char*) * stringsCount); //new const char*[stringsCount];
-		int * stringLength = (int*)malloc(sizeof(int) * stringsCount); //new int[stringsCount];
-		strings[0] = shaderTypeStrings[i];
-		stringLength[0] = int(strlen(shaderTypeStrings[i]));
-		strings[stringsCount - 1] = shaderString.c_str();
-		stringLength[stringsCount - 1] = int(shaderString.length());
+		const char *strings[] = { typeStrings[i], shaderString.c_str() };
+		const int stringLength[] = { int(strlen(typeStrings[i])), int(shaderString.length()) };
 
-		// Load and compile the shader source
-		glShaderSource(shader, stringsCount, strings, stringLength);
+		// Load and compile the shader source. Status is checked by EndShader
+		glShaderSource(shader, 2, strings, stringLength);
 		glCompileShader(shader);
+		glAttachShader(programObject, shader);
+	}
 
+	// Link the program
+	glBindAttribLocation(programObject, SemUV0, "inUV");
+	glProgramParameteri(programObject, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(programObject);
+	return programObject;
+}
+
+// waits for the program started by BeginShader. Errors are logged and the program deleted, 0 is returned then
+static unsigned int EndShader(unsigned int programObject, const char *fileName, uint64_t cacheHash)
+{
+	if (!programObject || !cacheHash)
+		return programObject;
+	TRACE_SCOPE(fileName, "compile");
 
-		free(stringLength);
-		free(strings);
+	TextureID shaders[3];
+	GLsizei shaderCount = 0;
+	glGetAttachedShaders(programObject, 3, &shaderCount, shaders);
 
-		// Check the compile status
-		glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
-		if (compiled == 0)
+	GLint linked;
+	glGetProgramiv(programObject, GL_LINK_STATUS, &linked);
+	if (linked == 0)
+	{
+		bool compiled = true;
+		for (GLsizei i = 0; i < shaderCount; i++)
 		{
+			// Check the compile status
+			GLint shaderCompiled;
+			glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &shaderCompiled);
+			if (shaderCompiled)
+				continue;
+			compiled = false;
 			GLint info_len = 0;
-			glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &info_len);
+			glGetShaderiv(shaders[i], GL_INFO_LOG_LENGTH, &info_len);
 			if (info_len > 1)
 			{
 				char* info_log = (char*)malloc(sizeof(char) * info_len);
-				glGetShaderInfoLog(shader, info_len, NULL, info_log);
+				glGetShaderInfoLog(shaders[i], info_len, NULL, info_log);
 				Log("Error compiling shader: %s \n", fileName);
 				Log(info_log);
 				Log("\n");
 				free(info_log);
 			}
-			glDeleteShader(shader);
-			return 0;
 		}
-		compiledShader[i] = shader;
-	}
-
-
-
-	GLint linked;
-
-	for (int i = 0; i<2; i++)
-		glAttachShader(programObject, compiledShader[i]);
-
-
-	// Link the program
-	glLinkProgram(programObject);
-
-	glBindAttribLocation(programObject, SemUV0, "inUV");
-
-	// Check the link status
-	glGetProgramiv(programObject, GL_LINK_STATUS, &linked);
-	if (linked == 0)
-	{
 		GLint info_len = 0;
 		glGetProgramiv(programObject, GL_INFO_LOG_LENGTH, &info_len);
-		if (info_len > 1)
+		if (compiled && info_len > 1)
 		{
 			char* info_log = (char*)malloc(sizeof(char) * info_len);
 			glGetProgramInfoLog(programObject, info_len, NULL, info_log);
@@ -410,18 +599,29 @@ unsigned int LoadShader(const std::string &shaderString, const char *fileName)
 			Log(info_log);
 			free(info_log);
 		}
-		glDeleteProgram(programObject);
-		return 0;
 	}
 
 	// Delete these here because they are attached to the program object.
-	for (int i = 0; i<2; i++)
-		glDeleteShader(compiledShader[i]);
+	for (GLsizei i = 0; i < shaderCount; i++)
+		glDeleteShader(shaders[i]);
+
+	if (linked == 0)
+	{
+		glDeleteProgram(programObject);
+		return 0;
+	}
 
-	// attributes
+	ProgramCacheStore(cacheHash, programObject);
 	return programObject;
 }
 
+unsigned int LoadShader(const std::string &shaderString, const char *fileName, bool layered = false)
+{
+	uint64_t cacheHash;
+	unsigned int programObject = BeginShader(shaderString, fileName, layered, cacheHash);
+	return EndShader(programObject, fileName, cacheHash);
+}
+
 FullScreenTriangle mFSQuad;
 
 void Evaluation::APIInit()
@@ -431,6 +631,17 @@ void Evaluation::APIInit()
 	std::ifstream prgStr("Stock/ProgressingNode.glsl");
 	std::ifstream cubStr("Stock/DisplayCubemap.glsl");
 
+	// GL_ARB_parallel_shader_compile: completion of a program is known without waiting for it
+	GLint extensionCount = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+	for (GLint i = 0; i < extensionCount; i++)
+	{
+		const char *extension = (const char*)glGetStringi(GL_EXTENSIONS, i);
+		if (extension && (!strcmp(extension, "GL_ARB_parallel_shader_compile") || !strcmp(extension, "GL_KHR_parallel_shader_compile")))
+			mbParallelShaderCompile = true;
+	}
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &mMaxTextureSize);
+
 	mProgressShader = prgStr.good() ? LoadShader(std::string(std::istreambuf_iterator<char>(prgStr), std::istreambuf_iterator<char>()), "progressShader") : 0;
 	mDisplayCubemapShader = cubStr.good() ? LoadShader(std::string(std::istreambuf_iterator<char>(cubStr), std::istreambuf_iterator<char>()), "cubeDisplay") : 0;
 }
@@ -489,7 +700,45 @@ int Evaluation::ReadImageMem(unsigned char *data, size_t dataSize, Image *image)
 	return EVAL_OK;
 }
 
-int Evaluation::WriteImage(const char *filename, Image *image, int format, int quality)
+// bits of image in another format, converted is allocated
+static int ConvertImageBits(const Image *image, Image *converted, int format)
+{
+	if (format < 0 || format >= TextureFormat::Count)
+		return EVAL_ERR;
+	cmft::Image src;
+	src.m_format = (cmft::TextureFormat::Enum)image->mFormat;
+	src.m_width = image->mWidth;
+	src.m_height = image->mHeight;
+	src.m_numFaces = image->mNumFaces;
+	src.m_numMips = image->mNumMips;
+	src.m_data = image->mBits;
+	src.m_dataSize = image->mDataSize;
+	cmft::Image dst;
+	cmft::imageConvert(dst, (cmft::TextureFormat::Enum)format, src);
+	if (!dst.m_data)
+		return EVAL_ERR;
+	*converted = *image;
+	converted->mBits = dst.m_data;
+	converted->mDataSize = dst.m_dataSize;
+	converted->mFormat = uint8_t(format);
+	return EVAL_OK;
+}
+
+int Evaluation::ConvertImage(Image *image, int format)
+{
+	if (image->mFormat == format)
+		return EVAL_OK;
+	if (ConvertKernelImage(image, format))
+		return EVAL_OK;
+	Image converted;
+	if (ConvertImageBits(image, &converted, format) != EVAL_OK)
+		return EVAL_ERR;
+	free(image->mBits);
+	*image = converted;
+	return EVAL_OK;
+}
+
+static int WriteImageFile(const char *filename, Image *image, int format, int quality)
 {
 	int components = textureComponentCount[image->mFormat];
 	switch (format)
@@ -511,7 +760,7 @@ int Evaluation::WriteImage(const char *filename, Image *image, int format, int q
 			return EVAL_ERR;
 		break;
 	case 4:
-		//if (stbi_write_hdr(filename, image->width, image->height, image->components, image->bits))
+		if (!stbi_write_hdr(filename, image->mWidth, image->mHeight, components, (const float*)image->mBits))
 			return EVAL_ERR;
 		break;
 	case 5:
@@ -551,183 +800,705 @@ int Evaluation::WriteImage(const char *filename, Image *image, int format, int q
 	return EVAL_OK;
 }
 
-int Evaluation::GetEvaluationImage(int target, Image *image)
+int Evaluation::WriteImage(const char *filename, Image *image, int format, int quality)
 {
-	if (target == -1 || target >= gEvaluation.mEvaluationStages.size())
-		return EVAL_ERR;
-
-	Evaluation::EvaluationStage &evaluation = gEvaluation.mEvaluationStages[target];
-	if (!evaluation.mTarget)
+	// jpg, png, tga and bmp are written with 8 bits per channel, hdr with floats. dds and ktx keep the image precision
+	int fileFormat = image->mFormat;
+	if (format == 4)
+		fileFormat = TextureFormat::RGBA32F;
+	else if (format < 4 && textureFormatSize[image->mFormat] != textureComponentCount[image->mFormat])
+		fileFormat = TextureFormat::RGBA8;
+	if (fileFormat == image->mFormat)
+		return WriteImageFile(filename, image, format, quality);
+
+	Image converted;
+	if (ConvertImageBits(image, &converted, fileFormat) != EVAL_OK)
 		return EVAL_ERR;
+	int res = WriteImageFile(filename, &converted, format, quality);
+	free(converted.mBits);
+	return res;
+}
 
-	RenderTarget& tgt = *evaluation.mTarget;
-
-	// compute total size
-	Image_t& img = tgt.mImage;
+// image description of a render target, bits are not allocated
+static void GetTargetImageInfo(const RenderTarget& tgt, Image *image)
+{
+	const Image_t& img = tgt.mImage;
 	unsigned int texelSize = GetTexelSize(img.mFormat);
-	unsigned int texelFormat = glInternalFormats[img.mFormat];
-	uint32_t size = 0;// img.mNumFaces * img.mWidth * img.mHeight * texelSize;
-	for (int i = 0;i<img.mNumMips;i++)
+	uint32_t size = 0;
+	for (int i = 0; i < img.mNumMips; i++)
 		size += img.mNumFaces * (img.mWidth >> i) * (img.mHeight >> i) * texelSize;
 
-	image->mBits = malloc(size);
+	image->mBits = NULL;
 	image->mDataSize = size;
 	image->mWidth = img.mWidth;
 	image->mHeight = img.mHeight;
 	image->mNumMips = img.mNumMips;
 	image->mFormat = img.mFormat;
 	image->mNumFaces = img.mNumFaces;
+}
 
-	glBindTexture(GL_TEXTURE_2D, tgt.mGLTexID);
-	unsigned char *ptr = (unsigned char *)image->mBits;
+// every face and mip of the texture, packed. ptr is an offset when a pixel pack buffer is bound
+static void ReadTargetTexture(const RenderTarget& tgt, unsigned char *ptr)
+{
+	const Image_t& img = tgt.mImage;
+	unsigned int texelSize = GetTexelSize(img.mFormat);
+	unsigned int texelFormat = glInputFormats[img.mFormat];
+	unsigned int texelType = glInputTypes[img.mFormat];
 	if (img.mNumFaces == 1)
 	{
+		glBindTexture(GL_TEXTURE_2D, tgt.mGLTexID);
 		for (int i = 0; i < img.mNumMips; i++)
 		{
-			glGetTexImage(GL_TEXTURE_2D, i, texelFormat, GL_UNSIGNED_BYTE, ptr);
+			glGetTexImage(GL_TEXTURE_2D, i, texelFormat, texelType, ptr);
 			ptr += (img.mWidth >> i) * (img.mHeight >> i) * texelSize;
 		}
+		glBindTexture(GL_TEXTURE_2D, 0);
 	}
 	else
 	{
+		glBindTexture(GL_TEXTURE_CUBE_MAP, tgt.mGLTexID);
 		for (int cube = 0; cube < img.mNumFaces; cube++)
 		{
 			for (int i = 0; i < img.mNumMips; i++)
 			{
-				glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X+cube, i, texelFormat, GL_UNSIGNED_BYTE, ptr);
+				glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + cube, i, texelFormat, texelType, ptr);
 				ptr += (img.mWidth >> i) * (img.mHeight >> i) * texelSize;
 			}
 		}
+		glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
 	}
-	return EVAL_OK;
 }
 
-int Evaluation::SetEvaluationImage(int target, Image *image)
+int Evaluation::GetEvaluationImage(int target, Image *image)
 {
+	if (target == -1 || target >= gEvaluation.mEvaluationStages.size())
+		return EVAL_ERR;
+
 	Evaluation::EvaluationStage &evaluation = gEvaluation.mEvaluationStages[target];
 	if (!evaluation.mTarget)
+		return EVAL_ERR;
+
+	RenderTarget& tgt = *evaluation.mTarget;
+	GetTargetImageInfo(tgt, image);
+	image->mBits = malloc(image->mDataSize);
+
+	// CPU backend
+	if (!tgt.mGLTexID && tgt.mImage.mBits)
 	{
-		evaluation.mTarget = new RenderTarget;
+		memcpy(image->mBits, tgt.mImage.mBits, image->mDataSize);
+		return EVAL_OK;
 	}
-	evaluation.mbFreeSizing = false;
-	unsigned int texelSize = GetTexelSize(image->mFormat);
-	unsigned int inputFormat = glInputFormats[image->mFormat];
-	unsigned int internalFormat = glInternalFormats[image->mFormat];
-	unsigned char *ptr = (unsigned char *)image->mBits;
-	if (image->mNumFaces == 1)
-	{
-		evaluation.mTarget->InitBuffer(image->mWidth, image->mHeight);
 
-		glBindTexture(GL_TEXTURE_2D, evaluation.mTarget->mGLTexID);
+	ReadTargetTexture(tgt, (unsigned char *)image->mBits);
+	return EVAL_OK;
+}
 
-		for (int i = 0; i < image->mNumMips; i++)
-		{
-			glTexImage2D(GL_TEXTURE_2D, i, internalFormat, image->mWidth >> i, image->mHeight >> i, 0, inputFormat, GL_UNSIGNED_BYTE, ptr);
-			ptr += (image->mWidth >> i) * (image->mHeight >> i) * texelSize;
-		}
+typedef int(*readbackFunction)(Image*, void*);
 
-		if (image->mNumMips > 1)
-			TexParam(GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_TEXTURE_2D);
-		else
-			TexParam(GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_TEXTURE_2D);
+struct ReadbackTaskSet final : enki::ITaskSet
+{
+	ReadbackTaskSet(readbackFunction function, const Image& image, const void *ptr, size_t size, int stage) : enki::ITaskSet()
+		, mFunction(function)
+		, mImage(image)
+		, mBuffer(malloc(size))
+		, mStage(stage)
+	{
+		memcpy(mBuffer, ptr, size);
 	}
-	else
+	virtual void    ExecuteRange(enki::TaskSetPartition, uint32_t)
 	{
-		evaluation.mTarget->InitCube(image->mWidth);
-		glBindTexture(GL_TEXTURE_CUBE_MAP, evaluation.mTarget->mGLTexID);
-
-		for (int face = 0; face < image->mNumFaces; face++)
 		{
-			for (int i = 0; i < image->mNumMips; i++)
-			{
-				glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, i, internalFormat, image->mWidth >> i, image->mWidth >> i, 0, inputFormat, GL_UNSIGNED_BYTE, ptr);
-				ptr += (image->mWidth >> i) * (image->mWidth >> i) * texelSize;
-			}
+			TRACE_SCOPE("Readback", "job", mStage);
+			Evaluation::JobTimer timer(mStage);
+			mFunction(&mImage, mBuffer);
 		}
-
-		if (image->mNumMips > 1)
-			TexParam(GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_TEXTURE_CUBE_MAP);
-		else
-			TexParam(GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_TEXTURE_CUBE_MAP);
-
+		free(mBuffer);
+		delete this;
 	}
-	gEvaluation.SetTargetDirty(target, true);
-	return EVAL_OK;
-}
+	readbackFunction mFunction;
+	Image mImage;
+	void *mBuffer;
+	int mStage;
+};
 
-int Evaluation::SetEvaluationImageCube(int target, Image *image, int cubeFace)
+int Evaluation::GetEvaluationImageAsync(int target, int(*readbackFunction)(Image*, void*), void *ptr, unsigned int size)
 {
-	if (image->mNumFaces != 1)
+	if (target < 0 || target >= int(gEvaluation.mEvaluationStages.size()) || !readbackFunction)
 		return EVAL_ERR;
+
 	Evaluation::EvaluationStage &evaluation = gEvaluation.mEvaluationStages[target];
 	if (!evaluation.mTarget)
+		return EVAL_ERR;
+
+	RenderTarget& tgt = *evaluation.mTarget;
+	Image image;
+	GetTargetImageInfo(tgt, &image);
+
+	// CPU backend, bits are already there
+	if (!tgt.mGLTexID)
 	{
-		evaluation.mTarget = new RenderTarget;
+		if (!tgt.mImage.mBits)
+			return EVAL_ERR;
+		image.mBits = malloc(image.mDataSize);
+		memcpy(image.mBits, tgt.mImage.mBits, image.mDataSize);
+		g_TS.AddTaskSetToPipe(new ReadbackTaskSet(readbackFunction, image, ptr, size, GetJobStage()));
+		return EVAL_OK;
 	}
-	evaluation.mbFreeSizing = false;
-	evaluation.mTarget->InitCube(image->mWidth);
 
-	UploadImage(image, evaluation.mTarget->mGLTexID, cubeFace);
-	gEvaluation.SetTargetDirty(target, true);
+	Readback readback;
+	gEvaluation.AcquireReadbackBuffer(image.mDataSize, readback.mBuffer, readback.mBufferSize);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.mBuffer);
+	ReadTargetTexture(tgt, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	readback.mFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	readback.mImage = image;
+	readback.mFunction = readbackFunction;
+	readback.mStage = GetJobStage();
+	readback.mData.assign((uint8_t*)ptr, (uint8_t*)ptr + size);
+	gEvaluation.mReadbacks.push_back(readback);
 	return EVAL_OK;
 }
 
-int Evaluation::CubemapFilter(Image *image, int faceSize, int lightingModel, int excludeBase, int glossScale, int glossBias)
+void Evaluation::AcquireReadbackBuffer(size_t size, unsigned int& buffer, size_t& bufferSize)
 {
-	cmft::Image img;
-	img.m_data = image->mBits;
-	img.m_dataSize = image->mDataSize;
-	img.m_numMips = image->mNumMips;
-	img.m_numFaces = image->mNumFaces;
-	img.m_width = image->mWidth;
-	img.m_height = image->mHeight;
-	img.m_format = (cmft::TextureFormat::Enum)image->mFormat;
-
-	extern unsigned int gCPUCount;
-
-	cmft::setWarningPrintf(Log);
-	cmft::setInfoPrintf(Log);
-
-	faceSize = 16;
-	if (!cmft::imageRadianceFilter(img
-		, faceSize // face size
-		, (cmft::LightingModel::Enum)lightingModel
-		, (excludeBase != 0)
-		, uint8_t(log2(faceSize)) // map mip count
-		, glossScale
-		, glossBias
-		, cmft::EdgeFixup::None
-		, gCPUCount))
-		return EVAL_ERR;
-
-	image->mBits = img.m_data;
-	image->mDataSize = img.m_dataSize;
-	image->mNumMips = img.m_numMips;
-	image->mNumFaces = img.m_numFaces;
-	image->mWidth = img.m_width;
-	image->mHeight = img.m_height;
-	image->mFormat = img.m_format;
-	
-	return EVAL_OK;
+	// smallest free buffer big enough, or the biggest one grown
+	int best = -1;
+	for (int i = 0; i < int(mReadbackBuffers.size()); i++)
+	{
+		const ReadbackBuffer& candidate = mReadbackBuffers[i];
+		if (best == -1)
+			best = i;
+		else if (candidate.mSize >= size && (mReadbackBuffers[best].mSize < size || candidate.mSize < mReadbackBuffers[best].mSize))
+			best = i;
+		else if (candidate.mSize < size && mReadbackBuffers[best].mSize < size && candidate.mSize > mReadbackBuffers[best].mSize)
+			best = i;
+	}
+	if (best == -1)
+	{
+		glGenBuffers(1, &buffer);
+		bufferSize = 0;
+	}
+	else
+	{
+		buffer = mReadbackBuffers[best].mBuffer;
+		bufferSize = mReadbackBuffers[best].mSize;
+		mReadbackBuffers.erase(mReadbackBuffers.begin() + best);
+	}
+	if (bufferSize < size)
+	{
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		bufferSize = size;
+	}
 }
 
-int Evaluation::AllocateImage(Image *image)
+void Evaluation::ReleaseReadbackBuffer(unsigned int buffer, size_t bufferSize)
 {
-	return EVAL_OK;
+	static const size_t maxFreeBuffers = 4;
+	if (mReadbackBuffers.size() >= maxFreeBuffers)
+	{
+		glDeleteBuffers(1, &buffer);
+		return;
+	}
+	ReadbackBuffer readbackBuffer;
+	readbackBuffer.mBuffer = buffer;
+	readbackBuffer.mSize = bufferSize;
+	mReadbackBuffers.push_back(readbackBuffer);
 }
 
-int Evaluation::FreeImage(Image *image)
+void Evaluation::ProcessReadbacks(bool waitAll)
 {
-	free(image->mBits);
-	image->mBits = NULL;
-	return EVAL_OK;
+	// fences are signaled in order
+	while (!mReadbacks.empty())
+	{
+		Readback& readback = mReadbacks.front();
+		GLsync fence = (GLsync)readback.mFence;
+		GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, waitAll ? GLuint64(1000000000) : 0);
+		if (status == GL_TIMEOUT_EXPIRED)
+		{
+			if (!waitAll)
+				break;
+			continue;
+		}
+		glDeleteSync(fence);
+
+		// the function is called with NULL bits when the readback failed
+		Image& image = readback.mImage;
+		image.mBits = NULL;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.mBuffer);
+		void *bits = (status == GL_WAIT_FAILED) ? NULL : glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, image.mDataSize, GL_MAP_READ_BIT);
+		if (bits)
+		{
+			image.mBits = malloc(image.mDataSize);
+			memcpy(image.mBits, bits, image.mDataSize);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		else
+		{
+			Log("Asynchronous readback failed.\n");
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		ReleaseReadbackBuffer(readback.mBuffer, readback.mBufferSize);
+
+		g_TS.AddTaskSetToPipe(new ReadbackTaskSet(readback.mFunction, image, readback.mData.data(), readback.mData.size(), readback.mStage));
+		mReadbacks.erase(mReadbacks.begin());
+	}
+}
+
+void Evaluation::ClearReadbacks()
+{
+	ProcessReadbacks(true);
+	for (auto& readbackBuffer : mReadbackBuffers)
+		glDeleteBuffers(1, &readbackBuffer.mBuffer);
+	mReadbackBuffers.clear();
+}
+
+void Evaluation::InitImageTarget(size_t target, const Image *image, int cubeFace)
+{
+	Evaluation::EvaluationStage &evaluation = mEvaluationStages[target];
+	if (!evaluation.mTarget)
+	{
+		CreateStageTarget(evaluation);
+	}
+	evaluation.mbFreeSizing = false;
+	RenderTarget& tgt = *evaluation.mTarget;
+	if (cubeFace != -1)
+	{
+		tgt.InitCube(image->mWidth, image->mFormat);
+		return;
+	}
+
+	unsigned int inputFormat = glInputFormats[image->mFormat];
+	unsigned int inputType = glInputTypes[image->mFormat];
+	unsigned int internalFormat = glInternalFormats[image->mFormat];
+	unsigned int textureType = (image->mNumFaces == 1) ? GL_TEXTURE_2D : GL_TEXTURE_CUBE_MAP;
+	if (image->mNumFaces == 1)
+		tgt.InitBuffer(image->mWidth, image->mHeight, image->mFormat);
+	else
+		tgt.InitCube(image->mWidth, image->mFormat);
+
+	glBindTexture(textureType, tgt.mGLTexID);
+	for (int face = 0; face < image->mNumFaces; face++)
+	{
+		unsigned int faceTarget = (image->mNumFaces == 1) ? GL_TEXTURE_2D : GL_TEXTURE_CUBE_MAP_POSITIVE_X + face;
+		for (int i = 1; i < image->mNumMips; i++)
+			glTexImage2D(faceTarget, i, internalFormat, image->mWidth >> i, image->mHeight >> i, 0, inputFormat, inputType, NULL);
+	}
+
+	if (image->mNumMips > 1)
+		TexParam(GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, textureType);
+	else
+		TexParam(GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, textureType);
+	// an interrupted asynchronous upload can leave it set
+	glTexParameteri(textureType, GL_TEXTURE_BASE_LEVEL, 0);
+	// mips are added to the storage. Keeps the pool from reusing it as a plain target
+	tgt.mImage.mNumMips = image->mNumMips;
+}
+
+int Evaluation::SetEvaluationImage(int target, Image *image)
+{
+	if (gEvaluation.mBackend == BACKEND_CPU)
+	{
+		Evaluation::EvaluationStage &evaluation = gEvaluation.mEvaluationStages[target];
+		if (!evaluation.mTarget)
+		{
+			gEvaluation.CreateStageTarget(evaluation);
+		}
+		evaluation.mbFreeSizing = false;
+		if (evaluation.mTarget->CopyToCPUBuffer(image) != EVAL_OK)
+			return EVAL_ERR;
+		gEvaluation.SetTargetDirty(target, true);
+		return EVAL_OK;
+	}
+	gEvaluation.InitImageTarget(target, image, -1);
+
+	unsigned int texelSize = GetTexelSize(image->mFormat);
+	unsigned int inputFormat = glInputFormats[image->mFormat];
+	unsigned int inputType = glInputTypes[image->mFormat];
+	unsigned char *ptr = (unsigned char *)image->mBits;
+	for (int face = 0; face < image->mNumFaces; face++)
+	{
+		unsigned int faceTarget = (image->mNumFaces == 1) ? GL_TEXTURE_2D : GL_TEXTURE_CUBE_MAP_POSITIVE_X + face;
+		for (int i = 0; i < image->mNumMips; i++)
+		{
+			glTexSubImage2D(faceTarget, i, 0, 0, image->mWidth >> i, image->mHeight >> i, inputFormat, inputType, ptr);
+			ptr += (image->mWidth >> i) * (image->mHeight >> i) * texelSize;
+		}
+	}
+	gEvaluation.SetTargetDirty(target, true);
+	return EVAL_OK;
+}
+
+int Evaluation::SetEvaluationImageCube(int target, Image *image, int cubeFace)
+{
+	if (image->mNumFaces != 1)
+		return EVAL_ERR;
+	if (gEvaluation.mBackend == BACKEND_CPU)
+	{
+		Log("Cubemaps are not supported by CPU evaluation.\n");
+		return EVAL_ERR;
+	}
+	gEvaluation.InitImageTarget(target, image, cubeFace);
+
+	UploadImage(image, gEvaluation.mEvaluationStages[target].mTarget->mGLTexID, cubeFace);
+	gEvaluation.SetTargetDirty(target, true);
+	return EVAL_OK;
+}
+
+struct UploadCopyTaskSet : enki::ITaskSet
+{
+	UploadCopyTaskSet() : enki::ITaskSet(), mDestination(NULL)
+	{
+	}
+	virtual void    ExecuteRange(enki::TaskSetPartition, uint32_t)
+	{
+		TRACE_SCOPE("UploadCopy", "upload");
+		memcpy(mDestination, mImage.mBits, mImage.mDataSize);
+		Evaluation::FreeImage(&mImage);
+	}
+	void *mDestination;
+	Image mImage;
+};
+
+struct Evaluation::ImageUpload
+{
+	int mTarget;
+	int mCubeFace;
+	Image mImage;
+	unsigned int mTexture;
+	unsigned int mBuffer;
+	bool mbMapped;
+	bool mbCopyStarted;
+	// next rows to upload. Mips go coarse to fine
+	int mLevel;
+	int mFace;
+	int mRow;
+	UploadCopyTaskSet mCopyTask;
+};
+
+// offset of a face mip in the image bits. Faces are stored one after the other with their mips
+static size_t GetImageOffset(const Image& image, int face, int level)
+{
+	unsigned int texelSize = GetTexelSize(image.mFormat);
+	size_t faceSize = 0;
+	size_t levelOffset = 0;
+	for (int i = 0; i < image.mNumMips; i++)
+	{
+		if (i == level)
+			levelOffset = faceSize;
+		faceSize += (image.mWidth >> i) * (image.mHeight >> i) * texelSize;
+	}
+	return face * faceSize + levelOffset;
+}
+
+int Evaluation::QueueUpload(int target, Image *image, int cubeFace)
+{
+	if (target < 0 || !image->mBits)
+		return EVAL_ERR;
+	if (cubeFace != -1 && image->mNumFaces != 1)
+		return EVAL_ERR;
+
+	ImageUpload *upload = new ImageUpload;
+	upload->mTarget = target;
+	upload->mCubeFace = cubeFace;
+	upload->mImage = *image;
+	upload->mTexture = 0;
+	upload->mBuffer = 0;
+	upload->mbMapped = false;
+	upload->mbCopyStarted = false;
+	// a cube face only sets the first mip, like SetEvaluationImageCube
+	upload->mLevel = (cubeFace == -1) ? image->mNumMips - 1 : 0;
+	upload->mFace = 0;
+	upload->mRow = 0;
+
+	std::lock_guard<std::mutex> lock(gEvaluation.mUploadMutex);
+	gEvaluation.mIncomingUploads.push_back(upload);
+	return EVAL_OK;
+}
+
+int Evaluation::SetEvaluationImageAsync(int target, Image *image)
+{
+	return QueueUpload(target, image, -1);
+}
+
+int Evaluation::SetEvaluationImageCubeAsync(int target, Image *image, int cubeFace)
+{
+	return QueueUpload(target, image, cubeFace);
+}
+
+bool Evaluation::IsUploading(size_t target)
+{
+	for (auto upload : mUploads)
+	{
+		if (upload->mTarget == int(target))
+			return true;
+	}
+	std::lock_guard<std::mutex> lock(mUploadMutex);
+	for (auto upload : mIncomingUploads)
+	{
+		if (upload->mTarget == int(target))
+			return true;
+	}
+	return false;
+}
+
+void Evaluation::CancelUpload(ImageUpload *upload)
+{
+	if (upload->mbCopyStarted)
+		g_TS.WaitforTask(&upload->mCopyTask);
+	else
+		FreeImage(&upload->mImage);
+	if (upload->mBuffer)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload->mBuffer);
+		if (upload->mbMapped)
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glDeleteBuffers(1, &upload->mBuffer);
+	}
+	delete upload;
+}
+
+// allocates the texture and the PBO, the copy to the PBO is done by a job. Returns false when there is nothing left to do
+bool Evaluation::StartUpload(ImageUpload *upload)
+{
+	Image& image = upload->mImage;
+	if (upload->mTarget >= int(mEvaluationStages.size()))
+	{
+		FreeImage(&image);
+		delete upload;
+		return false;
+	}
+	if (mBackend == BACKEND_CPU)
+	{
+		if (upload->mCubeFace == -1)
+			SetEvaluationImage(upload->mTarget, &image);
+		else
+			SetEvaluationImageCube(upload->mTarget, &image, upload->mCubeFace);
+		FreeImage(&image);
+		delete upload;
+		return false;
+	}
+
+	// a newer image replaces the one being uploaded
+	for (size_t i = 0; i < mUploads.size();)
+	{
+		ImageUpload *previous = mUploads[i];
+		if (previous->mTarget == upload->mTarget && (previous->mCubeFace == upload->mCubeFace || upload->mCubeFace == -1))
+		{
+			CancelUpload(previous);
+			mUploads.erase(mUploads.begin() + i);
+			continue;
+		}
+		i++;
+	}
+
+	InitImageTarget(upload->mTarget, &image, upload->mCubeFace);
+	RenderTarget& tgt = *mEvaluationStages[upload->mTarget].mTarget;
+	upload->mTexture = tgt.mGLTexID;
+	if (upload->mLevel)
+	{
+		// only the mips already uploaded are sampled
+		unsigned int textureType = (image.mNumFaces == 1) ? GL_TEXTURE_2D : GL_TEXTURE_CUBE_MAP;
+		glBindTexture(textureType, upload->mTexture);
+		glTexParameteri(textureType, GL_TEXTURE_BASE_LEVEL, image.mNumMips - 1);
+		glBindTexture(textureType, 0);
+	}
+
+	glGenBuffers(1, &upload->mBuffer);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload->mBuffer);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, image.mDataSize, NULL, GL_STREAM_DRAW);
+	void *mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, image.mDataSize, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if (!mapped)
+	{
+		Log("Unable to map upload buffer.\n");
+		CancelUpload(upload);
+		return false;
+	}
+	upload->mbMapped = true;
+	upload->mbCopyStarted = true;
+	upload->mCopyTask.mDestination = mapped;
+	upload->mCopyTask.mImage = image;
+	g_TS.AddTaskSetToPipe(&upload->mCopyTask);
+	return true;
+}
+
+// uploads rows until the budget is spent. Returns true when the texture is complete
+bool Evaluation::ContinueUpload(ImageUpload *upload, unsigned int startTime, unsigned int budgetMs)
+{
+	const Image& image = upload->mImage;
+	unsigned int texelSize = GetTexelSize(image.mFormat);
+	unsigned int inputFormat = glInputFormats[image.mFormat];
+	unsigned int inputType = glInputTypes[image.mFormat];
+	unsigned int textureType = (image.mNumFaces == 1 && upload->mCubeFace == -1) ? GL_TEXTURE_2D : GL_TEXTURE_CUBE_MAP;
+	static const size_t chunkSize = 4 << 20;
+
+	glBindTexture(textureType, upload->mTexture);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload->mBuffer);
+	if (upload->mbMapped)
+	{
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		upload->mbMapped = false;
+	}
+
+	bool done = false;
+	while (SDL_GetTicks() - startTime < budgetMs)
+	{
+		int width = image.mWidth >> upload->mLevel;
+		int height = image.mHeight >> upload->mLevel;
+		int rows = std::max(int(chunkSize / (width * texelSize)), 1);
+		rows = std::min(rows, height - upload->mRow);
+		unsigned int faceTarget = GL_TEXTURE_2D;
+		if (upload->mCubeFace != -1)
+			faceTarget = glCubeFace[upload->mCubeFace];
+		else if (image.mNumFaces != 1)
+			faceTarget = GL_TEXTURE_CUBE_MAP_POSITIVE_X + upload->mFace;
+		size_t offset = GetImageOffset(image, upload->mFace, upload->mLevel) + upload->mRow * width * texelSize;
+		glTexSubImage2D(faceTarget, upload->mLevel, 0, upload->mRow, width, rows, inputFormat, inputType, (void*)offset);
+
+		upload->mRow += rows;
+		if (upload->mRow < height)
+			continue;
+		upload->mRow = 0;
+		upload->mFace++;
+		if (upload->mFace < image.mNumFaces)
+			continue;
+		upload->mFace = 0;
+		if (upload->mCubeFace == -1 && image.mNumMips > 1)
+			glTexParameteri(textureType, GL_TEXTURE_BASE_LEVEL, upload->mLevel);
+		if (!upload->mLevel)
+		{
+			done = true;
+			break;
+		}
+		// a coarser version is ready, children can use it
+		SetTargetDirty(upload->mTarget, true);
+		upload->mLevel--;
+	}
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glBindTexture(textureType, 0);
+	return done;
+}
+
+void Evaluation::ProcessUploads(unsigned int budgetMs)
+{
+	TRACE_SCOPE("ProcessUploads", "upload");
+	std::vector<ImageUpload*> incomingUploads;
+	{
+		std::lock_guard<std::mutex> lock(mUploadMutex);
+		incomingUploads.swap(mIncomingUploads);
+	}
+	for (auto upload : incomingUploads)
+	{
+		if (StartUpload(upload))
+			mUploads.push_back(upload);
+	}
+
+	unsigned int startTime = SDL_GetTicks();
+	for (size_t i = 0; i < mUploads.size();)
+	{
+		ImageUpload *upload = mUploads[i];
+		// the target was released or reused for something else
+		int target = upload->mTarget;
+		if (target >= int(mEvaluationStages.size()) || !mEvaluationStages[target].mTarget || mEvaluationStages[target].mTarget->mGLTexID != upload->mTexture)
+		{
+			CancelUpload(upload);
+			mUploads.erase(mUploads.begin() + i);
+			continue;
+		}
+		if (!upload->mCopyTask.GetIsComplete() || SDL_GetTicks() - startTime >= budgetMs)
+		{
+			i++;
+			continue;
+		}
+		if (ContinueUpload(upload, startTime, budgetMs))
+		{
+			glDeleteBuffers(1, &upload->mBuffer);
+			delete upload;
+			mUploads.erase(mUploads.begin() + i);
+			SetTargetDirty(target, true);
+			continue;
+		}
+		i++;
+	}
+}
+
+void Evaluation::ClearUploads()
+{
+	{
+		std::lock_guard<std::mutex> lock(mUploadMutex);
+		mUploads.insert(mUploads.end(), mIncomingUploads.begin(), mIncomingUploads.end());
+		mIncomingUploads.clear();
+	}
+	for (auto upload : mUploads)
+		CancelUpload(upload);
+	mUploads.clear();
+}
+
+int Evaluation::CubemapFilter(Image *image, int faceSize, int lightingModel, int excludeBase, int glossScale, int glossBias)
+{
+	cmft::Image img;
+	img.m_data = image->mBits;
+	img.m_dataSize = image->mDataSize;
+	img.m_numMips = image->mNumMips;
+	img.m_numFaces = image->mNumFaces;
+	img.m_width = image->mWidth;
+	img.m_height = image->mHeight;
+	img.m_format = (cmft::TextureFormat::Enum)image->mFormat;
+
+	extern unsigned int gCPUCount;
+
+	cmft::setWarningPrintf(Log);
+	cmft::setInfoPrintf(Log);
+
+	faceSize = 16;
+	if (!cmft::imageRadianceFilter(img
+		, faceSize // face size
+		, (cmft::LightingModel::Enum)lightingModel
+		, (excludeBase != 0)
+		, uint8_t(log2(faceSize)) // map mip count
+		, glossScale
+		, glossBias
+		, cmft::EdgeFixup::None
+		, gCPUCount))
+		return EVAL_ERR;
+
+	image->mBits = img.m_data;
+	image->mDataSize = img.m_dataSize;
+	image->mNumMips = img.m_numMips;
+	image->mNumFaces = img.m_numFaces;
+	image->mWidth = img.m_width;
+	image->mHeight = img.m_height;
+	image->mFormat = img.m_format;
+	
+	return EVAL_OK;
+}
+
+int Evaluation::AllocateImage(Image *image)
+{
+	return EVAL_OK;
+}
+
+int Evaluation::FreeImage(Image *image)
+{
+	free(image->mBits);
+	image->mBits = NULL;
+	return EVAL_OK;
 }
 
 int Evaluation::EncodePng(Image *image, std::vector<unsigned char> &pngImage)
 {
 	int outlen;
-	int components = 4; // TODO
-	unsigned char *bits = stbi_write_png_to_mem((unsigned char*)image->mBits, image->mWidth * components, image->mWidth, image->mHeight, components, &outlen);
+	int components = 4;
+	Image converted;
+	converted.mBits = NULL;
+	if (image->mFormat != TextureFormat::RGBA8 && ConvertImageBits(image, &converted, TextureFormat::RGBA8) != EVAL_OK)
+		return EVAL_ERR;
+	unsigned char *bits = stbi_write_png_to_mem((unsigned char*)(converted.mBits ? converted.mBits : image->mBits), image->mWidth * components, image->mWidth, image->mHeight, components, &outlen);
+	free(converted.mBits);
 	if (!bits)
 		return EVAL_ERR;
 	pngImage.resize(outlen);
@@ -790,19 +1561,24 @@ void Evaluation::RecurseGetUse(size_t target, std::vector<size_t>& usedNodes)
 int Evaluation::Evaluate(int target, int width, int height, Image *image)
 {
 	std::vector<size_t> svgEvalList = gEvaluation.mEvaluationOrderList;
-	gEvaluation.mEvaluationOrderList.clear();
+	std::vector<size_t> usedNodes;
+	gEvaluation.RecurseGetUse(target, usedNodes);
+	gEvaluation.SetEvaluationOrder(usedNodes);
 
-	gEvaluation.RecurseGetUse(target, gEvaluation.mEvaluationOrderList);
+	// edit targets keep their content during the baking evaluation. Dirty states are put back so the edit
+	// graph doesn't need to be evaluated again
+	std::vector<uint8_t> dirtyStates = gEvaluation.GetDirtyStates();
 
-	gEvaluation.SetEvaluationMemoryMode(1);
+	gEvaluation.SetEvaluationMemoryMode(1, width, height);
 
 	gEvaluation.RunEvaluation(width, height, true);
 	GetEvaluationImage(target, image);
-	gEvaluation.SetEvaluationMemoryMode(0);
+	Log("Evaluate %dx%d : %d stages, %d targets, peak memory %.1f MB planned, %.1f MB actual\n", width, height, int(usedNodes.size()),
+		int(gEvaluation.mBakingRenderTargets.size()), double(gEvaluation.mPlannedPeakBytes) / (1024.0 * 1024.0), double(gEvaluation.mActualPeakBytes) / (1024.0 * 1024.0));
+	gEvaluation.SetEvaluationMemoryMode(0, width, height);
 
-	gEvaluation.mEvaluationOrderList = svgEvalList;
-
-	gEvaluation.RunEvaluation(256, 256, true);
+	gEvaluation.SetEvaluationOrder(svgEvalList);
+	gEvaluation.SetDirtyStates(dirtyStates);
 	return EVAL_OK;
 }
 
@@ -811,12 +1587,25 @@ static const EValuationFunction evaluationFunctions[] = {
 	{ "ReadImage", (void*)Evaluation::ReadImage },
 	{ "WriteImage", (void*)Evaluation::WriteImage },
 	{ "GetEvaluationImage", (void*)Evaluation::GetEvaluationImage },
+	{ "GetEvaluationImageAsync", (void*)Evaluation::GetEvaluationImageAsync },
 	{ "SetEvaluationImage", (void*)Evaluation::SetEvaluationImage },
 	{ "SetEvaluationImageCube", (void*)Evaluation::SetEvaluationImageCube },
+	{ "SetEvaluationImageAsync", (void*)Evaluation::SetEvaluationImageAsync },
+	{ "SetEvaluationImageCubeAsync", (void*)Evaluation::SetEvaluationImageCubeAsync },
 	{ "AllocateImage", (void*)Evaluation::AllocateImage },
 	{ "FreeImage", (void*)Evaluation::FreeImage },
+	{ "ConvertImage", (void*)Evaluation::ConvertImage },
+	{ "ResizeImage", (void*)Evaluation::ResizeImage },
+	{ "GenerateMips", (void*)Evaluation::GenerateMips },
+	{ "BlendImage", (void*)Evaluation::BlendImage },
+	{ "ConvolveImage", (void*)Evaluation::ConvolveImage },
+	{ "GetImageHistogram", (void*)Evaluation::GetImageHistogram },
+	{ "PremultiplyImage", (void*)Evaluation::PremultiplyImage },
+	{ "SwizzleImage", (void*)Evaluation::SwizzleImage },
 	{ "SetThumbnailImage", (void*)Evaluation::SetThumbnailImage },
 	{ "Evaluate", (void*)Evaluation::Evaluate},
+	{ "EvaluateTiled", (void*)Evaluation::EvaluateTiled},
+	{ "GetMaxTextureSize", (void*)Evaluation::GetMaxTextureSize},
 	{ "SetBlendingMode", (void*)Evaluation::SetBlendingMode},
 	{ "GetEvaluationSize", (void*)Evaluation::GetEvaluationSize},
 	{ "SetEvaluationSize", (void*)Evaluation::SetEvaluationSize },
@@ -825,99 +1614,598 @@ static const EValuationFunction evaluationFunctions[] = {
 	{ "SetProcessing", (void*)Evaluation::SetProcessing},
 	{ "Job", (void*)Evaluation::Job },
 	{ "JobMain", (void*)Evaluation::JobMain },
+	{ "JobParallelFor", (void*)Evaluation::JobParallelFor },
 	{ "memmove", memmove },
 	{ "strcpy", strcpy },
 	{ "strlen", strlen },
 };
 
-typedef int(*jobFunction)(void*);
+typedef int(*jobFunction)(void*);
+
+struct CFunctionTaskSet : enki::ITaskSet
+{
+	CFunctionTaskSet(jobFunction function, void *ptr, unsigned int size) : enki::ITaskSet()
+		, mFunction(function)
+		, mBuffer(malloc(size))
+		, mStage(Evaluation::GetJobStage())
+	{
+		memcpy(mBuffer, ptr, size);
+	}
+	virtual void    ExecuteRange(enki::TaskSetPartition range, uint32_t threadnum)
+	{
+		{
+			TRACE_SCOPE("Job", "job", mStage);
+			Evaluation::JobTimer timer(mStage);
+			mFunction(mBuffer);
+		}
+		free(mBuffer);
+		delete this;
+	}
+	jobFunction mFunction;
+	void *mBuffer;
+	int mStage;
+};
+
+struct CFunctionMainTask : enki::IPinnedTask
+{
+	CFunctionMainTask(jobFunction function, void *ptr, unsigned int size)
+		: enki::IPinnedTask(0) // set pinned thread to 0
+		, mFunction(function)
+		, mBuffer(malloc(size))
+		, mStage(Evaluation::GetJobStage())
+	{
+		memcpy(mBuffer, ptr, size);
+	}
+	virtual void Execute()
+	{
+		{
+			TRACE_SCOPE("JobMain", "job", mStage);
+			Evaluation::JobTimer timer(mStage);
+			mFunction(mBuffer);
+		}
+		free(mBuffer);
+		delete this;
+	}
+	jobFunction mFunction;
+	void *mBuffer;
+	int mStage;
+};
+
+typedef int(*jobChunkFunction)(void*, unsigned int, unsigned int);
+
+struct CFunctionParallelForTaskSet;
+
+// runs the completion of a JobParallelFor once every chunk is done
+struct CFunctionCompletionTaskSet final : enki::ITaskSet
+{
+	CFunctionCompletionTaskSet(CFunctionParallelForTaskSet *parallelFor) : enki::ITaskSet(), mParallelFor(parallelFor)
+	{
+	}
+	virtual void    ExecuteRange(enki::TaskSetPartition, uint32_t);
+	CFunctionParallelForTaskSet *mParallelFor;
+};
+
+struct CFunctionCompletionMainTask final : enki::IPinnedTask
+{
+	CFunctionCompletionMainTask(CFunctionParallelForTaskSet *parallelFor) : enki::IPinnedTask(0), mParallelFor(parallelFor)
+	{
+	}
+	virtual void Execute();
+	CFunctionParallelForTaskSet *mParallelFor;
+};
+
+// enkiTS partitions of [0, count), grain items or more. The payload is copied once and shared by the chunks
+struct CFunctionParallelForTaskSet final : enki::ITaskSet
+{
+	CFunctionParallelForTaskSet(jobChunkFunction function, unsigned int count, unsigned int grain, void *ptr, unsigned int size, jobFunction completion, bool completionOnMain)
+		: enki::ITaskSet(count, grain ? grain : 1)
+		, mFunction(function)
+		, mBuffer(malloc(size))
+		, mRemaining(count)
+		, mCompletion(completion)
+		, mbCompletionOnMain(completionOnMain)
+		, mStage(Evaluation::GetJobStage())
+		, mCompletionTask(this)
+		, mCompletionMainTask(this)
+	{
+		memcpy(mBuffer, ptr, size);
+	}
+	virtual void    ExecuteRange(enki::TaskSetPartition range, uint32_t)
+	{
+		{
+			TRACE_SCOPE("JobParallelFor", "job", mStage);
+			Evaluation::JobTimer timer(mStage);
+			mFunction(mBuffer, range.start, range.end);
+		}
+		const uint32_t count = range.end - range.start;
+		if (mRemaining.fetch_sub(count) == count)
+			AddCompletion();
+	}
+	void AddCompletion()
+	{
+		if (mbCompletionOnMain)
+			g_TS.AddPinnedTask(&mCompletionMainTask);
+		else
+			g_TS.AddTaskSetToPipe(&mCompletionTask);
+	}
+	void Complete();
+	// the scheduler still uses the tasks after they return
+	bool IsDeletable() const { return GetIsComplete() && mCompletionTask.GetIsComplete() && mCompletionMainTask.GetIsComplete(); }
+	jobChunkFunction mFunction;
+	void *mBuffer;
+	std::atomic<uint32_t> mRemaining;
+	jobFunction mCompletion;
+	bool mbCompletionOnMain;
+	int mStage;
+	CFunctionCompletionTaskSet mCompletionTask;
+	CFunctionCompletionMainTask mCompletionMainTask;
+};
+
+// completed sets are deleted by the next JobParallelFor
+static std::mutex gParallelForMutex;
+static std::vector<CFunctionParallelForTaskSet*> gRetiredParallelFors;
+
+static void DeleteRetiredParallelFors()
+{
+	std::lock_guard<std::mutex> lock(gParallelForMutex);
+	auto deletable = std::partition(gRetiredParallelFors.begin(), gRetiredParallelFors.end(), [](CFunctionParallelForTaskSet* parallelFor) { return !parallelFor->IsDeletable(); });
+	for (auto iter = deletable; iter != gRetiredParallelFors.end(); ++iter)
+		delete *iter;
+	gRetiredParallelFors.erase(deletable, gRetiredParallelFors.end());
+}
+
+void Evaluation::ClearParallelForJobs()
+{
+	// completions on the main thread, then every set is done
+	g_TS.RunPinnedTasks();
+	DeleteRetiredParallelFors();
+	if (!gRetiredParallelFors.empty())
+		Log("%d JobParallelFor still running.\n", int(gRetiredParallelFors.size()));
+}
+
+void CFunctionParallelForTaskSet::Complete()
+{
+	if (mCompletion)
+	{
+		TRACE_SCOPE("JobParallelFor completion", "job", mStage);
+		Evaluation::JobTimer timer(mStage);
+		mCompletion(mBuffer);
+	}
+	free(mBuffer);
+	std::lock_guard<std::mutex> lock(gParallelForMutex);
+	gRetiredParallelFors.push_back(this);
+}
+
+void CFunctionCompletionTaskSet::ExecuteRange(enki::TaskSetPartition, uint32_t)
+{
+	mParallelFor->Complete();
+}
+
+void CFunctionCompletionMainTask::Execute()
+{
+	mParallelFor->Complete();
+}
+
+void Evaluation::SetProcessing(int target, int processing)
+{
+	gEvaluation.mEvaluationStages[target].mbProcessing = processing != 0;
+}
+
+int Evaluation::Job(int(*jobFunction)(void*), void *ptr, unsigned int size)
+{
+	g_TS.AddTaskSetToPipe(new CFunctionTaskSet(jobFunction, ptr, size));
+	return EVAL_OK;
+}
+
+int Evaluation::JobMain(int(*jobMainFunction)(void*), void *ptr, unsigned int size)
+{
+	g_TS.AddPinnedTask(new CFunctionMainTask(jobMainFunction, ptr, size));
+	return EVAL_OK;
+}
+
+int Evaluation::JobParallelFor(int(*chunkFunction)(void*, unsigned int, unsigned int), unsigned int count, unsigned int grain, void *ptr, unsigned int size, int(*completionFunction)(void*), int completionOnMain)
+{
+	if (!chunkFunction)
+		return EVAL_ERR;
+	DeleteRetiredParallelFors();
+	CFunctionParallelForTaskSet *parallelFor = new CFunctionParallelForTaskSet(chunkFunction, count, grain, ptr, size, completionFunction, completionOnMain != 0);
+	if (count)
+		g_TS.AddTaskSetToPipe(parallelFor);
+	else
+		parallelFor->AddCompletion();
+	return EVAL_OK;
+}
+
+void Evaluation::SetBlendingMode(int target, int blendSrc, int blendDst)
+{
+	EvaluationStage& evaluation = gEvaluation.mEvaluationStages[target];
+
+	evaluation.mBlendingSrc = blendSrc;
+	evaluation.mBlendingDst = blendDst;
+}
+
+std::string ReplaceAll(std::string str, const std::string& from, const std::string& to)
+{
+	size_t start_pos = 0;
+	while ((start_pos = str.find(from, start_pos)) != std::string::npos) {
+		str.replace(start_pos, from.length(), to);
+		start_pos += to.length(); // Handles case where 'to' is a substring of 'from'
+	}
+	return str;
+}
+
+// EvaluationBlock and sampler units of a node program. Returns the sampler count
+static unsigned int BindProgramSamplers(unsigned int program)
+{
+	int evaluationBlockIndex = glGetUniformBlockIndex(program, "EvaluationBlock");
+	if (evaluationBlockIndex != -1)
+		glUniformBlockBinding(program, evaluationBlockIndex, 2);
+
+	// samplers get consecutive units, in samplerName order
+	unsigned int samplerCount = 0;
+	glUseProgram(program);
+	for (auto name : samplerName)
+	{
+		int location = glGetUniformLocation(program, name);
+		if (location != -1)
+			glUniform1i(location, samplerCount++);
+	}
+	glUseProgram(0);
+	return samplerCount;
+}
+
+static unsigned int BeginNodeProgram(const std::string& baseShader, const std::string& filename, const std::string& text, bool layered, uint64_t& cacheHash)
+{
+	std::string shaderText = ReplaceAll(baseShader, "__NODE__", text);
+	std::string nodeName = ReplaceAll(filename, ".glsl", "");
+	shaderText = ReplaceAll(shaderText, "__FUNCTION__", nodeName + "()");
+
+	return BeginShader(shaderText, filename.c_str(), layered, cacheHash);
+}
+
+// node program with its blocks and sampler units bound
+static unsigned int EndNodeProgram(unsigned int program, const std::string& filename, uint64_t cacheHash, unsigned int& samplerCount)
+{
+	samplerCount = 0;
+	program = EndShader(program, filename.c_str(), cacheHash);
+	if (!program)
+		return 0;
+
+	std::string nodeName = ReplaceAll(filename, ".glsl", "");
+	int parameterBlockIndex = glGetUniformBlockIndex(program, (nodeName + "Block").c_str());
+	if (parameterBlockIndex != -1)
+		glUniformBlockBinding(program, parameterBlockIndex, 1);
+
+	samplerCount = BindProgramSamplers(program);
+	return program;
+}
+
+static unsigned int LoadNodeProgram(const std::string& baseShader, const std::string& filename, const std::string& text, bool layered, unsigned int& samplerCount)
+{
+	uint64_t cacheHash;
+	unsigned int program = BeginNodeProgram(baseShader, filename, text, layered, cacheHash);
+	return EndNodeProgram(program, filename, cacheHash, samplerCount);
+}
+
+unsigned int Evaluation::GetLayeredProgram(size_t nodeType)
+{
+	Evaluator& evaluator = mEvaluatorPerNodeType[nodeType];
+	if (evaluator.mbLayeredCompiled)
+		return evaluator.mGLSLLayeredProgram;
+	evaluator.mbLayeredCompiled = true;
+
+	for (auto& script : mEvaluatorScripts)
+	{
+		if (script.second.mNodeType != int(nodeType) || script.first.find(".glsl") == std::string::npos)
+			continue;
+		unsigned int samplerCount;
+		evaluator.mGLSLLayeredProgram = LoadNodeProgram(mEvaluatorScripts["Shader.glsl"].mText, script.first, script.second.mText, true, samplerCount);
+		if (!evaluator.mGLSLLayeredProgram)
+			Log("%s - No layered rendering, cubemap faces are rendered one by one.\n", script.first.c_str());
+		break;
+	}
+	return evaluator.mGLSLLayeredProgram;
+}
+
+unsigned int Evaluation::GetTiledProgram(size_t nodeType)
+{
+	Evaluator& evaluator = mEvaluatorPerNodeType[nodeType];
+	if (evaluator.mbTiledCompiled)
+		return evaluator.mGLSLTiledProgram;
+	evaluator.mbTiledCompiled = true;
+
+	for (auto& script : mEvaluatorScripts)
+	{
+		if (script.second.mNodeType != int(nodeType) || script.first.find(".glsl") == std::string::npos)
+			continue;
+		unsigned int samplerCount;
+		evaluator.mGLSLTiledProgram = LoadNodeProgram("#define TILED\n" + mEvaluatorScripts["Shader.glsl"].mText, script.first, script.second.mText, false, samplerCount);
+		if (!evaluator.mGLSLTiledProgram)
+			Log("%s - Tiled program not compiled, tiles sample the whole inputs.\n", script.first.c_str());
+		break;
+	}
+	return evaluator.mGLSLTiledProgram;
+}
+
+// the only read of its input a node must do to be fused after another one
+static const std::string PointwiseRead = "texture(Sampler0, vUV)";
+
+// parameter block binding of a fused chain stage. 2 is EvaluationBlock
+static unsigned int FusedBlockBinding(size_t stage)
+{
+	return stage ? (unsigned int)(2 + stage) : 1;
+}
+
+bool Evaluation::IsPointwiseNode(size_t nodeType) const
+{
+	for (auto& script : mEvaluatorScripts)
+	{
+		if (script.second.mNodeType != int(nodeType) || script.first.find(".glsl") == std::string::npos)
+			continue;
+		// the same texel of Sampler0, once. Neighbours, other samplers or evaluation infos can't be fused
+		const std::string& text = script.second.mText;
+		size_t readPosition = text.find(PointwiseRead);
+		if (readPosition == std::string::npos || text.find(PointwiseRead, readPosition + 1) != std::string::npos)
+			return false;
+		std::string remaining = ReplaceAll(text, PointwiseRead, "");
+		return remaining.find("Sampler") == std::string::npos && remaining.find("EvaluationParam") == std::string::npos;
+	}
+	return false;
+}
 
-struct CFunctionTaskSet : enki::ITaskSet
+bool Evaluation::GetFusedProgram(const std::vector<size_t>& stages, FusedProgram& fusedProgram)
 {
-	CFunctionTaskSet(jobFunction function, void *ptr, unsigned int size) : enki::ITaskSet()
-		, mFunction(function)
-		, mBuffer(malloc(size))
+	std::string key;
+	for (auto stage : stages)
+		key += (key.empty() ? "" : ">") + mEvaluationStages[stage].mNodeTypename;
+
+	auto iter = mFusedPrograms.find(key);
+	if (iter == mFusedPrograms.end())
 	{
-		memcpy(mBuffer, ptr, size);
+		// each node calls the function of the previous one instead of sampling its target
+		std::string text;
+		std::string function;
+		for (auto stage : stages)
+		{
+			const std::string& nodeName = mEvaluationStages[stage].mNodeTypename;
+			std::string nodeText = mEvaluatorScripts[nodeName + ".glsl"].mText;
+			if (!function.empty())
+				nodeText = ReplaceAll(nodeText, PointwiseRead, function);
+			text += nodeText + "\n";
+			function = nodeName + "()";
+		}
+		std::string shaderText = ReplaceAll(mEvaluatorScripts["Shader.glsl"].mText, "__NODE__", text);
+		shaderText = ReplaceAll(shaderText, "__FUNCTION__", function);
+
+		FusedProgram program;
+		program.mProgram = LoadShader(shaderText, key.c_str());
+		program.mSamplerCount = 0;
+		if (program.mProgram)
+		{
+			for (size_t i = 0; i < stages.size(); i++)
+			{
+				int parameterBlockIndex = glGetUniformBlockIndex(program.mProgram, (mEvaluationStages[stages[i]].mNodeTypename + "Block").c_str());
+				if (parameterBlockIndex != -1)
+					glUniformBlockBinding(program.mProgram, parameterBlockIndex, FusedBlockBinding(i));
+			}
+			program.mSamplerCount = BindProgramSamplers(program.mProgram);
+		}
+		else
+		{
+			Log("%s - Fused program not compiled, nodes are evaluated one by one.\n", key.c_str());
+		}
+		iter = mFusedPrograms.insert(std::make_pair(key, program)).first;
 	}
-	virtual void    ExecuteRange(enki::TaskSetPartition range, uint32_t threadnum)
+	fusedProgram = iter->second;
+	return fusedProgram.mProgram != 0;
+}
+
+void Evaluation::ClearFusedPrograms()
+{
+	for (auto& program : mFusedPrograms)
 	{
-		mFunction(mBuffer);
-		free(mBuffer);
-		delete this;
+		if (program.second.mProgram)
+			glDeleteProgram(program.second.mProgram);
 	}
-	jobFunction mFunction;
-	void *mBuffer;
-};
+	mFusedPrograms.clear();
+}
 
-struct CFunctionMainTask : enki::IPinnedTask
+void Evaluation::ClearEvaluators()
 {
-	CFunctionMainTask(jobFunction function, void *ptr, unsigned int size)
-		: enki::IPinnedTask(0) // set pinned thread to 0
-		, mFunction(function)
-		, mBuffer(malloc(size))
+	ClearFusedPrograms();
+	// clear. Node type programs are the ones of their script
+	for (auto& script : mEvaluatorScripts)
 	{
-		memcpy(mBuffer, ptr, size);
+		if (script.second.mProgram)
+			glDeleteProgram(script.second.mProgram);
+		script.second.mProgram = 0;
+		script.second.mSamplerCount = 0;
+		script.second.mCompileState = ProgramNotCompiled;
 	}
-	virtual void Execute()
+	for (auto mem : mRetiredCode)
+		free(mem);
+	mRetiredCode.clear();
+	for (auto& program : mEvaluatorPerNodeType)
 	{
-		mFunction(mBuffer);
-		free(mBuffer);
-		delete this;
+		if (program.mGLSLLayeredProgram)
+			glDeleteProgram(program.mGLSLLayeredProgram);
+		if (program.mGLSLTiledProgram)
+			glDeleteProgram(program.mGLSLTiledProgram);
+		if (program.mMem)
+			free(program.mMem);
 	}
-	jobFunction mFunction;
-	void *mBuffer;
-};
+}
 
-void Evaluation::SetProcessing(int target, int processing)
+void Evaluation::BeginScriptProgram(const std::string& filename, EvaluatorScript& shader)
 {
-	gEvaluation.mEvaluationStages[target].mbProcessing = processing != 0;
+	shader.mProgram = BeginNodeProgram(mEvaluatorScripts["Shader.glsl"].mText, filename, shader.mText, false, shader.mCacheHash);
+	shader.mCompileState = ProgramCompiling;
 }
 
-int Evaluation::Job(int(*jobFunction)(void*), void *ptr, unsigned int size)
+bool Evaluation::PrepareNodeProgram(size_t nodeType, bool wait)
 {
-	g_TS.AddTaskSetToPipe(new CFunctionTaskSet(jobFunction, ptr, size));
-	return EVAL_OK;
+	Evaluator& evaluator = mEvaluatorPerNodeType[nodeType];
+	if (evaluator.mbProgramReady)
+		return true;
+	for (auto& script : mEvaluatorScripts)
+	{
+		if (script.second.mNodeType != int(nodeType) || script.first.find(".glsl") == std::string::npos)
+			continue;
+		EvaluatorScript& shader = script.second;
+		if (shader.mCompileState == ProgramNotCompiled)
+			BeginScriptProgram(script.first, shader);
+		if (shader.mCompileState == ProgramCompiling || shader.mCompileState == ProgramCompilingShown)
+		{
+			// programs from the program cache are ready at once
+			if (!wait && mbParallelShaderCompile && shader.mCacheHash)
+			{
+				GLint completed = 0;
+				glGetProgramiv(shader.mProgram, GL_COMPLETION_STATUS_ARB, &completed);
+				if (!completed)
+					return false;
+			}
+			else if (!wait && shader.mCacheHash && shader.mCompileState == ProgramCompiling)
+			{
+				// without parallel compilation, the query would wait as long as linking. The processing
+				// animation is shown for a frame, then the link is waited for
+				shader.mCompileState = ProgramCompilingShown;
+				return false;
+			}
+			shader.mProgram = EndNodeProgram(shader.mProgram, script.first, shader.mCacheHash, shader.mSamplerCount);
+			shader.mCompileState = ProgramCompiled;
+		}
+		evaluator.mGLSLProgram = shader.mProgram;
+		evaluator.mSamplerCount = shader.mSamplerCount;
+		break;
+	}
+	evaluator.mbProgramReady = true;
+	LogEvaluatorsReady();
+	return true;
 }
 
-int Evaluation::JobMain(int(*jobMainFunction)(void*), void *ptr, unsigned int size)
+void Evaluation::LogEvaluatorsReady()
 {
-	g_TS.AddPinnedTask(new CFunctionMainTask(jobMainFunction, ptr, size));
-	return EVAL_OK;
+	if (mbEvaluatorsReadyLogged)
+		return;
+	int programCount = 0;
+	int compiledCount = 0;
+	for (auto& script : mEvaluatorScripts)
+	{
+		const EvaluatorScript& shader = script.second;
+		if (shader.mNodeType == -1 || script.first.find(".glsl") == std::string::npos)
+			continue;
+		if (shader.mCompileState != ProgramCompiled)
+			return;
+		programCount++;
+		// cache hash is kept for programs compiled from source
+		if (shader.mCacheHash)
+			compiledCount++;
+	}
+	if (!programCount)
+		return;
+	mbEvaluatorsReadyLogged = true;
+	Log("%s startup: %d GLSL programs in use ready %.1f ms after loading the evaluators, %d compiled from source\n", compiledCount ? "Cold" : "Warm", programCount, GetProfilerTime(mEvaluatorsTicks), compiledCount);
 }
 
-void Evaluation::SetBlendingMode(int target, int blendSrc, int blendDst)
+// libtcc 0.9.27 keeps the compiler state in globals, only one TCCState compiles at a time
+static std::mutex gTCCMutex;
+
+void Evaluation::CompileC(CCompilation& compilation)
 {
-	EvaluationStage& evaluation = gEvaluation.mEvaluationStages[target];
+	const std::string& filename = compilation.mFilename;
+	try
+	{
+		if (compilation.mText.empty())
+		{
+			std::ifstream t(compilation.mDirectory + filename);
+			if (!t.good())
+			{
+				Log("%s - Unable to load file.\n", filename.c_str());
+				return;
+			}
+			compilation.mText = std::string((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
+		}
+		compilation.mbLoaded = true;
 
-	evaluation.mBlendingSrc = blendSrc;
-	evaluation.mBlendingDst = blendDst;
-}
+		if (compilation.mTier == CompilerFromSource)
+			compilation.mTier = (compilation.mText.find("#define IMOGEN_NATIVE") != std::string::npos) ? CompilerNative : CompilerTCC;
+		if (compilation.mTier == CompilerNative)
+		{
+			// the system compiler runs outside of the tcc lock, several workers build at the same time
+			static const std::vector<std::pair<const char*, void*> > apiFunctions = []() {
+				std::vector<std::pair<const char*, void*> > functions;
+				for (auto& evaluationFunction : evaluationFunctions)
+					functions.push_back(std::make_pair(evaluationFunction.szFunctionName, evaluationFunction.function));
+				return functions;
+			}();
+			TRACE_SCOPE(filename.c_str(), "native compile");
+			if (CompileNativeC(compilation, apiFunctions))
+				return;
+			compilation.mTier = CompilerTCC;
+		}
 
-std::string ReplaceAll(std::string str, const std::string& from, const std::string& to)
-{
-	size_t start_pos = 0;
-	while ((start_pos = str.find(from, start_pos)) != std::string::npos) {
-		str.replace(start_pos, from.length(), to);
-		start_pos += to.length(); // Handles case where 'to' is a substring of 'from'
+		std::lock_guard<std::mutex> lock(gTCCMutex);
+		TRACE_SCOPE(filename.c_str(), "compile");
+		TCCState *s = tcc_new();
+
+		int *noLib = (int*)s;
+		noLib[2] = 1; // no stdlib
+
+		tcc_set_error_func(s, 0, libtccErrorFunc);
+		tcc_add_include_path(s, "C\\");
+		tcc_set_output_type(s, TCC_OUTPUT_MEMORY);
+
+		if (tcc_compile_string(s, compilation.mText.c_str()) != 0)
+		{
+			Log("%s - Compilation error!\n", filename.c_str());
+			tcc_delete(s);
+			return;
+		}
+
+		for (auto& evaluationFunction : evaluationFunctions)
+			tcc_add_symbol(s, evaluationFunction.szFunctionName, evaluationFunction.function);
+
+		int size = tcc_relocate(s, NULL);
+		if (size == -1)
+		{
+			Log("%s - Libtcc unable to relocate program!\n", filename.c_str());
+			tcc_delete(s);
+			return;
+		}
+		compilation.mMem = malloc(size);
+		tcc_relocate(s, compilation.mMem);
+
+		*(void**)(&compilation.mCFunction) = tcc_get_symbol(s, "main");
+		if (!compilation.mCFunction)
+		{
+			Log("%s - No main function!\n", filename.c_str());
+		}
+		tcc_delete(s);
+	}
+	catch (...)
+	{
+		Log("Error at compiling %s", filename.c_str());
 	}
-	return str;
 }
 
-void Evaluation::ClearEvaluators()
+struct CompileCTaskSet : enki::ITaskSet
 {
-	// clear
-	for (auto& program : mEvaluatorPerNodeType)
+	CompileCTaskSet(std::vector<Evaluation::CCompilation>& compilations) : enki::ITaskSet(uint32_t(compilations.size()))
+		, mCompilations(compilations)
 	{
-		if (program.mGLSLProgram)
-			glDeleteProgram(program.mGLSLProgram);
-		if (program.mMem)
-			free(program.mMem);
 	}
-}
+	virtual void ExecuteRange(enki::TaskSetPartition range, uint32_t)
+	{
+		for (uint32_t i = range.start; i < range.end; i++)
+			Evaluation::CompileC(mCompilations[i]);
+	}
+	std::vector<Evaluation::CCompilation>& mCompilations;
+};
 
 void Evaluation::SetEvaluators(const std::vector<EvaluatorFile>& evaluatorfilenames)
 {
+	mEvaluatorsTicks = GetProfilerTicks();
+	mbEvaluatorsReadyLogged = mBackend != BACKEND_GLSL;
 	ClearEvaluators();
 
 	mEvaluatorPerNodeType.clear();
@@ -941,7 +2229,26 @@ void Evaluation::SetEvaluators(const std::vector<EvaluatorFile>& evaluatorfilena
 		}
 	}
 
-	std::string baseShader = mEvaluatorScripts["Shader.glsl"].mText;
+	// C nodes are compiled by the workers while GLSL programs are started
+	std::vector<CCompilation> compilations;
+	for (auto& file : evaluatorfilenames)
+	{
+		if (file.mEvaluatorType != EVALUATOR_C)
+			continue;
+		CCompilation compilation;
+		compilation.mDirectory = file.mDirectory;
+		compilation.mFilename = file.mFilename;
+		compilations.push_back(compilation);
+	}
+	CompileCTaskSet compileCTask(compilations);
+	if (!compilations.empty())
+		g_TS.AddTaskSetToPipe(&compileCTask);
+
+	// with parallel compilation every program is started, the driver threads build them. Otherwise a program
+	// is compiled when its node type is first added. Types already used, when reloading, are started now
+	const uint64_t compileStart = GetProfilerTicks();
+	const int cacheHits = ProgramCacheGetHits();
+	int programCount = 0;
 	for (auto& file : evaluatorfilenames)
 	{
 		if (file.mEvaluatorType != EVALUATOR_GLSL)
@@ -951,120 +2258,259 @@ void Evaluation::SetEvaluators(const std::vector<EvaluatorFile>& evaluatorfilena
 		if (filename == "Shader.glsl")
 			continue;
 
+		// scripts are still needed by AddEvaluation. CPU kernels are used instead of the programs
+		if (mBackend == BACKEND_CPU)
+			continue;
+
 		EvaluatorScript& shader = mEvaluatorScripts[filename];
-		std::string shaderText = ReplaceAll(baseShader, "__NODE__", shader.mText);
-		std::string nodeName = ReplaceAll(filename, ".glsl", "");
-		shaderText = ReplaceAll(shaderText, "__FUNCTION__", nodeName + "()");
+		if (mbParallelShaderCompile || shader.mNodeType != -1)
+		{
+			BeginScriptProgram(filename, shader);
+			programCount++;
+		}
+	}
 
-		unsigned int program = LoadShader(shaderText, filename.c_str());
+	if (programCount)
+		Log("%d GLSL programs started in %.1f ms, %d from the program cache\n", programCount, GetProfilerTime(compileStart), ProgramCacheGetHits() - cacheHits);
+
+	if (!mUniformRing.mBuffer && mBackend == BACKEND_GLSL)
+		InitUniformRing();
+
+	// C programs compiled by the workers meanwhile
+	if (!compilations.empty())
+		g_TS.WaitforTaskSet(&compileCTask);
+	for (auto& compilation : compilations)
+	{
+		if (!compilation.mbLoaded)
+			continue;
+		if (mEvaluatorScripts.find(compilation.mFilename) == mEvaluatorScripts.end())
+			mEvaluatorScripts[compilation.mFilename] = EvaluatorScript(compilation.mText);
+		else
+			mEvaluatorScripts[compilation.mFilename].mText = compilation.mText;
 
-		int parameterBlockIndex = glGetUniformBlockIndex(program, (nodeName + "Block").c_str());
-		if (parameterBlockIndex != -1)
-			glUniformBlockBinding(program, parameterBlockIndex, 1);
+		EvaluatorScript& program = mEvaluatorScripts[compilation.mFilename];
+		program.mCFunction = compilation.mCFunction;
+		program.mMem = compilation.mMem;
+		if (program.mNodeType != -1)
+		{
+			mEvaluatorPerNodeType[program.mNodeType].mCFunction = program.mCFunction;
+			mEvaluatorPerNodeType[program.mNodeType].mMem = program.mMem;
+		}
+	}
+}
 
-		parameterBlockIndex = glGetUniformBlockIndex(program, "EvaluationBlock");
-		if (parameterBlockIndex != -1)
-			glUniformBlockBinding(program, parameterBlockIndex, 2);
-		shader.mProgram = program;
-		if (shader.mNodeType != -1)
-			mEvaluatorPerNodeType[shader.mNodeType].mGLSLProgram = program;
+void Evaluation::SetNodeTypeDirty(int nodeType)
+{
+	// result cache keys include the sources: results of the previous code are not found anymore, in memory and
+	// on disk. Shader.glsl is part of every GLSL hash, they are all computed again
+	for (auto& evaluator : mEvaluatorPerNodeType)
+		evaluator.mCodeHash = 0;
+	for (size_t i = 0; i < mEvaluationStages.size(); i++)
+	{
+		if (int(mEvaluationStages[i].mNodeType) == nodeType)
+			SetTargetDirty(i);
 	}
+}
 
-	if (!gEvaluation.mEvaluationStateGLSLBuffer)
+void Evaluation::ReloadNodeProgram(const std::string& filename, EvaluatorScript& shader)
+{
+	// the previous program is used until the new one is linked
+	unsigned int samplerCount;
+	unsigned int program = LoadNodeProgram(mEvaluatorScripts["Shader.glsl"].mText, filename, shader.mText, false, samplerCount);
+	if (!program)
 	{
-		glGenBuffers(1, &mEvaluationStateGLSLBuffer);
-		glBindBuffer(GL_UNIFORM_BUFFER, mEvaluationStateGLSLBuffer);
+		Log("%s - Previous program is kept.\n", filename.c_str());
+		return;
+	}
+	if (shader.mProgram)
+		glDeleteProgram(shader.mProgram);
+	shader.mProgram = program;
+	shader.mSamplerCount = samplerCount;
+	shader.mCompileState = ProgramCompiled;
+	shader.mCacheHash = 0;
+	if (shader.mNodeType == -1)
+		return;
 
-		glBufferData(GL_UNIFORM_BUFFER, sizeof(EvaluationInfo), NULL, GL_DYNAMIC_DRAW);
-		glBindBufferBase(GL_UNIFORM_BUFFER, 2, mEvaluationStateGLSLBuffer);
-		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	Evaluator& evaluator = mEvaluatorPerNodeType[shader.mNodeType];
+	evaluator.mGLSLProgram = program;
+	evaluator.mSamplerCount = samplerCount;
+	evaluator.mbProgramReady = true;
+	if (evaluator.mGLSLLayeredProgram)
+		glDeleteProgram(evaluator.mGLSLLayeredProgram);
+	evaluator.mGLSLLayeredProgram = 0;
+	evaluator.mbLayeredCompiled = false;
+	if (evaluator.mGLSLTiledProgram)
+		glDeleteProgram(evaluator.mGLSLTiledProgram);
+	evaluator.mGLSLTiledProgram = 0;
+	evaluator.mbTiledCompiled = false;
+	SetNodeTypeDirty(shader.mNodeType);
+}
+
+void Evaluation::ReloadEvaluator(const EvaluatorFile& file)
+{
+	std::ifstream t(file.mDirectory + file.mFilename);
+	if (!t.good())
+	{
+		Log("%s - Unable to load file.\n", file.mFilename.c_str());
+		return;
 	}
+	std::string text((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
+	auto iter = mEvaluatorScripts.find(file.mFilename);
+	if (iter != mEvaluatorScripts.end() && iter->second.mText == text)
+		return;
+	TRACE_SCOPE(file.mFilename.c_str(), "reload");
 
-	// C
-	for (auto& file : evaluatorfilenames)
+	if (file.mEvaluatorType == EVALUATOR_GLSL)
 	{
-		if (file.mEvaluatorType != EVALUATOR_C)
-			continue;
-		const std::string filename = file.mFilename;
-		try
+		mEvaluatorScripts[file.mFilename].mText = text;
+		// scripts are still needed by AddEvaluation. CPU kernels are used instead of the programs
+		if (mBackend == BACKEND_CPU)
+			return;
+		ClearFusedPrograms();
+		if (file.mFilename != "Shader.glsl")
 		{
-			std::ifstream t(file.mDirectory + filename);
-			if (!t.good())
+			ReloadNodeProgram(file.mFilename, mEvaluatorScripts[file.mFilename]);
+			return;
+		}
+		for (auto& script : mEvaluatorScripts)
+		{
+			EvaluatorScript& shader = script.second;
+			if (script.first == "Shader.glsl" || script.first.find(".glsl") == std::string::npos || shader.mCompileState == ProgramNotCompiled)
+				continue;
+			if (shader.mNodeType != -1)
 			{
-				Log("%s - Unable to load file.\n", filename.c_str());
+				ReloadNodeProgram(script.first, shader);
 				continue;
 			}
-			std::string str((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
-			if (mEvaluatorScripts.find(filename) == mEvaluatorScripts.end())
-				mEvaluatorScripts[filename] = EvaluatorScript(str);
-			else
-				mEvaluatorScripts[filename].mText = str;
+			// not used yet, compiled again by the first AddEvaluation
+			if (shader.mProgram)
+				glDeleteProgram(shader.mProgram);
+			shader.mProgram = 0;
+			shader.mCompileState = ProgramNotCompiled;
+		}
+		return;
+	}
 
-			EvaluatorScript& program = mEvaluatorScripts[filename];
-			TCCState *s = tcc_new();
+	CCompilation compilation;
+	compilation.mDirectory = file.mDirectory;
+	compilation.mFilename = file.mFilename;
+	CompileC(compilation);
+	if (!compilation.mCFunction)
+	{
+		Log("%s - Previous program is kept.\n", file.mFilename.c_str());
+		if (compilation.mMem)
+			free(compilation.mMem);
+		return;
+	}
+	EvaluatorScript& program = mEvaluatorScripts[file.mFilename];
+	program.mText = compilation.mText;
+	if (program.mMem)
+		mRetiredCode.push_back(program.mMem);
+	program.mCFunction = compilation.mCFunction;
+	program.mMem = compilation.mMem;
+	if (program.mNodeType != -1)
+	{
+		mEvaluatorPerNodeType[program.mNodeType].mCFunction = program.mCFunction;
+		mEvaluatorPerNodeType[program.mNodeType].mMem = program.mMem;
+		SetNodeTypeDirty(program.mNodeType);
+	}
+}
 
-			int *noLib = (int*)s;
-			noLib[2] = 1; // no stdlib
+void Evaluation::InitUniformRing()
+{
+	static const size_t uniformRingSize = 1 << 20;
+	GLint alignment = 256;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	glGenBuffers(1, &mUniformRing.mBuffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, mUniformRing.mBuffer);
+	glBufferData(GL_UNIFORM_BUFFER, uniformRingSize, NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	mUniformRing.mSize = uniformRingSize;
+	mUniformRing.mAlignment = size_t(std::max(alignment, 1));
+	mUniformRing.mHead = 0;
+	mUniformRing.mQuarter = 0;
+}
 
-			tcc_set_error_func(s, 0, libtccErrorFunc);
-			tcc_add_include_path(s, "C\\");
-			tcc_set_output_type(s, TCC_OUTPUT_MEMORY);
+size_t Evaluation::WriteUniforms(const void *data, size_t size)
+{
+	UniformRing& ring = mUniformRing;
+	const size_t quarterSize = ring.mSize / 4;
+	if (size > quarterSize)
+	{
+		Log("Uniform block of %d bytes is too big.\n", int(size));
+		size = quarterSize;
+	}
+	size_t offset = (ring.mHead + ring.mAlignment - 1) / ring.mAlignment * ring.mAlignment;
+	if (offset + size > (ring.mQuarter + 1) * quarterSize)
+	{
+		ring.mFences[ring.mQuarter] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		ring.mQuarter = (ring.mQuarter + 1) & 3;
+		if (ring.mFences[ring.mQuarter])
+		{
+			// the GPU is more than 3 quarters behind
+			glClientWaitSync((GLsync)ring.mFences[ring.mQuarter], GL_SYNC_FLUSH_COMMANDS_BIT, GLuint64(1000000000));
+			glDeleteSync((GLsync)ring.mFences[ring.mQuarter]);
+			ring.mFences[ring.mQuarter] = NULL;
+		}
+		offset = ring.mQuarter * quarterSize;
+	}
 
-			if (tcc_compile_string(s, program.mText.c_str()) != 0)
-			{
-				Log("%s - Compilation error!\n", filename.c_str());
-				continue;
-			}
+	glBindBuffer(GL_UNIFORM_BUFFER, ring.mBuffer);
+	void *ptr = glMapBufferRange(GL_UNIFORM_BUFFER, offset, size, GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+	if (ptr)
+	{
+		memcpy(ptr, data, size);
+		glUnmapBuffer(GL_UNIFORM_BUFFER);
+	}
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	ring.mHead = offset + size;
+	return offset;
+}
 
-			for (auto& evaluationFunction : evaluationFunctions)
-				tcc_add_symbol(s, evaluationFunction.szFunctionName, evaluationFunction.function);
+static uint32_t GetSamplerKey(const InputSampler& inputSampler)
+{
+	return (inputSampler.mWrapU & 0xFF) | ((inputSampler.mWrapV & 0xFF) << 8) | ((inputSampler.mFilterMin & 0xFF) << 16) | ((inputSampler.mFilterMag & 0xFF) << 24);
+}
 
-			int size = tcc_relocate(s, NULL);
-			if (size == -1)
-			{
-				Log("%s - Libtcc unable to relocate program!\n", filename.c_str());
-				continue;
-			}
-			program.mMem = malloc(size);
-			tcc_relocate(s, program.mMem);
+unsigned int Evaluation::GetSamplerObject(const InputSampler& inputSampler)
+{
+	uint32_t key = GetSamplerKey(inputSampler);
+	auto iter = mSamplerObjects.find(key);
+	if (iter != mSamplerObjects.end())
+		return iter->second;
 
-			*(void**)(&program.mCFunction) = tcc_get_symbol(s, "main");
-			if (!program.mCFunction)
-			{
-				Log("%s - No main function!\n", filename.c_str());
-			}
-			tcc_delete(s);
+	unsigned int sampler;
+	glGenSamplers(1, &sampler);
+	glSamplerParameteri(sampler, GL_TEXTURE_MIN_FILTER, filter[inputSampler.mFilterMin]);
+	glSamplerParameteri(sampler, GL_TEXTURE_MAG_FILTER, filter[inputSampler.mFilterMag]);
+	glSamplerParameteri(sampler, GL_TEXTURE_WRAP_S, wrap[inputSampler.mWrapU]);
+	glSamplerParameteri(sampler, GL_TEXTURE_WRAP_T, wrap[inputSampler.mWrapV]);
+	mSamplerObjects[key] = sampler;
+	return sampler;
+}
 
-			if (program.mNodeType != -1)
-			{
-				mEvaluatorPerNodeType[program.mNodeType].mCFunction = program.mCFunction;
-				mEvaluatorPerNodeType[program.mNodeType].mMem = program.mMem;
-			}
-		}
-		catch (...)
-		{
-			Log("Error at compiling %s", filename.c_str());
-		}
-	}
+void Evaluation::UnbindSamplers()
+{
+	for (unsigned int i = 0; i < mBoundSamplerCount; i++)
+		glBindSampler(i, 0);
+	mBoundSamplerCount = 0;
 }
 
-void Evaluation::BindGLSLParameters(EvaluationStage& stage)
+void Evaluation::ClearGLSLBindings()
 {
-	if (!stage.mParametersBuffer)
-	{
-		glGenBuffers(1, &stage.mParametersBuffer);
-		glBindBuffer(GL_UNIFORM_BUFFER, stage.mParametersBuffer);
+	for (auto& samplerObject : mSamplerObjects)
+		glDeleteSamplers(1, &samplerObject.second);
+	mSamplerObjects.clear();
 
-		glBufferData(GL_UNIFORM_BUFFER, stage.mParametersSize, stage.mParameters, GL_DYNAMIC_DRAW);
-		glBindBufferBase(GL_UNIFORM_BUFFER, 1, stage.mParametersBuffer);
-		glBindBuffer(GL_UNIFORM_BUFFER, 0);
-	}
-	else
+	UniformRing& ring = mUniformRing;
+	for (auto& fence : ring.mFences)
 	{
-		glBindBuffer(GL_UNIFORM_BUFFER, stage.mParametersBuffer);
-		glBufferData(GL_UNIFORM_BUFFER, stage.mParametersSize, stage.mParameters, GL_DYNAMIC_DRAW);
-		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		if (fence)
+			glDeleteSync((GLsync)fence);
 	}
+	if (ring.mBuffer)
+		glDeleteBuffers(1, &ring.mBuffer);
+	memset(&ring, 0, sizeof(UniformRing));
 }
 
 void Evaluation::SetMouseInfos(EvaluationInfo &evaluationInfo, EvaluationStage &evaluationStage) const
@@ -1074,19 +2520,36 @@ void Evaluation::SetMouseInfos(EvaluationInfo &evaluationInfo, EvaluationStage &
 	evaluationInfo.mouse[2] = evaluationStage.mLButDown ? 1.f : 0.f;
 	evaluationInfo.mouse[3] = evaluationStage.mRButDown ? 1.f : 0.f;
 }
-void Evaluation::EvaluateGLSL(EvaluationStage& evaluationStage, EvaluationInfo& evaluationInfo)
+void Evaluation::EvaluateGLSL(EvaluationStage& evaluationStage, EvaluationInfo& evaluationInfo, const FusedChain *fusedChain)
 {
-	const Input& input = evaluationStage.mInput;
+	// a fused chain samples the inputs of its first stage and renders in the target of the last one
+	EvaluationStage& inputStage = fusedChain ? mEvaluationStages[fusedChain->mStages[0]] : evaluationStage;
+	const Input& input = inputStage.mInput;
 
 	RenderTarget* tgt = evaluationStage.mTarget;
+	unsigned int program = fusedChain ? fusedChain->mProgram.mProgram : mEvaluatorPerNodeType[evaluationStage.mNodeType].mGLSLProgram;
+	// cubemap in one draw when the driver can, face by face otherwise
+	unsigned int layeredProgram = 0;
+	if (!evaluationInfo.uiPass && !fusedChain && tgt->mImage.mNumFaces == 6 && !mbTiling)
+		layeredProgram = GetLayeredProgram(evaluationStage.mNodeType);
+	// only tiles pay the uv remap of their input samples
+	if (!evaluationInfo.uiPass && !fusedChain && mbTiling)
+	{
+		unsigned int tiledProgram = GetTiledProgram(evaluationStage.mNodeType);
+		if (tiledProgram)
+			program = tiledProgram;
+	}
 	if (!evaluationInfo.uiPass)
 	{
-		if (tgt->mImage.mNumFaces == 6)
+		if (layeredProgram)
+			tgt->BindAsLayeredCubeTarget();
+		else if (tgt->mImage.mNumFaces == 6)
 			tgt->BindAsCubeTarget();
 		else
 			tgt->BindAsTarget();
 	}
-	unsigned int program = mEvaluatorPerNodeType[evaluationStage.mNodeType].mGLSLProgram;
+	if (layeredProgram)
+		program = layeredProgram;
 	const int blendOps[] = { evaluationStage.mBlendingSrc, evaluationStage.mBlendingDst };
 	unsigned int blend[] = { GL_ONE, GL_ZERO };
 
@@ -1099,8 +2562,8 @@ void Evaluation::EvaluateGLSL(EvaluationStage& evaluationStage, EvaluationInfo&
 
 	evaluationInfo.targetIndex = 0;
 	memcpy(evaluationInfo.inputIndices, input.mInputs, sizeof(evaluationInfo.inputIndices));
-	evaluationInfo.forcedDirty = evaluationStage.mbForceEval ? 1 : 0;
-	SetMouseInfos(evaluationInfo, evaluationStage);
+	evaluationInfo.forcedDirty = inputStage.mbForceEval ? 1 : 0;
+	SetMouseInfos(evaluationInfo, inputStage);
 	//evaluationInfo.uiPass = 1;
 
 	glEnable(GL_BLEND);
@@ -1108,6 +2571,66 @@ void Evaluation::EvaluateGLSL(EvaluationStage& evaluationStage, EvaluationInfo&
 
 	glUseProgram(program);
 
+	if (fusedChain)
+	{
+		for (size_t i = 0; i < fusedChain->mStages.size(); i++)
+		{
+			const EvaluationStage& stage = mEvaluationStages[fusedChain->mStages[i]];
+			if (!stage.mParametersSize)
+				continue;
+			size_t parametersOffset = WriteUniforms(stage.mParameters, stage.mParametersSize);
+			glBindBufferRange(GL_UNIFORM_BUFFER, FusedBlockBinding(i), mUniformRing.mBuffer, parametersOffset, stage.mParametersSize);
+		}
+	}
+	else if (evaluationStage.mParametersSize)
+	{
+		size_t parametersOffset = WriteUniforms(evaluationStage.mParameters, evaluationStage.mParametersSize);
+		glBindBufferRange(GL_UNIFORM_BUFFER, 1, mUniformRing.mBuffer, parametersOffset, evaluationStage.mParametersSize);
+	}
+
+	// textures and samplers are the same for every face
+	const unsigned int samplerCount = fusedChain ? fusedChain->mProgram.mSamplerCount : mEvaluatorPerNodeType[evaluationStage.mNodeType].mSamplerCount;
+	for (unsigned int samplerIndex = 0; samplerIndex < samplerCount; samplerIndex++)
+	{
+		glActiveTexture(GL_TEXTURE0 + samplerIndex);
+		int targetIndex = input.mInputs[samplerIndex];
+		if (targetIndex < 0)
+		{
+			glBindTexture(GL_TEXTURE_2D, 0);
+			continue;
+		}
+		auto* inputTarget = mEvaluationStages[targetIndex].mTarget;
+		if (!inputTarget)
+			continue;
+		InputSampler inputSampler = inputStage.mInputSamplers[samplerIndex];
+		if (inputTarget->mImage.mNumFaces == 1)
+		{
+			// tiles are sampled inside their margins, wrapping would read the other side of the tile
+			if (mbTiling)
+				inputSampler.mWrapU = inputSampler.mWrapV = 1;
+			glBindTexture(GL_TEXTURE_2D, inputTarget->mGLTexID);
+		}
+		else
+		{
+			glBindTexture(GL_TEXTURE_CUBE_MAP, inputTarget->mGLTexID);
+		}
+		glBindSampler(samplerIndex, GetSamplerObject(inputSampler));
+	}
+	mBoundSamplerCount = std::max(mBoundSamplerCount, samplerCount);
+
+	if (layeredProgram)
+	{
+		// EvaluationBlock starts with the 6 face rotations instead of viewRot
+		uint8_t layeredInfo[sizeof(rotMatrices) + sizeof(EvaluationInfo) - sizeof(evaluationInfo.viewRot)];
+		memcpy(layeredInfo, rotMatrices, sizeof(rotMatrices));
+		memcpy(layeredInfo + sizeof(rotMatrices), (uint8_t*)&evaluationInfo + sizeof(evaluationInfo.viewRot), sizeof(EvaluationInfo) - sizeof(evaluationInfo.viewRot));
+		size_t evaluationInfoOffset = WriteUniforms(layeredInfo, sizeof(layeredInfo));
+		glBindBufferRange(GL_UNIFORM_BUFFER, 2, mUniformRing.mBuffer, evaluationInfoOffset, sizeof(layeredInfo));
+		mFSQuad.Render();
+		glDisable(GL_BLEND);
+		return;
+	}
+
 	size_t faceCount = evaluationInfo.uiPass ? 1 : tgt->mImage.mNumFaces;
 	for (size_t face = 0; face < faceCount; face++)
 	{
@@ -1115,48 +2638,9 @@ void Evaluation::EvaluateGLSL(EvaluationStage& evaluationStage, EvaluationInfo&
 			tgt->BindCubeFace(face);
 
 		memcpy(evaluationInfo.viewRot, rotMatrices[face], sizeof(float) * 16);
-		glBindBuffer(GL_UNIFORM_BUFFER, mEvaluationStateGLSLBuffer);
-		glBufferData(GL_UNIFORM_BUFFER, sizeof(EvaluationInfo), &evaluationInfo, GL_DYNAMIC_DRAW);
-		glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
+		size_t evaluationInfoOffset = WriteUniforms(&evaluationInfo, sizeof(EvaluationInfo));
+		glBindBufferRange(GL_UNIFORM_BUFFER, 2, mUniformRing.mBuffer, evaluationInfoOffset, sizeof(EvaluationInfo));
 
-		glBindBufferBase(GL_UNIFORM_BUFFER, 1, evaluationStage.mParametersBuffer);
-		glBindBufferBase(GL_UNIFORM_BUFFER, 2, mEvaluationStateGLSLBuffer);
-
-		int samplerIndex = 0;
-		for (size_t inputIndex = 0; inputIndex < sizeof(samplerName)/sizeof(const char*); inputIndex++)
-		{
-			unsigned int parameter = glGetUniformLocation(program, samplerName[inputIndex]);
-			if (parameter == 0xFFFFFFFF)
-				continue;
-			glUniform1i(parameter, samplerIndex);
-			glActiveTexture(GL_TEXTURE0 + samplerIndex);
-			
-			int targetIndex = input.mInputs[samplerIndex];
-			if (targetIndex < 0)
-			{
-				glBindTexture(GL_TEXTURE_2D, 0);
-			}
-			else
-			{
-				auto* tgt = mEvaluationStages[targetIndex].mTarget;
-				if (tgt)
-				{
-					const InputSampler& inputSampler = evaluationStage.mInputSamplers[samplerIndex];
-					if (tgt->mImage.mNumFaces == 1)
-					{
-						glBindTexture(GL_TEXTURE_2D, mEvaluationStages[targetIndex].mTarget->mGLTexID);
-						TexParam(filter[inputSampler.mFilterMin], filter[inputSampler.mFilterMag], wrap[inputSampler.mWrapU], wrap[inputSampler.mWrapV], GL_TEXTURE_2D);
-					}
-					else
-					{
-						glBindTexture(GL_TEXTURE_CUBE_MAP, mEvaluationStages[targetIndex].mTarget->mGLTexID);
-						TexParam(filter[inputSampler.mFilterMin], filter[inputSampler.mFilterMag], wrap[inputSampler.mWrapU], wrap[inputSampler.mWrapV], GL_TEXTURE_CUBE_MAP);
-					}
-				}
-			}
-			samplerIndex++;
-		}
 		//
 		mFSQuad.Render();
 	}
@@ -1185,8 +2669,7 @@ void Evaluation::EvaluateC(EvaluationStage& evaluationStage, size_t index, Evalu
 
 void Evaluation::EvaluationStage::Clear()
 {
-	if (mEvaluationMask&EvaluationGLSL)
-		glDeleteBuffers(1, &mParametersBuffer);
+	ClearGPUTimer(*this);
 	//gEvaluation.UnreferenceRenderTarget(&mTarget);
 }
 
@@ -1194,6 +2677,7 @@ void Evaluation::FinishEvaluation()
 {
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	glUseProgram(0);
+	UnbindSamplers();
 }
 
 unsigned int Evaluation::UploadImage(Image *image, unsigned int textureId, int cubeFace)
@@ -1205,8 +2689,9 @@ unsigned int Evaluation::UploadImage(Image *image, unsigned int textureId, int c
 	glBindTexture(targetType, textureId);
 
 	unsigned int inputFormat = glInputFormats[image->mFormat];
+	unsigned int inputType = glInputTypes[image->mFormat];
 	unsigned int internalFormat = glInternalFormats[image->mFormat];
-	glTexImage2D((cubeFace==-1)? GL_TEXTURE_2D: glCubeFace[cubeFace], 0, internalFormat, image->mWidth, image->mHeight, 0, inputFormat, GL_UNSIGNED_BYTE, image->mBits);
+	glTexImage2D((cubeFace==-1)? GL_TEXTURE_2D: glCubeFace[cubeFace], 0, internalFormat, image->mWidth, image->mHeight, 0, inputFormat, inputType, image->mBits);
 	TexParam(GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, targetType);
 
 	glBindTexture(targetType, 0);
@@ -1281,6 +2766,7 @@ void Evaluation::NodeUICallBack(const ImDrawList* parent_list, const ImDrawCmd*
 			evaluationInfo.forcedDirty = 1;
 			evaluationInfo.uiPass = 1;
 			gEvaluation.PerformEvaluationForNode(cb.mNodeIndex, int(w), int(h), true, evaluationInfo);
+			gEvaluation.UnbindSamplers();
 		}
 		break;
 		case CBUI_Progress:
@@ -1347,7 +2833,7 @@ int Evaluation::SetEvaluationSize(int target, int imageWidth, int imageHeight)
 	if (!renderTarget)
 		return EVAL_ERR;
 	stage.mbFreeSizing = false;
-	renderTarget->InitBuffer(imageWidth, imageHeight);
+	gEvaluation.InitTarget(renderTarget, imageWidth, imageHeight, stage.mOutputFormat);
 	return EVAL_OK;
 }
 
@@ -1359,7 +2845,12 @@ int Evaluation::SetEvaluationCubeSize(int target, int faceWidth)
 	RenderTarget* renderTarget = stage.mTarget;
 	if (!renderTarget)
 		return EVAL_ERR;
+	if (gEvaluation.mBackend == BACKEND_CPU)
+	{
+		Log("Cubemaps are not supported by CPU evaluation.\n");
+		return EVAL_ERR;
+	}
 	stage.mbFreeSizing = false;
-	renderTarget->InitCube(faceWidth);
+	renderTarget->InitCube(faceWidth, stage.mOutputFormat);
 	return EVAL_OK;
 }
\ No newline at end of file
@@ -0,0 +1,598 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#include "GL/gl3w.h"
+#include "Evaluation.h"
+#include "TaskScheduler.h"
+#include <SDL.h>
+#include <stdlib.h>
+#include <functional>
+
+extern enki::TaskScheduler g_TS;
+extern Evaluation gEvaluation;
+
+int Evaluation::BenchmarkDirtyPropagation(int nodeCount)
+{
+	if (nodeCount < 2)
+		nodeCount = 2;
+
+	// synthetic material graph: generators, filters and blends. Outputs mostly feed one node, sometimes more
+	Evaluation evaluation;
+	EvaluationStage stage;
+	stage.mbDirty = false;
+	evaluation.mEvaluationStages.resize(nodeCount, stage);
+
+	srand(1234);
+	size_t edgeCount = 0;
+	std::vector<size_t> order;
+	std::vector<int> unusedOutputs;
+	for (int i = 0; i < nodeCount; i++)
+	{
+		order.push_back(i);
+		int dice = rand() % 10;
+		int inputCount = (dice < 3) ? 0 : ((dice < 8) ? 1 : 2);
+		for (int slot = 0; slot < inputCount && !unusedOutputs.empty(); slot++)
+		{
+			size_t pick = rand() % unusedOutputs.size();
+			evaluation.AddEvaluationInput(i, slot, unusedOutputs[pick]);
+			edgeCount++;
+			// 1 in 5 outputs is shared with another node
+			if (rand() % 5)
+			{
+				unusedOutputs[pick] = unusedOutputs.back();
+				unusedOutputs.pop_back();
+			}
+		}
+		unusedOutputs.push_back(i);
+	}
+	evaluation.SetEvaluationOrder(order);
+
+	// SetTargetDirty before the children lists: order list search then rescan of every later stage
+	auto scanSetTargetDirty = [&evaluation](size_t target)
+	{
+		auto& stages = evaluation.mEvaluationStages;
+		auto& orderList = evaluation.mEvaluationOrderList;
+		if (!stages[target].mbDirty)
+		{
+			evaluation.mDirtyCount++;
+			stages[target].mbDirty = true;
+		}
+		for (size_t i = 0; i < orderList.size(); i++)
+		{
+			if (orderList[i] != target)
+				continue;
+
+			for (i++; i < orderList.size(); i++)
+			{
+				EvaluationStage& currentEvaluation = stages[orderList[i]];
+				if (currentEvaluation.mbDirty)
+					continue;
+
+				for (auto inp : currentEvaluation.mInput.mInputs)
+				{
+					if (inp >= 0 && stages[inp].mbDirty)
+					{
+						evaluation.mDirtyCount++;
+						currentEvaluation.mbDirty = true;
+						break;
+					}
+				}
+			}
+		}
+	};
+	auto resetDirty = [&evaluation]()
+	{
+		for (auto& evaluationStage : evaluation.mEvaluationStages)
+			evaluationStage.mbDirty = false;
+		evaluation.mDirtyCount = 0;
+	};
+
+	static const int iterations = 2000;
+	const double frequency = double(SDL_GetPerformanceFrequency());
+	Uint64 coneTime = 0;
+	Uint64 scanTime = 0;
+	size_t dirtiedCount = 0;
+	int mismatchCount = 0;
+	std::vector<bool> coneDirty(nodeCount);
+	for (int iteration = 0; iteration < iterations; iteration++)
+	{
+		size_t target = rand() % nodeCount;
+
+		resetDirty();
+		Uint64 start = SDL_GetPerformanceCounter();
+		evaluation.SetTargetDirty(target);
+		coneTime += SDL_GetPerformanceCounter() - start;
+		int coneDirtyCount = evaluation.mDirtyCount;
+		for (int i = 0; i < nodeCount; i++)
+			coneDirty[i] = evaluation.mEvaluationStages[i].mbDirty;
+		dirtiedCount += coneDirtyCount;
+
+		resetDirty();
+		start = SDL_GetPerformanceCounter();
+		scanSetTargetDirty(target);
+		scanTime += SDL_GetPerformanceCounter() - start;
+
+		bool match = coneDirtyCount == evaluation.mDirtyCount;
+		for (int i = 0; i < nodeCount && match; i++)
+			match = coneDirty[i] == evaluation.mEvaluationStages[i].mbDirty;
+		if (!match)
+			mismatchCount++;
+	}
+
+	double coneMicroSeconds = double(coneTime) * 1000000.0 / frequency / iterations;
+	double scanMicroSeconds = double(scanTime) * 1000000.0 / frequency / iterations;
+	printf("Dirty propagation, %d nodes, %d links, %d random edits\n", nodeCount, int(edgeCount), iterations);
+	printf("  downstream cone : %.3f us per call (%.1f nodes dirtied on average)\n", coneMicroSeconds, double(dirtiedCount) / iterations);
+	printf("  order list scan : %.3f us per call\n", scanMicroSeconds);
+	printf("  speedup x%.1f, %d mismatch(es)\n", (coneMicroSeconds > 0.0) ? scanMicroSeconds / coneMicroSeconds : 0.0, mismatchCount);
+	return mismatchCount ? 1 : 0;
+}
+
+int Evaluation::BenchmarkParallelEvaluation(int branchCount, int size)
+{
+	if (branchCount < 1)
+		branchCount = 1;
+	if (size < 16)
+		size = 16;
+
+	// branchCount x (Sine -> Blur -> Blur -> Blur -> Blur), then a tree of Blend
+	Evaluation evaluation;
+	evaluation.mBackend = BACKEND_CPU;
+	const char *nodeNames[] = { "Sine", "Blur", "Blend" };
+	evaluation.mEvaluatorPerNodeType.resize(3);
+	for (int i = 0; i < 3; i++)
+		evaluation.mEvaluatorPerNodeType[i].mCPUKernel = GetCPUKernel(nodeNames[i]);
+
+	static float sineParameters[2] = { 8.f, 0.5f };
+	static float blurParameters[2] = { 0.3f, 0.002f };
+	static float blendParameters[9] = { 1.f, 1.f, 1.f, 1.f, 1.f, 1.f, 1.f, 1.f, 0.f }; // op 4, average
+	static const int averageOp = 4;
+	memcpy(&blendParameters[8], &averageOp, sizeof(int));
+
+	auto addStage = [&evaluation](size_t nodeType, void *parameters, size_t parametersSize)
+	{
+		EvaluationStage stage;
+		stage.mTarget = new RenderTarget;
+		evaluation.mAllocatedRenderTargets.push_back(stage.mTarget);
+		stage.mNodeType = nodeType;
+		stage.mParameters = parameters;
+		stage.mParametersSize = parametersSize;
+		stage.mInputSamplers.resize(8);
+		stage.mEvaluationMask = EvaluationGLSL;
+		evaluation.mEvaluationStages.push_back(stage);
+		evaluation.mDirtyCount++;
+		return evaluation.mEvaluationStages.size() - 1;
+	};
+
+	std::vector<size_t> outputs;
+	for (int branch = 0; branch < branchCount; branch++)
+	{
+		size_t previous = addStage(0, sineParameters, sizeof(sineParameters));
+		for (int i = 0; i < 4; i++)
+		{
+			size_t blur = addStage(1, blurParameters, sizeof(blurParameters));
+			evaluation.AddEvaluationInput(blur, 0, int(previous));
+			previous = blur;
+		}
+		outputs.push_back(previous);
+	}
+	while (outputs.size() > 1)
+	{
+		std::vector<size_t> blends;
+		for (size_t i = 0; i + 1 < outputs.size(); i += 2)
+		{
+			size_t blend = addStage(2, blendParameters, sizeof(blendParameters));
+			evaluation.AddEvaluationInput(blend, 0, int(outputs[i]));
+			evaluation.AddEvaluationInput(blend, 1, int(outputs[i + 1]));
+			blends.push_back(blend);
+		}
+		if (outputs.size() & 1)
+			blends.push_back(outputs.back());
+		outputs = blends;
+	}
+	const size_t finalStage = outputs[0];
+
+	std::vector<size_t> order;
+	for (size_t i = 0; i < evaluation.mEvaluationStages.size(); i++)
+		order.push_back(i);
+	evaluation.SetEvaluationOrder(order);
+
+	static const int iterations = 4;
+	const double frequency = double(SDL_GetPerformanceFrequency());
+	double times[2];
+	std::vector<uint8_t> results[2];
+	for (int parallel = 0; parallel < 2; parallel++)
+	{
+		evaluation.SetParallelEvaluation(parallel != 0);
+		Uint64 start = SDL_GetPerformanceCounter();
+		for (int i = 0; i < iterations; i++)
+			evaluation.RunEvaluation(size, size, true);
+		times[parallel] = double(SDL_GetPerformanceCounter() - start) * 1000.0 / frequency / iterations;
+		const Image_t& image = evaluation.mEvaluationStages[finalStage].mTarget->mImage;
+		results[parallel].assign((uint8_t*)image.mBits, (uint8_t*)image.mBits + image.mDataSize);
+	}
+
+	bool match = results[0] == results[1];
+	printf("Graph evaluation, %d branches, %d stages, %dx%d, %d threads\n", branchCount, int(evaluation.mEvaluationStages.size()), size, size, int(g_TS.GetNumTaskThreads()));
+	printf("  serial order : %.2f ms\n", times[0]);
+	printf("  parallel     : %.2f ms\n", times[1]);
+	printf("  speedup x%.2f, results %s\n", (times[1] > 0.0) ? times[0] / times[1] : 0.0, match ? "identical" : "DIFFERENT");
+
+	for (auto* rt : evaluation.mAllocatedRenderTargets)
+	{
+		rt->Destroy();
+		delete rt;
+	}
+	return match ? 0 : 1;
+}
+
+int Evaluation::BenchmarkPrecisions(int size)
+{
+	if (size < 16)
+		size = 16;
+
+	// pixel types of the EvaluationPrecision formats
+	static const unsigned int precisionTypes[] = { GL_UNSIGNED_BYTE, GL_HALF_FLOAT, GL_FLOAT };
+	static const char *precisionNames[] = { "8 bits", "16 bits float", "32 bits float" };
+	static const int iterations = 8;
+	const double frequency = double(SDL_GetPerformanceFrequency());
+
+	printf("Render target precisions, %dx%d, %d iterations\n", size, size, iterations);
+	printf("  %-14s %9s %11s %15s %13s\n", "precision", "MB", "copy GB/s", "readback MB/s", "upload MB/s");
+	for (int precision = 0; precision < PRECISION_COUNT; precision++)
+	{
+		uint8_t format = GetPrecisionFormat(precision);
+		size_t bytes = size_t(size) * size * GetTexelSize(format);
+		std::vector<uint8_t> bits(bytes);
+		RenderTarget source, destination;
+		source.InitBuffer(size, size, format);
+		destination.InitBuffer(size, size, format);
+
+		// framebuffer copy, every texel is read and written once. Close to what a pointwise node costs
+		glFinish();
+		Uint64 start = SDL_GetPerformanceCounter();
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, source.mFbo);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, destination.mFbo);
+		for (int i = 0; i < iterations; i++)
+			glBlitFramebuffer(0, 0, size, size, 0, 0, size, size, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		glFinish();
+		double copyTime = double(SDL_GetPerformanceCounter() - start) / frequency;
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		// same calls as GetEvaluationImage and SetEvaluationImage
+		glBindTexture(GL_TEXTURE_2D, destination.mGLTexID);
+		start = SDL_GetPerformanceCounter();
+		for (int i = 0; i < iterations; i++)
+			glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, precisionTypes[precision], bits.data());
+		double readbackTime = double(SDL_GetPerformanceCounter() - start) / frequency;
+
+		start = SDL_GetPerformanceCounter();
+		for (int i = 0; i < iterations; i++)
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, size, size, GL_RGBA, precisionTypes[precision], bits.data());
+		glFinish();
+		double uploadTime = double(SDL_GetPerformanceCounter() - start) / frequency;
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		const double totalBytes = double(bytes) * iterations;
+		printf("  %-14s %9.1f %11.2f %15.1f %13.1f\n", precisionNames[precision], double(bytes) / (1024.0 * 1024.0),
+			(copyTime > 0.0) ? totalBytes * 2.0 / copyTime / (1024.0 * 1024.0 * 1024.0) : 0.0,
+			(readbackTime > 0.0) ? totalBytes / readbackTime / (1024.0 * 1024.0) : 0.0,
+			(uploadTime > 0.0) ? totalBytes / uploadTime / (1024.0 * 1024.0) : 0.0);
+
+		source.Destroy();
+		destination.Destroy();
+	}
+	return 0;
+}
+
+int Evaluation::BenchmarkGLSLBindings(int drawCount)
+{
+	if (drawCount < 1)
+		drawCount = 1;
+
+	// the GLSL node with the most samplers
+	size_t nodeType = 0;
+	for (size_t i = 0; i < gEvaluation.mEvaluatorPerNodeType.size(); i++)
+	{
+		gEvaluation.PrepareNodeProgram(i, true);
+		const Evaluator& evaluator = gEvaluation.mEvaluatorPerNodeType[i];
+		if (evaluator.mGLSLProgram && evaluator.mSamplerCount > gEvaluation.mEvaluatorPerNodeType[nodeType].mSamplerCount)
+			nodeType = i;
+	}
+	const unsigned int program = gEvaluation.mEvaluatorPerNodeType[nodeType].mGLSLProgram;
+	if (!program)
+	{
+		Log("No GLSL node to benchmark.\n");
+		return 1;
+	}
+
+	// chain of small nodes, driver overhead is all that's left
+	static const int size = 64;
+	static const int chainLength = 16;
+	Evaluation evaluation;
+	evaluation.mBackend = BACKEND_GLSL;
+	evaluation.mEvaluatorPerNodeType = gEvaluation.mEvaluatorPerNodeType;
+	evaluation.InitUniformRing();
+	static uint8_t parameters[1024] = { 0 };
+	for (int i = 0; i < chainLength; i++)
+	{
+		EvaluationStage stage;
+		stage.mTarget = new RenderTarget;
+		stage.mTarget->InitBuffer(size, size);
+		evaluation.mAllocatedRenderTargets.push_back(stage.mTarget);
+		stage.mNodeType = nodeType;
+		stage.mParameters = parameters;
+		stage.mParametersSize = sizeof(parameters);
+		stage.mInputSamplers.resize(8);
+		for (int input = 0; input < 8; input++)
+			stage.mInput.mInputs[input] = i ? i - 1 : -1;
+		evaluation.mEvaluationStages.push_back(stage);
+	}
+
+	// previous bindings: sampler lookups, texture parameters and buffer reallocation for every draw
+	static const char* samplerNames[] = { "Sampler0", "Sampler1", "Sampler2", "Sampler3", "Sampler4", "Sampler5", "Sampler6", "Sampler7", "CubeSampler0" };
+	unsigned int buffers[2];
+	glGenBuffers(2, buffers);
+	glBindBuffer(GL_UNIFORM_BUFFER, buffers[0]);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(parameters), parameters, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	float triangle[] = { 0.f,0.f, 2.f,0.f, 0.f,2.f };
+	unsigned int triangleBuffer, triangleArray;
+	glGenBuffers(1, &triangleBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, triangleBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(triangle), triangle, GL_STATIC_DRAW);
+	glGenVertexArrays(1, &triangleArray);
+	glBindVertexArray(triangleArray);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+	glEnableVertexAttribArray(0);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	auto drawPrevious = [&](EvaluationStage& stage, EvaluationInfo& evaluationInfo)
+	{
+		stage.mTarget->BindAsTarget();
+		glUseProgram(program);
+		glBindBuffer(GL_UNIFORM_BUFFER, buffers[1]);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(EvaluationInfo), &evaluationInfo, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		glBindBufferBase(GL_UNIFORM_BUFFER, 1, buffers[0]);
+		glBindBufferBase(GL_UNIFORM_BUFFER, 2, buffers[1]);
+		int samplerIndex = 0;
+		for (auto name : samplerNames)
+		{
+			int location = glGetUniformLocation(program, name);
+			if (location == -1)
+				continue;
+			glUniform1i(location, samplerIndex);
+			glActiveTexture(GL_TEXTURE0 + samplerIndex);
+			int input = stage.mInput.mInputs[samplerIndex];
+			glBindTexture(GL_TEXTURE_2D, (input < 0) ? 0 : evaluation.mEvaluationStages[input].mTarget->mGLTexID);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+			samplerIndex++;
+		}
+		glBindVertexArray(triangleArray);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+		glBindVertexArray(0);
+	};
+
+	const double frequency = double(SDL_GetPerformanceFrequency());
+	double times[2];
+	for (int cached = 0; cached < 2; cached++)
+	{
+		EvaluationInfo evaluationInfo;
+		glFinish();
+		Uint64 start = SDL_GetPerformanceCounter();
+		for (int i = 0; i < drawCount; i++)
+		{
+			EvaluationStage& stage = evaluation.mEvaluationStages[i % chainLength];
+			if (cached)
+				evaluation.EvaluateGLSL(stage, evaluationInfo);
+			else
+				drawPrevious(stage, evaluationInfo);
+		}
+		evaluation.FinishEvaluation();
+		Uint64 submitted = SDL_GetPerformanceCounter();
+		glFinish();
+		times[cached] = double(submitted - start) * 1000000.0 / frequency / drawCount;
+	}
+
+	printf("GLSL bindings, %d draws of %dx%d, %d samplers\n", drawCount, size, size, int(gEvaluation.mEvaluatorPerNodeType[nodeType].mSamplerCount));
+	printf("  previous : %.3f us per draw\n", times[0]);
+	printf("  cached   : %.3f us per draw\n", times[1]);
+	printf("  speedup x%.2f\n", (times[1] > 0.0) ? times[0] / times[1] : 0.0);
+
+	glDeleteVertexArrays(1, &triangleArray);
+	glDeleteBuffers(1, &triangleBuffer);
+	glDeleteBuffers(2, buffers);
+	evaluation.ClearGLSLBindings();
+	for (auto* rt : evaluation.mAllocatedRenderTargets)
+	{
+		rt->Destroy();
+		delete rt;
+	}
+	return 0;
+}
+
+int Evaluation::BenchmarkNativeC(int size)
+{
+	if (size < 16)
+		size = 16;
+
+	// julia set, a pixel loop with a data dependent inner loop, as a C node would write it
+	static const char *benchmarkSource =
+		"typedef struct BenchmarkParameters_t\n"
+		"{\n"
+		"	unsigned char *bits;\n"
+		"	int width, height;\n"
+		"	int iterations;\n"
+		"} BenchmarkParameters;\n"
+		"int main(BenchmarkParameters *param, void *evaluation)\n"
+		"{\n"
+		"	int x, y, i;\n"
+		"	for (y = 0; y < param->height; y++)\n"
+		"	{\n"
+		"		for (x = 0; x < param->width; x++)\n"
+		"		{\n"
+		"			float zr = (float)x / (float)param->width * 3.f - 1.5f;\n"
+		"			float zi = (float)y / (float)param->height * 3.f - 1.5f;\n"
+		"			unsigned char *pixel = param->bits + (y * param->width + x) * 4;\n"
+		"			for (i = 0; i < param->iterations && zr * zr + zi * zi < 4.f; i++)\n"
+		"			{\n"
+		"				float t = zr * zr - zi * zi - 0.8f;\n"
+		"				zi = 2.f * zr * zi + 0.156f;\n"
+		"				zr = t;\n"
+		"			}\n"
+		"			pixel[0] = pixel[1] = pixel[2] = (unsigned char)(i * 255 / param->iterations);\n"
+		"			pixel[3] = 255;\n"
+		"		}\n"
+		"	}\n"
+		"	return 0;\n"
+		"}\n";
+
+	struct BenchmarkParameters
+	{
+		unsigned char *bits;
+		int width, height;
+		int iterations;
+	};
+
+	static const int iterations = 4;
+	static const char *tierNames[] = { "tcc", "native" };
+	const double frequency = double(SDL_GetPerformanceFrequency());
+	double compileTimes[2] = { 0.0, 0.0 };
+	double runTimes[2] = { 0.0, 0.0 };
+	std::vector<uint8_t> results[2];
+	for (int tier = CompilerTCC; tier <= CompilerNative; tier++)
+	{
+		CCompilation compilation;
+		compilation.mDirectory = "C/";
+		compilation.mFilename = "BenchmarkNativeC.c";
+		compilation.mText = benchmarkSource;
+		compilation.mTier = tier;
+		Uint64 start = SDL_GetPerformanceCounter();
+		CompileC(compilation);
+		compileTimes[tier] = double(SDL_GetPerformanceCounter() - start) * 1000.0 / frequency;
+		if (!compilation.mCFunction || compilation.mTier != tier)
+		{
+			printf("Unable to compile the %s benchmark node\n", tierNames[tier]);
+			if (compilation.mMem)
+				free(compilation.mMem);
+			return 1;
+		}
+
+		results[tier].resize(size_t(size) * size * 4);
+		BenchmarkParameters parameters = { results[tier].data(), size, size, 64 };
+		start = SDL_GetPerformanceCounter();
+		for (int i = 0; i < iterations; i++)
+			compilation.mCFunction(&parameters, NULL);
+		runTimes[tier] = double(SDL_GetPerformanceCounter() - start) * 1000.0 / frequency / iterations;
+		if (compilation.mMem)
+			free(compilation.mMem);
+	}
+
+	// contracted multiply-adds may change a few iteration counts
+	size_t differences = 0;
+	for (size_t i = 0; i < results[0].size(); i++)
+		differences += (results[0][i] != results[1][i]) ? 1 : 0;
+
+	printf("C node, %dx%d pixel loop, %d iterations\n", size, size, iterations);
+	for (int tier = CompilerTCC; tier <= CompilerNative; tier++)
+		printf("  %-7s compile %8.2f ms, run %8.2f ms\n", tierNames[tier], compileTimes[tier], runTimes[tier]);
+	printf("  speedup x%.2f, %d different bytes\n", (runTimes[1] > 0.0) ? runTimes[0] / runTimes[1] : 0.0, int(differences));
+	return 0;
+}
+
+int Evaluation::BenchmarkImageKernels(int size)
+{
+	if (size < 16)
+		size = 16;
+
+	// mipmapped cubemap, like the CubemapFilter output. Each face has its own value, resizing keeps it
+	bool cubeMatch = true;
+	{
+		Image cube;
+		memset(&cube, 0, sizeof(Image));
+		cube.mWidth = cube.mHeight = 8;
+		cube.mNumFaces = 6;
+		cube.mNumMips = 1;
+		cube.mFormat = TextureFormat::RGBA8;
+		cube.mDataSize = 8 * 8 * 4 * 6;
+		cube.mBits = malloc(cube.mDataSize);
+		for (int face = 0; face < 6; face++)
+			memset((uint8_t*)cube.mBits + face * 8 * 8 * 4, 40 * face, 8 * 8 * 4);
+		if (GenerateMips(&cube) != EVAL_OK || ResizeImage(&cube, 4, 4) != EVAL_OK || cube.mNumMips != 1)
+			cubeMatch = false;
+		for (uint32_t i = 0; cubeMatch && i < cube.mDataSize; i++)
+			cubeMatch = ((uint8_t*)cube.mBits)[i] == uint8_t(40 * (i / (4 * 4 * 4)));
+		FreeImage(&cube);
+	}
+
+	Image image;
+	memset(&image, 0, sizeof(Image));
+	image.mWidth = image.mHeight = size;
+	image.mNumFaces = 1;
+	image.mNumMips = 1;
+	image.mFormat = TextureFormat::RGBA8;
+	image.mDataSize = size * size * 4;
+	image.mBits = malloc(image.mDataSize);
+	for (uint32_t i = 0; i < image.mDataSize; i++)
+		((uint8_t*)image.mBits)[i] = uint8_t(i * 7);
+	Image other = image;
+	other.mBits = malloc(image.mDataSize);
+	memcpy(other.mBits, image.mBits, image.mDataSize);
+
+	static const float blurKernel[25] = {
+		1.f / 256.f, 4.f / 256.f, 6.f / 256.f, 4.f / 256.f, 1.f / 256.f,
+		4.f / 256.f, 16.f / 256.f, 24.f / 256.f, 16.f / 256.f, 4.f / 256.f,
+		6.f / 256.f, 24.f / 256.f, 36.f / 256.f, 24.f / 256.f, 6.f / 256.f,
+		4.f / 256.f, 16.f / 256.f, 24.f / 256.f, 16.f / 256.f, 4.f / 256.f,
+		1.f / 256.f, 4.f / 256.f, 6.f / 256.f, 4.f / 256.f, 1.f / 256.f };
+	static unsigned int histogram[1024];
+	const double frequency = double(SDL_GetPerformanceFrequency());
+	auto time = [frequency](const std::function<void()>& kernel)
+	{
+		Uint64 start = SDL_GetPerformanceCounter();
+		kernel();
+		return double(SDL_GetPerformanceCounter() - start) * 1000.0 / frequency;
+	};
+
+	printf("Image kernels, %dx%d RGBA8, %d threads\n", size, size, int(g_TS.GetNumTaskThreads()));
+	printf("  blend       : %.2f ms\n", time([&]() { BlendImage(&image, &other, 8, 0.5f); }));
+	printf("  convolve 5x5: %.2f ms\n", time([&]() { ConvolveImage(&image, blurKernel, 5, 5); }));
+	printf("  histogram   : %.2f ms\n", time([&]() { GetImageHistogram(&image, histogram); }));
+	printf("  premultiply : %.2f ms\n", time([&]() { PremultiplyImage(&image, 0); }));
+	printf("  swizzle     : %.2f ms\n", time([&]() { SwizzleImage(&image, 2, 1, 0, 3); }));
+	printf("  to RGBA32F  : %.2f ms\n", time([&]() { ConvertImage(&image, TextureFormat::RGBA32F); }));
+	printf("  mips        : %.2f ms\n", time([&]() { GenerateMips(&image); }));
+	printf("  resize /3   : %.2f ms\n", time([&]() { ResizeImage(&image, size / 3, size / 3); }));
+	printf("  mipmapped cubemap resize %s\n", cubeMatch ? "correct" : "WRONG");
+
+	FreeImage(&image);
+	FreeImage(&other);
+	return cubeMatch ? 0 : 1;
+}
@@ -0,0 +1,836 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#include "Evaluation.h"
+#include "EvaluationCPU.h"
+#include "TaskScheduler.h"
+#include <emmintrin.h>
+#include <math.h>
+
+extern enki::TaskScheduler g_TS;
+
+// 4 pixels per register. Kernels are written like their GLSL counterpart, one lane per pixel.
+struct SimdFloat
+{
+	SimdFloat() {}
+	SimdFloat(__m128 value) : v(value) {}
+	SimdFloat(float value) : v(_mm_set1_ps(value)) {}
+	__m128 v;
+};
+
+inline SimdFloat operator + (SimdFloat a, SimdFloat b) { return _mm_add_ps(a.v, b.v); }
+inline SimdFloat operator - (SimdFloat a, SimdFloat b) { return _mm_sub_ps(a.v, b.v); }
+inline SimdFloat operator * (SimdFloat a, SimdFloat b) { return _mm_mul_ps(a.v, b.v); }
+inline SimdFloat operator / (SimdFloat a, SimdFloat b) { return _mm_div_ps(a.v, b.v); }
+inline SimdFloat operator - (SimdFloat a) { return _mm_sub_ps(_mm_setzero_ps(), a.v); }
+inline SimdFloat operator & (SimdFloat a, SimdFloat b) { return _mm_and_ps(a.v, b.v); }
+inline SimdFloat operator | (SimdFloat a, SimdFloat b) { return _mm_or_ps(a.v, b.v); }
+inline SimdFloat CmpLT(SimdFloat a, SimdFloat b) { return _mm_cmplt_ps(a.v, b.v); }
+inline SimdFloat CmpLE(SimdFloat a, SimdFloat b) { return _mm_cmple_ps(a.v, b.v); }
+inline SimdFloat CmpGT(SimdFloat a, SimdFloat b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline SimdFloat CmpGE(SimdFloat a, SimdFloat b) { return _mm_cmpge_ps(a.v, b.v); }
+inline SimdFloat Select(SimdFloat mask, SimdFloat a, SimdFloat b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+// NaN gives b, so Clamp/Saturate turn NaN into the low bound
+inline SimdFloat Min(SimdFloat a, SimdFloat b) { return _mm_min_ps(a.v, b.v); }
+inline SimdFloat Max(SimdFloat a, SimdFloat b) { return _mm_max_ps(a.v, b.v); }
+inline SimdFloat Abs(SimdFloat a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a.v); }
+inline SimdFloat Sqrt(SimdFloat a) { return _mm_sqrt_ps(a.v); }
+inline SimdFloat Clamp(SimdFloat a, SimdFloat low, SimdFloat high) { return Min(Max(a, low), high); }
+inline SimdFloat Saturate(SimdFloat a) { return Clamp(a, 0.f, 1.f); }
+inline SimdFloat Mix(SimdFloat a, SimdFloat b, SimdFloat t) { return a + (b - a) * t; }
+
+inline SimdFloat Floor(SimdFloat a)
+{
+	// SSE2 has no floor. Values above 2^23 are already integers
+	__m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+	SimdFloat res = _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, a.v), _mm_set1_ps(1.f)));
+	return Select(CmpLT(Abs(a), 8388608.f), res, a);
+}
+
+inline SimdFloat Fract(SimdFloat a) { return a - Floor(a); }
+inline SimdFloat Mod(SimdFloat a, SimdFloat b) { return a - b * Floor(a / b); }
+
+inline SimdFloat SmoothStep(SimdFloat edge0, SimdFloat edge1, SimdFloat x)
+{
+	SimdFloat t = Saturate((x - edge0) / (edge1 - edge0));
+	return t * t * (SimdFloat(3.f) - t * 2.f);
+}
+
+static const float PI = 3.14159265359f;
+static const float SQRT2 = 1.414213562373095f;
+
+inline SimdFloat Sin(SimdFloat x)
+{
+	// reduce to [-PI, PI] then to [-PI/2, PI/2]
+	x = x - Floor(x * (0.5f / PI) + 0.5f) * (2.f * PI);
+	x = Select(CmpGT(x, PI * 0.5f), SimdFloat(PI) - x, x);
+	x = Select(CmpLT(x, -PI * 0.5f), SimdFloat(-PI) - x, x);
+	SimdFloat x2 = x * x;
+	SimdFloat poly = SimdFloat(-1.f / 39916800.f) * x2 + 1.f / 362880.f;
+	poly = poly * x2 - 1.f / 5040.f;
+	poly = poly * x2 + 1.f / 120.f;
+	poly = poly * x2 - 1.f / 6.f;
+	poly = poly * x2 + 1.f;
+	return poly * x;
+}
+
+inline SimdFloat Cos(SimdFloat x) { return Sin(x + PI * 0.5f); }
+
+inline SimdFloat Atan2(SimdFloat y, SimdFloat x)
+{
+	SimdFloat ax = Abs(x);
+	SimdFloat ay = Abs(y);
+	SimdFloat high = Max(ax, ay);
+	SimdFloat a = Select(CmpGT(high, 0.f), Min(ax, ay) / high, 0.f);
+	SimdFloat s = a * a;
+	SimdFloat r = SimdFloat(-0.0117212f) * s + 0.05265332f;
+	r = r * s - 0.11643287f;
+	r = r * s + 0.19354346f;
+	r = r * s - 0.33262347f;
+	r = (r * s + 0.99997726f) * a;
+	r = Select(CmpGT(ay, ax), SimdFloat(PI * 0.5f) - r, r);
+	r = Select(CmpLT(x, 0.f), SimdFloat(PI) - r, r);
+	return Select(CmpLT(y, 0.f), -r, r);
+}
+
+struct SimdVec2
+{
+	SimdVec2() {}
+	SimdVec2(SimdFloat _x, SimdFloat _y) : x(_x), y(_y) {}
+	SimdFloat x, y;
+};
+
+inline SimdVec2 operator + (const SimdVec2& a, const SimdVec2& b) { return SimdVec2(a.x + b.x, a.y + b.y); }
+inline SimdVec2 operator - (const SimdVec2& a, SimdFloat b) { return SimdVec2(a.x - b, a.y - b); }
+inline SimdVec2 operator * (const SimdVec2& a, SimdFloat b) { return SimdVec2(a.x * b, a.y * b); }
+inline SimdFloat Length(const SimdVec2& a) { return Sqrt(a.x * a.x + a.y * a.y); }
+
+struct SimdColor
+{
+	SimdColor() {}
+	SimdColor(SimdFloat value) : r(value), g(value), b(value), a(value) {}
+	SimdColor(SimdFloat _r, SimdFloat _g, SimdFloat _b, SimdFloat _a) : r(_r), g(_g), b(_b), a(_a) {}
+	SimdFloat r, g, b, a;
+};
+
+inline SimdColor operator + (const SimdColor& a, const SimdColor& b) { return SimdColor(a.r + b.r, a.g + b.g, a.b + b.b, a.a + b.a); }
+inline SimdColor operator - (const SimdColor& a, const SimdColor& b) { return SimdColor(a.r - b.r, a.g - b.g, a.b - b.b, a.a - b.a); }
+inline SimdColor operator * (const SimdColor& a, const SimdColor& b) { return SimdColor(a.r * b.r, a.g * b.g, a.b * b.b, a.a * b.a); }
+inline SimdColor operator / (const SimdColor& a, const SimdColor& b) { return SimdColor(a.r / b.r, a.g / b.g, a.b / b.b, a.a / b.a); }
+inline SimdColor operator * (const SimdColor& a, SimdFloat b) { return SimdColor(a.r * b, a.g * b, a.b * b, a.a * b); }
+inline SimdColor Min(const SimdColor& a, const SimdColor& b) { return SimdColor(Min(a.r, b.r), Min(a.g, b.g), Min(a.b, b.b), Min(a.a, b.a)); }
+inline SimdColor Max(const SimdColor& a, const SimdColor& b) { return SimdColor(Max(a.r, b.r), Max(a.g, b.g), Max(a.b, b.b), Max(a.a, b.a)); }
+inline SimdColor Abs(const SimdColor& a) { return SimdColor(Abs(a.r), Abs(a.g), Abs(a.b), Abs(a.a)); }
+inline SimdColor Saturate(const SimdColor& a) { return SimdColor(Saturate(a.r), Saturate(a.g), Saturate(a.b), Saturate(a.a)); }
+
+// an input as the GLSL sampler sees it
+struct CPUInput
+{
+	const uint8_t *mBits;
+	int mWidth;
+	int mHeight;
+	int mWrapU;
+	int mWrapV;
+	bool mbNearest;
+};
+
+struct CPUKernelContext
+{
+	const uint8_t *mParameters;
+	size_t mParametersSize;
+	uint8_t *mTarget;
+	int mWidth;
+	int mHeight;
+	int mBlendingSrc;
+	int mBlendingDst;
+	CPUInput mInputs[8];
+	// EvaluationInfo::tileRect, uv covered by the target and the inputs
+	float mTileRect[4];
+
+	// parameters are read with the std140 offsets of the GLSL block, the way the shader reads the same buffer.
+	// GL reads past the end of the buffer as 0
+	float Float(size_t offset) const
+	{
+		float res = 0.f;
+		if (offset + sizeof(float) <= mParametersSize)
+			memcpy(&res, mParameters + offset, sizeof(float));
+		return res;
+	}
+	int Int(size_t offset) const
+	{
+		int res = 0;
+		if (offset + sizeof(int) <= mParametersSize)
+			memcpy(&res, mParameters + offset, sizeof(int));
+		return res;
+	}
+	SimdColor Color(size_t offset) const
+	{
+		return SimdColor(Float(offset), Float(offset + 4), Float(offset + 8), Float(offset + 12));
+	}
+};
+
+struct PixelGroup
+{
+	int mX;
+	int mY;
+	SimdVec2 mUV; // vUV of the 4 pixels
+};
+
+// RGBA8 in memory, like the GL render targets. Buffers are padded so a 4 pixels load never goes outside.
+static const size_t CPUBufferPadding = 16;
+
+inline SimdColor LoadPixels(const uint8_t *bits, int width, int x, int y)
+{
+	__m128i pixels = _mm_loadu_si128((const __m128i*)(bits + (size_t(y) * width + x) * 4));
+	__m128i mask = _mm_set1_epi32(0xFF);
+	SimdFloat scale(1.f / 255.f);
+	return SimdColor(SimdFloat(_mm_cvtepi32_ps(_mm_and_si128(pixels, mask))) * scale,
+		SimdFloat(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixels, 8), mask))) * scale,
+		SimdFloat(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixels, 16), mask))) * scale,
+		SimdFloat(_mm_cvtepi32_ps(_mm_srli_epi32(pixels, 24))) * scale);
+}
+
+static int WrapTexel(int coord, int size, int wrapMode)
+{
+	switch (wrapMode)
+	{
+	case 0: // repeat
+		coord %= size;
+		return (coord < 0) ? coord + size : coord;
+	case 2: // clamp to border
+		return (coord < 0 || coord >= size) ? -1 : coord;
+	case 3: // mirrored repeat
+	{
+		int period = size * 2;
+		coord %= period;
+		if (coord < 0)
+			coord += period;
+		return (coord < size) ? coord : period - 1 - coord;
+	}
+	default: // clamp to edge
+		return (coord < 0) ? 0 : ((coord >= size) ? size - 1 : coord);
+	}
+}
+
+static void FetchTexel(const CPUInput& input, int x, int y, float *rgba)
+{
+	// border color is transparent black
+	if (x < 0 || y < 0)
+	{
+		rgba[0] = rgba[1] = rgba[2] = rgba[3] = 0.f;
+		return;
+	}
+	const uint8_t *texel = input.mBits + (size_t(y) * input.mWidth + x) * 4;
+	for (int i = 0; i < 4; i++)
+		rgba[i] = float(texel[i]) * (1.f / 255.f);
+}
+
+static float SanitizeCoordinate(float value)
+{
+	if (!(value == value))
+		return 0.f;
+	return (value < -1e6f) ? -1e6f : ((value > 1e6f) ? 1e6f : value);
+}
+
+static void SampleTexel(const CPUInput& input, float u, float v, float *rgba)
+{
+	u = SanitizeCoordinate(u) * float(input.mWidth);
+	v = SanitizeCoordinate(v) * float(input.mHeight);
+	if (input.mbNearest)
+	{
+		FetchTexel(input, WrapTexel(int(floorf(u)), input.mWidth, input.mWrapU), WrapTexel(int(floorf(v)), input.mHeight, input.mWrapV), rgba);
+		return;
+	}
+
+	u -= 0.5f;
+	v -= 0.5f;
+	float u0 = floorf(u);
+	float v0 = floorf(v);
+	float tu = u - u0;
+	float tv = v - v0;
+	int x0 = WrapTexel(int(u0), input.mWidth, input.mWrapU);
+	int x1 = WrapTexel(int(u0) + 1, input.mWidth, input.mWrapU);
+	int y0 = WrapTexel(int(v0), input.mHeight, input.mWrapV);
+	int y1 = WrapTexel(int(v0) + 1, input.mHeight, input.mWrapV);
+	float t00[4], t10[4], t01[4], t11[4];
+	FetchTexel(input, x0, y0, t00);
+	FetchTexel(input, x1, y0, t10);
+	FetchTexel(input, x0, y1, t01);
+	FetchTexel(input, x1, y1, t11);
+	for (int i = 0; i < 4; i++)
+	{
+		float bottom = t00[i] + (t10[i] - t00[i]) * tu;
+		float top = t01[i] + (t11[i] - t01[i]) * tu;
+		rgba[i] = bottom + (top - bottom) * tv;
+	}
+}
+
+// texture(SamplerN, uv)
+static SimdColor Sample(const CPUKernelContext& context, int slot, const SimdVec2& uv)
+{
+	const CPUInput& input = context.mInputs[slot];
+	// nothing bound, GL returns (0,0,0,1)
+	if (!input.mBits)
+		return SimdColor(0.f, 0.f, 0.f, 1.f);
+
+	float u[4], v[4], texels[4][4];
+	SimdFloat tileU = (uv.x - SimdFloat(context.mTileRect[0])) * SimdFloat(1.f / context.mTileRect[2]);
+	SimdFloat tileV = (uv.y - SimdFloat(context.mTileRect[1])) * SimdFloat(1.f / context.mTileRect[3]);
+	_mm_storeu_ps(u, tileU.v);
+	_mm_storeu_ps(v, tileV.v);
+	for (int i = 0; i < 4; i++)
+		SampleTexel(input, u[i], v[i], texels[i]);
+	return SimdColor(_mm_setr_ps(texels[0][0], texels[1][0], texels[2][0], texels[3][0]),
+		_mm_setr_ps(texels[0][1], texels[1][1], texels[2][1], texels[3][1]),
+		_mm_setr_ps(texels[0][2], texels[1][2], texels[2][2], texels[3][2]),
+		_mm_setr_ps(texels[0][3], texels[1][3], texels[2][3], texels[3][3]));
+}
+
+// texture(SamplerN, vUV). Texel centers are sampled exactly when sizes match, whatever filter or wrap mode.
+static SimdColor SampleCenter(const CPUKernelContext& context, int slot, const PixelGroup& group)
+{
+	const CPUInput& input = context.mInputs[slot];
+	if (input.mBits && input.mWidth == context.mWidth && input.mHeight == context.mHeight)
+		return LoadPixels(input.mBits, input.mWidth, group.mX, group.mY);
+	return Sample(context, slot, group.mUV);
+}
+
+static SimdColor BlendFactor(int blendOp, const SimdColor& src, const SimdColor& dst)
+{
+	// blend constant color is never set, it stays (0,0,0,0)
+	switch (blendOp)
+	{
+	case ZERO: return SimdColor(0.f);
+	case SRC_COLOR: return src;
+	case ONE_MINUS_SRC_COLOR: return SimdColor(1.f) - src;
+	case DST_COLOR: return dst;
+	case ONE_MINUS_DST_COLOR: return SimdColor(1.f) - dst;
+	case SRC_ALPHA: return SimdColor(src.a);
+	case ONE_MINUS_SRC_ALPHA: return SimdColor(SimdFloat(1.f) - src.a);
+	case DST_ALPHA: return SimdColor(dst.a);
+	case ONE_MINUS_DST_ALPHA: return SimdColor(SimdFloat(1.f) - dst.a);
+	case CONSTANT_COLOR: return SimdColor(0.f);
+	case CONSTANT_ALPHA: return SimdColor(0.f);
+	case SRC_ALPHA_SATURATE:
+	{
+		SimdFloat f = Min(src.a, SimdFloat(1.f) - dst.a);
+		return SimdColor(f, f, f, 1.f);
+	}
+	default: return SimdColor(1.f);
+	}
+}
+
+static void StorePixels(const CPUKernelContext& context, int x, int y, const SimdColor& color)
+{
+	// unorm target: output is clamped before blending
+	SimdColor src = Saturate(color);
+	if (context.mBlendingSrc != ONE || context.mBlendingDst != ZERO)
+	{
+		SimdColor dst = LoadPixels(context.mTarget, context.mWidth, x, y);
+		src = Saturate(src * BlendFactor(context.mBlendingSrc, src, dst) + dst * BlendFactor(context.mBlendingDst, src, dst));
+	}
+	SimdFloat scale(255.f);
+	__m128i pixels = _mm_cvtps_epi32((src.r * scale).v);
+	pixels = _mm_or_si128(pixels, _mm_slli_epi32(_mm_cvtps_epi32((src.g * scale).v), 8));
+	pixels = _mm_or_si128(pixels, _mm_slli_epi32(_mm_cvtps_epi32((src.b * scale).v), 16));
+	pixels = _mm_or_si128(pixels, _mm_slli_epi32(_mm_cvtps_epi32((src.a * scale).v), 24));
+
+	uint8_t *ptr = context.mTarget + (size_t(y) * context.mWidth + x) * 4;
+	int count = context.mWidth - x;
+	if (count >= 4)
+	{
+		_mm_storeu_si128((__m128i*)ptr, pixels);
+	}
+	else
+	{
+		uint8_t tail[16];
+		_mm_storeu_si128((__m128i*)tail, pixels);
+		memcpy(ptr, tail, count * 4);
+	}
+}
+
+template<typename Kernel> void KernelRow(const CPUKernelContext& context, int y)
+{
+	PixelGroup group;
+	group.mY = y;
+	group.mUV.y = context.mTileRect[1] + (float(y) + 0.5f) / float(context.mHeight) * context.mTileRect[3];
+	const SimdFloat pixelCenters = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+	const SimdFloat invWidth(context.mTileRect[2] / float(context.mWidth));
+	const SimdFloat tileX(context.mTileRect[0]);
+	for (int x = 0; x < context.mWidth; x += 4)
+	{
+		group.mX = x;
+		group.mUV.x = tileX + (SimdFloat(float(x)) + pixelCenters) * invWidth;
+		StorePixels(context, x, y, Kernel::Evaluate(context, group));
+	}
+}
+
+// kernels. Parameter offsets are the ones of the GLSL uniform blocks.
+struct CircleKernel
+{
+	static SimdColor Evaluate(const CPUKernelContext& context, const PixelGroup& group)
+	{
+		float radius = context.Float(0);
+		float t = context.Float(4);
+		SimdFloat r = Length(group.mUV - 0.5f);
+		SimdFloat circle = SimdFloat(1.f) - SmoothStep(radius - 0.001f, radius, r);
+		// sin(acos(x)) is sqrt(1-x*x). Outside the radius, acos gives NaN that ends up black
+		SimdFloat ratio = r / radius;
+		SimdFloat h = Sqrt(Max(SimdFloat(1.f) - ratio * ratio, 0.f));
+		return SimdColor(Select(CmpLE(ratio, 1.f), Mix(circle, h, t), 0.f));
+	}
+};
+
+struct SquareKernel
+{
+	static SimdColor Evaluate(const CPUKernelContext& context, const PixelGroup& group)
+	{
+		float width = context.Float(0);
+		SimdVec2 nuv = group.mUV - 0.5f;
+		return SimdColor(SimdFloat(1.f) - SmoothStep(width - 0.001f, width, Max(Abs(nuv.x), Abs(nuv.y))));
+	}
+};
+
+struct CheckerKernel
+{
+	static SimdColor Evaluate(const CPUKernelContext& context, const PixelGroup& group)
+	{
+		SimdVec2 nuv = group.mUV - 0.5f;
+		return SimdColor(Mod(Floor(nuv.x) + Floor(nuv.y), 2.f));
+	}
+};
+
+struct SineKernel
+{
+	static SimdColor Evaluate(const CPUKernelContext& context, const PixelGroup& group)
+	{
+		float freq = context.Float(0);
+		float angle = context.Float(4);
+		SimdVec2 nuv = (group.mUV - 0.5f) * (freq * PI * 2.f);
+		return SimdColor(Cos(nuv.x * cosf(angle) + nuv.y * sinf(angle)) * 0.5f + 0.5f);
+	}
+};
+
+struct SmoothStepKernel
+{
+	static SimdColor Evaluate(const CPUKernelContext& context, const PixelGroup& group)
+	{
+		SimdFloat low(context.Float(0));
+		SimdFloat high(context.Float(4));
+		SimdColor tex = SampleCenter(context, 0, group);
+		return SimdColor(SmoothStep(low, high, tex.r), SmoothStep(low, high, tex.g), SmoothStep(low, high, tex.b), SmoothStep(low, high, tex.a));
+	}
+};
+
+struct TransformKernel
+{
+	static SimdColor Evaluate(const CPUKernelContext& context, const PixelGroup& group)
+	{
+		float rotate = context.Float(16);
+		float c = cosf(rotate);
+		float s = sinf(rotate);
+		SimdFloat rsx = (group.mUV.x + context.Float(0)) * context.Float(8) - 0.5f;
+		SimdFloat rsy = (group.mUV.y + context.Float(4)) * context.Float(12) - 0.5f;
+		SimdVec2 ro(rsx * c - rsy * s + 0.5f, rsx * s + rsy * c + 0.5f);
+		return Sample(context, 0, ro);
+	}
+};
+
+struct MADDKernel
+{
+	static SimdColor Evaluate(const CPUKernelContext& context, const PixelGroup& group)
+	{
+		return SampleCenter(context, 0, group) * context.Color(0) + context.Color(16);
+	}
+};
+
+struct BlendKernel
+{
+	static SimdFloat BlendChannel(int op, SimdFloat a, SimdFloat b)
+	{
+		switch (op)
+		{
+		case 0: return a + b; // Add
+		case 1: return a * b; // Multiply
+		case 2: return Min(a, b); // Darken
+		case 3: return Max(a, b); // Lighten
+		case 4: return (a + b) * 0.5f; // Average
+		case 5: return SimdFloat(1.f) - (SimdFloat(1.f) - b) * (SimdFloat(1.f) - a); // Screen
+		case 6: return SimdFloat(1.f) - (SimdFloat(1.f) - a) / b; // Color Burn
+		case 7: return a / (SimdFloat(1.f) - b); // Color Dodge
+		case 8: return a * b * 2.f + a * a - a * a * b * 2.f; // Soft Light
+		case 9: return a - b; // Subtract
+		case 10: return Abs(b - a); // Difference
+		case 11: return SimdFloat(1.f) - Abs(SimdFloat(1.f) - a - b); // Inverse Difference
+		case 12: return b + a - a * b * 2.f; // Exclusion
+		}
+		return 0.f;
+	}
+
+	static SimdColor Evaluate(const CPUKernelContext& context, const PixelGroup& group)
+	{
+		SimdColor a = SampleCenter(context, 0, group) * context.Color(0);
+		SimdColor b = SampleCenter(context, 1, group) * context.Color(16);
+		int op = context.Int(32);
+		return SimdColor(BlendChannel(op, a.r, b.r), BlendChannel(op, a.g, b.g), BlendChannel(op, a.b, b.b), BlendChannel(op, a.a, b.a));
+	}
+};
+
+struct InvertKernel
+{
+	static SimdColor Evaluate(const CPUKernelContext& context, const PixelGroup& group)
+	{
+		return SimdColor(1.f) - SampleCenter(context, 0, group);
+	}
+};
+
+struct RampKernel
+{
+	static SimdColor Evaluate(const CPUKernelContext& context, const PixelGroup& group)
+	{
+		// vec2 ramp[8] has a 16 bytes stride in std140
+		SimdColor tex = SampleCenter(context, 0, group);
+		SimdFloat v = tex.r;
+		SimdFloat res(0.f);
+		SimdFloat found(0.f);
+		for (int i = 0; i < 7; i++)
+		{
+			float x0 = context.Float(i * 16);
+			float y0 = context.Float(i * 16 + 4);
+			float x1 = context.Float(i * 16 + 16);
+			float y1 = context.Float(i * 16 + 20);
+			SimdFloat inside = _mm_andnot_ps(found.v, (CmpGE(v, x0) & CmpLE(v, x1)).v);
+			res = Select(inside, Mix(y0, y1, SmoothStep(x0, x1, v)), res);
+			found = found | inside;
+		}
+		return tex * res;
+	}
+};
+
+struct TileKernel
+{
+	static SimdColor GetTile(const CPUKernelContext& context, SimdVec2 uv)
+	{
+		SimdFloat tx = Floor((Floor(uv.x) + 1.f) * 0.5f);
+		SimdFloat ty = Floor((Floor(uv.y) + 1.f) * 0.5f);
+		uv.x = uv.x + tx * 0.1f;
+		uv.y = uv.y + ty * 0.1f;
+		SimdFloat outside = CmpGT(Mod(uv.x, 2.f), 1.f) | CmpGT(Mod(uv.y, 2.f), 1.f);
+		SimdColor tex = Sample(context, 0, uv);
+		return SimdColor(Select(outside, 0.f, tex.r), Select(outside, 0.f, tex.g), Select(outside, 0.f, tex.b), Select(outside, 0.f, tex.a));
+	}
+
+	static SimdColor Evaluate(const CPUKernelContext& context, const PixelGroup& group)
+	{
+		SimdVec2 nuv = group.mUV * context.Float(0);
+		SimdVec2 offset0(context.Float(8), context.Float(12));
+		SimdVec2 offset1(context.Float(16), context.Float(20));
+		SimdColor col = GetTile(context, nuv + offset0);
+		col = col + GetTile(context, nuv + SimdVec2(0.95f, 0.f) + offset0);
+		col = col + GetTile(context, nuv + SimdVec2(0.f, 0.95f) + offset1);
+		col = col + GetTile(context, nuv + SimdVec2(0.95f, 0.95f) + offset1);
+		return col;
+	}
+};
+
+struct PolarCoordsKernel
+{
+	static SimdColor Evaluate(const CPUKernelContext& context, const PixelGroup& group)
+	{
+		SimdVec2 uvin = group.mUV - 0.5f;
+		SimdVec2 uv;
+		if (context.Int(0) == 1)
+		{
+			SimdFloat angle = uvin.x * (PI * 2.f) + PI / 2.f;
+			SimdFloat radius = (SimdFloat(1.f) - (uvin.y + 0.5f)) * 0.5f;
+			uv.x = Cos(angle) * radius + 0.5f;
+			uv.y = Sin(angle) * radius + 0.5f;
+		}
+		else
+		{
+			uv.x = Atan2(uvin.y, uvin.x) + PI / 2.f;
+			uv.x = Select(CmpLT(uv.x, 0.f), uv.x + PI * 2.f, uv.x);
+			uv.x = uv.x / (PI * 2.f);
+			uv.y = SimdFloat(1.f) - Length(uvin) * 2.f;
+		}
+		return Sample(context, 0, uv);
+	}
+};
+
+struct SwirlKernel
+{
+	static SimdColor Evaluate(const CPUKernelContext& context, const PixelGroup& group)
+	{
+		SimdVec2 uv = group.mUV - 0.5f;
+		SimdFloat len = Length(uv) / (SQRT2 * 0.5f);
+		SimdFloat angle = Mix(context.Float(0), context.Float(4), len);
+		SimdFloat s = Sin(angle);
+		SimdFloat c = Cos(angle);
+		// Rotate2D, mat2(c, -s, s, c) * v
+		SimdVec2 nuv(c * uv.x + s * uv.y + 0.5f, c * uv.y - s * uv.x + 0.5f);
+		return Sample(context, 0, nuv);
+	}
+};
+
+struct PixelizeKernel
+{
+	static SimdColor Evaluate(const CPUKernelContext& context, const PixelGroup& group)
+	{
+		SimdFloat scale(context.Float(0));
+		return Sample(context, 0, SimdVec2(Floor(group.mUV.x * scale) / scale, Floor(group.mUV.y * scale) / scale));
+	}
+};
+
+struct BlurKernel
+{
+	static SimdColor Evaluate(const CPUKernelContext& context, const PixelGroup& group)
+	{
+		float angle = context.Float(0);
+		float strength = context.Float(4);
+		SimdColor col(0.f);
+		for (int i = -5; i <= 5; i++)
+		{
+			SimdVec2 uv(group.mUV.x + cosf(angle) * strength * float(i), group.mUV.y + sinf(angle) * strength * float(i));
+			col = col + Sample(context, 0, uv);
+		}
+		return col * (1.f / 11.f);
+	}
+};
+
+struct NormalMapKernel
+{
+	static void Normalize(SimdFloat& x, SimdFloat& y, SimdFloat& z)
+	{
+		SimdFloat invLength = SimdFloat(1.f) / Sqrt(x * x + y * y + z * z);
+		x = x * invLength;
+		y = y * invLength;
+		z = z * invLength;
+	}
+
+	static SimdColor Evaluate(const CPUKernelContext& context, const PixelGroup& group)
+	{
+		float spread = context.Float(0);
+		const SimdVec2& uv = group.mUV;
+		SimdFloat s11 = SampleCenter(context, 0, group).r;
+		SimdFloat s01 = Sample(context, 0, SimdVec2(uv.x - spread, uv.y)).r;
+		SimdFloat s21 = Sample(context, 0, SimdVec2(uv.x + spread, uv.y)).r;
+		SimdFloat s10 = Sample(context, 0, SimdVec2(uv.x, uv.y - spread)).r;
+		SimdFloat s12 = Sample(context, 0, SimdVec2(uv.x, uv.y + spread)).r;
+		SimdFloat vax(spread), vay(0.f), vaz = s21 - s01;
+		SimdFloat vbx(0.f), vby(spread), vbz = s12 - s10;
+		Normalize(vax, vay, vaz);
+		Normalize(vbx, vby, vbz);
+		SimdFloat nx = vay * vbz - vaz * vby;
+		SimdFloat ny = vaz * vbx - vax * vbz;
+		SimdFloat nz = vax * vby - vay * vbx;
+		Normalize(nx, ny, nz);
+		return SimdColor(nx * 0.5f + 0.5f, ny * 0.5f + 0.5f, nz * 0.5f + 0.5f, s11);
+	}
+};
+
+struct ClampKernel
+{
+	static SimdColor Evaluate(const CPUKernelContext& context, const PixelGroup& group)
+	{
+		return Min(Max(SampleCenter(context, 0, group), context.Color(0)), context.Color(16));
+	}
+};
+
+struct ColorKernel
+{
+	static SimdColor Evaluate(const CPUKernelContext& context, const PixelGroup& group)
+	{
+		return context.Color(0);
+	}
+};
+
+struct CropKernel
+{
+	static SimdColor Evaluate(const CPUKernelContext& context, const PixelGroup& group)
+	{
+		float qx = context.Float(0), qy = context.Float(4), qz = context.Float(8), qw = context.Float(12);
+		SimdVec2 uv(Mix(fminf(qx, qz), fmaxf(qx, qz), group.mUV.x), Mix(fminf(qy, qw), fmaxf(qy, qw), group.mUV.y));
+		return Sample(context, 0, uv);
+	}
+};
+
+struct CPUKernel
+{
+	const char *szNodeName;
+	CPUKernelFunction function;
+};
+
+static const CPUKernel cpuKernels[] = {
+	{ "Circle", KernelRow<CircleKernel> },
+	{ "Square", KernelRow<SquareKernel> },
+	{ "Checker", KernelRow<CheckerKernel> },
+	{ "Sine", KernelRow<SineKernel> },
+	{ "SmoothStep", KernelRow<SmoothStepKernel> },
+	{ "Transform", KernelRow<TransformKernel> },
+	{ "MADD", KernelRow<MADDKernel> },
+	{ "Blend", KernelRow<BlendKernel> },
+	{ "Invert", KernelRow<InvertKernel> },
+	{ "Ramp", KernelRow<RampKernel> },
+	{ "Tile", KernelRow<TileKernel> },
+	{ "PolarCoords", KernelRow<PolarCoordsKernel> },
+	{ "Swirl", KernelRow<SwirlKernel> },
+	{ "Pixelize", KernelRow<PixelizeKernel> },
+	{ "Blur", KernelRow<BlurKernel> },
+	{ "NormalMap", KernelRow<NormalMapKernel> },
+	{ "Clamp", KernelRow<ClampKernel> },
+	{ "Color", KernelRow<ColorKernel> },
+	{ "Crop", KernelRow<CropKernel> },
+};
+
+CPUKernelFunction GetCPUKernel(const std::string& nodeName)
+{
+	for (auto& kernel : cpuKernels)
+	{
+		if (nodeName == kernel.szNodeName)
+			return kernel.function;
+	}
+	return NULL;
+}
+
+struct CPUKernelTaskSet : enki::ITaskSet
+{
+	// rows are split in tiles of 16 across the workers
+	CPUKernelTaskSet(CPUKernelFunction kernel, const CPUKernelContext& context) : enki::ITaskSet(context.mHeight, 16)
+		, mKernel(kernel)
+		, mContext(context)
+	{
+	}
+	virtual void    ExecuteRange(enki::TaskSetPartition range, uint32_t threadnum)
+	{
+		for (uint32_t y = range.start; y < range.end; y++)
+			mKernel(mContext, int(y));
+	}
+	CPUKernelFunction mKernel;
+	const CPUKernelContext& mContext;
+};
+
+void RenderTarget::InitCPUBuffer(int width, int height)
+{
+	if ((width == mImage.mWidth) && (mImage.mHeight == height) && mImage.mNumFaces == 1 && mImage.mBits)
+		return;
+	Release();
+	if (gRenderTargetPool.Acquire(*this, width, height, 1, TextureFormat::RGBA8, true))
+	{
+		memset(mImage.mBits, 0, mImage.mDataSize);
+		return;
+	}
+
+	mImage.mWidth = width;
+	mImage.mHeight = height;
+	mImage.mNumMips = 1;
+	mImage.mNumFaces = 1;
+	mImage.mFormat = TextureFormat::RGBA8;
+	mImage.mDataSize = width * height * 4;
+	mImage.mBits = calloc(mImage.mDataSize + CPUBufferPadding, 1);
+}
+
+int RenderTarget::CopyToCPUBuffer(const Image_t *image)
+{
+	if (image->mNumFaces != 1)
+		return EVAL_ERR;
+
+	int order[4] = { 0, 1, 2, 3 };
+	switch (image->mFormat)
+	{
+	case TextureFormat::BGR8:
+	case TextureFormat::BGRA8:
+		order[0] = 2;
+		order[2] = 0;
+		break;
+	case TextureFormat::RGB8:
+	case TextureFormat::RGBA8:
+		break;
+	default:
+		Log("CPU evaluation only supports 8 bits images.\n");
+		return EVAL_ERR;
+	}
+	const int components = (image->mFormat == TextureFormat::BGR8 || image->mFormat == TextureFormat::RGB8) ? 3 : 4;
+
+	InitCPUBuffer(image->mWidth, image->mHeight);
+	const uint8_t *src = (const uint8_t *)image->mBits;
+	uint8_t *dst = (uint8_t *)mImage.mBits;
+	for (int i = 0; i < image->mWidth * image->mHeight; i++, src += components, dst += 4)
+	{
+		dst[0] = src[order[0]];
+		dst[1] = src[order[1]];
+		dst[2] = src[order[2]];
+		dst[3] = (components == 4) ? src[3] : 255;
+	}
+	return EVAL_OK;
+}
+
+void Evaluation::EvaluateCPU(EvaluationStage& evaluationStage, EvaluationInfo& evaluationInfo)
+{
+	CPUKernelFunction kernel = mEvaluatorPerNodeType[evaluationStage.mNodeType].mCPUKernel;
+	RenderTarget* tgt = evaluationStage.mTarget;
+	if (!kernel || !tgt || !tgt->mImage.mBits || tgt->mImage.mNumFaces != 1)
+	{
+		Log("No CPU evaluation for node %s.\n", gMetaNodes[evaluationStage.mNodeType].mName.c_str());
+		return;
+	}
+
+	CPUKernelContext context;
+	context.mParameters = (const uint8_t *)evaluationStage.mParameters;
+	context.mParametersSize = evaluationStage.mParameters ? evaluationStage.mParametersSize : 0;
+	context.mTarget = (uint8_t *)tgt->mImage.mBits;
+	context.mWidth = tgt->mImage.mWidth;
+	context.mHeight = tgt->mImage.mHeight;
+	context.mBlendingSrc = (evaluationStage.mBlendingSrc < BLEND_LAST) ? evaluationStage.mBlendingSrc : ONE;
+	context.mBlendingDst = (evaluationStage.mBlendingDst < BLEND_LAST) ? evaluationStage.mBlendingDst : ZERO;
+	memcpy(context.mTileRect, evaluationInfo.tileRect, sizeof(context.mTileRect));
+	for (int slot = 0; slot < 8; slot++)
+	{
+		CPUInput& input = context.mInputs[slot];
+		memset(&input, 0, sizeof(CPUInput));
+		int targetIndex = evaluationStage.mInput.mInputs[slot];
+		if (targetIndex < 0 || !mEvaluationStages[targetIndex].mTarget)
+			continue;
+		const Image_t& image = mEvaluationStages[targetIndex].mTarget->mImage;
+		if (!image.mBits || image.mNumFaces != 1)
+			continue;
+		input.mBits = (const uint8_t *)image.mBits;
+		input.mWidth = image.mWidth;
+		input.mHeight = image.mHeight;
+		if (size_t(slot) < evaluationStage.mInputSamplers.size())
+		{
+			// no derivatives here. Minification filter is used when the input is bigger than the target.
+			const InputSampler& inputSampler = evaluationStage.mInputSamplers[slot];
+			bool minification = image.mWidth > context.mWidth || image.mHeight > context.mHeight;
+			// tiles are sampled inside their margins, wrapping would read the other side of the tile
+			input.mWrapU = mbTiling ? 1 : inputSampler.mWrapU;
+			input.mWrapV = mbTiling ? 1 : inputSampler.mWrapV;
+			input.mbNearest = (minification ? inputSampler.mFilterMin : inputSampler.mFilterMag) == 1;
+		}
+	}
+
+	CPUKernelTaskSet task(kernel, context);
+	g_TS.AddTaskSetToPipe(&task);
+	g_TS.WaitforTask(&task);
+}
@@ -0,0 +1,421 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#include <GL/gl3w.h>
+#include "Evaluation.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+extern Evaluation gEvaluation;
+
+// C nodes whose result only depends on their parameters and inputs. Other C nodes are evaluated every time:
+// Paint2D accumulates strokes, ImageWrite and Thumbnail write files.
+// Results of the slow ones are also written to the result cache directory.
+// Nodes reading files start their parameters with file names, their modification time and size are part of the result key
+static const size_t FileParameterLength = 1024;
+static const struct CachedCNode
+{
+	const char *mName;
+	bool mbOnDisk;
+	size_t mFileParameterCount;
+} gCachedCNodes[] = {
+	{ "CubemapFilter", true, 0 },
+	{ "EquirectConverter", false, 0 },
+	{ "ImageRead", false, 7 },
+	{ "PhysicalSky", false, 0 },
+};
+
+static const CachedCNode* GetCachedCNode(const std::string& nodeName)
+{
+	for (auto& cachedCNode : gCachedCNodes)
+	{
+		if (nodeName == cachedCNode.mName)
+			return &cachedCNode;
+	}
+	return NULL;
+}
+
+// FNV-1a
+static const uint64_t HashSeed = 14695981039346656037ULL;
+static uint64_t HashBytes(uint64_t hash, const void *data, size_t size)
+{
+	const uint8_t *bytes = (const uint8_t*)data;
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	return hash;
+}
+
+static void SwapSurfaces(RenderTarget& a, RenderTarget& b)
+{
+	std::swap(a.mImage, b.mImage);
+	std::swap(a.mGLTexID, b.mGLTexID);
+	std::swap(a.mFbo, b.mFbo);
+}
+
+void Evaluation::SetResultCacheBudget(size_t bytes)
+{
+	mResultCacheBudget = bytes;
+	if (!bytes)
+	{
+		// stage contents change without their hash being updated while the cache is off
+		ClearResultCache();
+		for (auto& evaluation : mEvaluationStages)
+			evaluation.mContentHash = 0;
+		return;
+	}
+	TrimResultCache();
+}
+
+bool Evaluation::IsResultCacheEnabled(const EvaluationInfo& evaluationInfo) const
+{
+	return mResultCacheBudget && mEvaluationMode == 0 && mBackend == BACKEND_GLSL && !mbTiling && !evaluationInfo.uiPass && !evaluationInfo.forcedDirty;
+}
+
+uint64_t Evaluation::GetCodeHash(size_t nodeType, const std::string& nodeName)
+{
+	if (nodeType >= mEvaluatorPerNodeType.size())
+		return 0;
+	uint64_t& codeHash = mEvaluatorPerNodeType[nodeType].mCodeHash;
+	if (codeHash)
+		return codeHash;
+	// GLSL nodes are compiled with Shader.glsl
+	uint64_t hash = HashSeed;
+	auto iter = mEvaluatorScripts.find(nodeName + ".glsl");
+	if (iter != mEvaluatorScripts.end())
+	{
+		hash = HashBytes(hash, iter->second.mText.c_str(), iter->second.mText.size());
+		auto shader = mEvaluatorScripts.find("Shader.glsl");
+		if (shader != mEvaluatorScripts.end())
+			hash = HashBytes(hash, shader->second.mText.c_str(), shader->second.mText.size());
+	}
+	iter = mEvaluatorScripts.find(nodeName + ".c");
+	if (iter != mEvaluatorScripts.end())
+		hash = HashBytes(hash, iter->second.mText.c_str(), iter->second.mText.size());
+	codeHash = hash ? hash : 1;
+	return codeHash;
+}
+
+uint64_t Evaluation::ComputeContentHash(size_t index, int width, int height)
+{
+	const EvaluationStage& evaluation = mEvaluationStages[index];
+	// node name rather than type index, disk results are used by later sessions. Results of edited sources are not
+	uint64_t hash = HashBytes(HashSeed, evaluation.mNodeTypename.c_str(), evaluation.mNodeTypename.size());
+	const uint64_t codeHash = GetCodeHash(evaluation.mNodeType, evaluation.mNodeTypename);
+	hash = HashBytes(hash, &codeHash, sizeof(codeHash));
+	if (evaluation.mParameters)
+		hash = HashBytes(hash, evaluation.mParameters, evaluation.mParametersSize);
+	const CachedCNode *cachedCNode = (evaluation.mEvaluationMask&EvaluationC) ? GetCachedCNode(evaluation.mNodeTypename) : NULL;
+	if (cachedCNode && evaluation.mParameters && evaluation.mParametersSize >= cachedCNode->mFileParameterCount * FileParameterLength)
+	{
+		// the same file name doesn't mean the same pixels
+		for (size_t i = 0; i < cachedCNode->mFileParameterCount; i++)
+		{
+			const char *fileName = (const char*)evaluation.mParameters + i * FileParameterLength;
+			if (!fileName[0] || !memchr(fileName, 0, FileParameterLength))
+				continue;
+			struct stat fileStat;
+			int64_t fileState[2] = { 0, 0 };
+			if (stat(fileName, &fileStat) == 0)
+			{
+				fileState[0] = int64_t(fileStat.st_mtime);
+				fileState[1] = int64_t(fileStat.st_size);
+			}
+			hash = HashBytes(hash, fileState, sizeof(fileState));
+		}
+	}
+	if (!evaluation.mInputSamplers.empty())
+		hash = HashBytes(hash, evaluation.mInputSamplers.data(), evaluation.mInputSamplers.size() * sizeof(InputSampler));
+	const int states[] = { width, height, evaluation.mOutputFormat, evaluation.mBlendingSrc, evaluation.mBlendingDst, evaluation.mLButDown, evaluation.mRButDown };
+	hash = HashBytes(hash, states, sizeof(states));
+	const float mouse[] = { evaluation.mRx, evaluation.mRy };
+	hash = HashBytes(hash, mouse, sizeof(mouse));
+	for (auto input : evaluation.mInput.mInputs)
+	{
+		uint64_t inputHash = 0;
+		if (input >= 0)
+		{
+			// input content is not known or not complete
+			inputHash = mEvaluationStages[input].mContentHash;
+			if (!inputHash || StageIsProcessing(input))
+				return 0;
+		}
+		hash = HashBytes(hash, &inputHash, sizeof(inputHash));
+	}
+	return hash ? hash : 1;
+}
+
+bool Evaluation::BeginCachedEvaluation(size_t index, int width, int height)
+{
+	EvaluationStage& evaluation = mEvaluationStages[index];
+	const CachedCNode *cachedCNode = (evaluation.mEvaluationMask&EvaluationC) ? GetCachedCNode(evaluation.mNodeTypename) : NULL;
+	if ((evaluation.mEvaluationMask&EvaluationC) && !cachedCNode)
+	{
+		// new version, children evaluated from it are cached with it
+		mContentVersion++;
+		evaluation.mContentHash = HashBytes(HashSeed, &mContentVersion, sizeof(mContentVersion));
+		return false;
+	}
+	// a pending upload would write in the surface given to the cache
+	if (!evaluation.mTarget || IsUploading(index))
+	{
+		evaluation.mContentHash = 0;
+		return false;
+	}
+	RenderTarget& target = *evaluation.mTarget;
+	const uint64_t hash = evaluation.mbForceEval ? 0 : ComputeContentHash(index, width, height);
+	if (hash && hash == evaluation.mContentHash && target.GetSurfaceSize())
+	{
+		mResultCacheHits++;
+		return true;
+	}
+
+	if (hash)
+	{
+		auto iter = std::find_if(mCachedResults.begin(), mCachedResults.end(), [hash](const CachedResult& cachedResult) { return cachedResult.mHash == hash; });
+		if (iter != mCachedResults.end())
+		{
+			// previous content takes the place of the cached one
+			mResultCacheBytes -= iter->mTarget.GetSurfaceSize();
+			SwapSurfaces(target, iter->mTarget);
+			if (evaluation.mContentHash && iter->mTarget.GetSurfaceSize())
+			{
+				iter->mHash = evaluation.mContentHash;
+				iter->mLastUse = mResultCacheClock++;
+				mResultCacheBytes += iter->mTarget.GetSurfaceSize();
+			}
+			else
+			{
+				iter->mTarget.Release();
+				mCachedResults.erase(iter);
+			}
+			evaluation.mContentHash = hash;
+			mResultCacheHits++;
+			TrimResultCache();
+			return true;
+		}
+	}
+
+	StoreResult(index, true);
+	evaluation.mContentHash = hash;
+	if (!hash)
+		return false;
+	mResultCacheMisses++;
+	if (cachedCNode && cachedCNode->mbOnDisk && !mResultCacheDirectory.empty())
+	{
+		if (LoadDiskResult(index, hash))
+			return true;
+		if (std::find(mPendingDiskResults.begin(), mPendingDiskResults.end(), hash) == mPendingDiskResults.end())
+			mPendingDiskResults.push_back(hash);
+	}
+	return false;
+}
+
+void Evaluation::StoreResult(size_t index, bool reallocate)
+{
+	EvaluationStage& evaluation = mEvaluationStages[index];
+	const uint64_t hash = evaluation.mContentHash;
+	if (!hash || !evaluation.mTarget || !evaluation.mTarget->GetSurfaceSize() || evaluation.mbProcessing || IsUploading(index))
+		return;
+	if ((evaluation.mEvaluationMask&EvaluationC) && !GetCachedCNode(evaluation.mNodeTypename))
+		return;
+	for (auto& cachedResult : mCachedResults)
+	{
+		if (cachedResult.mHash == hash)
+		{
+			cachedResult.mLastUse = mResultCacheClock++;
+			return;
+		}
+	}
+
+	RenderTarget& target = *evaluation.mTarget;
+	const Image_t image = target.mImage;
+	CachedResult cachedResult;
+	cachedResult.mHash = hash;
+	cachedResult.mLastUse = mResultCacheClock++;
+	SwapSurfaces(target, cachedResult.mTarget);
+	mResultCacheBytes += cachedResult.mTarget.GetSurfaceSize();
+	mCachedResults.push_back(cachedResult);
+	if (reallocate)
+	{
+		if (image.mNumFaces == 6)
+			target.InitCube(image.mWidth, image.mFormat);
+		else
+			target.InitBuffer(image.mWidth, image.mHeight, image.mFormat);
+	}
+	TrimResultCache();
+}
+
+void Evaluation::TrimResultCache()
+{
+	while (mResultCacheBytes > mResultCacheBudget && !mCachedResults.empty())
+	{
+		auto oldest = std::min_element(mCachedResults.begin(), mCachedResults.end(), [](const CachedResult& a, const CachedResult& b) { return a.mLastUse < b.mLastUse; });
+		mResultCacheBytes -= oldest->mTarget.GetSurfaceSize();
+		oldest->mTarget.Release();
+		*oldest = mCachedResults.back();
+		mCachedResults.pop_back();
+	}
+}
+
+void Evaluation::ClearResultCache()
+{
+	for (auto& cachedResult : mCachedResults)
+		cachedResult.mTarget.Release();
+	mCachedResults.clear();
+	mResultCacheBytes = 0;
+	mPendingDiskResults.clear();
+}
+
+void Evaluation::SetContentWritten(size_t target)
+{
+	EvaluationStage& evaluation = mEvaluationStages[target];
+	// cached C nodes set their result asynchronously, the hash they got when evaluated stays
+	if ((evaluation.mEvaluationMask&EvaluationC) && GetCachedCNode(evaluation.mNodeTypename))
+		return;
+	mContentVersion++;
+	evaluation.mContentHash = HashBytes(HashSeed, &mContentVersion, sizeof(mContentVersion));
+}
+
+// disk results: image description followed by every face and mip, like GetEvaluationImage
+struct DiskResultHeader
+{
+	uint32_t mMagic;
+	uint32_t mDataSize;
+	int32_t mWidth, mHeight;
+	uint8_t mNumMips, mNumFaces, mFormat, mPadding;
+};
+static const uint32_t DiskResultMagic = 0x31524D49; // IMR1
+
+std::string Evaluation::GetDiskResultPath(uint64_t hash) const
+{
+	char filename[32];
+	sprintf(filename, "%016llx.imr", (unsigned long long)hash);
+	return mResultCacheDirectory + "/" + filename;
+}
+
+bool Evaluation::LoadDiskResult(size_t index, uint64_t hash)
+{
+	FILE *fp = fopen(GetDiskResultPath(hash).c_str(), "rb");
+	if (!fp)
+		return false;
+	DiskResultHeader header;
+	Image image;
+	image.mBits = NULL;
+	if (fread(&header, sizeof(DiskResultHeader), 1, fp) == 1 && header.mMagic == DiskResultMagic && header.mFormat < TextureFormat::Count)
+	{
+		image.mBits = malloc(header.mDataSize);
+		if (fread(image.mBits, header.mDataSize, 1, fp) != 1)
+		{
+			free(image.mBits);
+			image.mBits = NULL;
+		}
+	}
+	fclose(fp);
+	if (!image.mBits)
+	{
+		Log("Result cache file %s is not valid.\n", GetDiskResultPath(hash).c_str());
+		return false;
+	}
+	image.mDataSize = header.mDataSize;
+	image.mWidth = header.mWidth;
+	image.mHeight = header.mHeight;
+	image.mNumMips = header.mNumMips;
+	image.mNumFaces = header.mNumFaces;
+	image.mFormat = header.mFormat;
+	int res = SetEvaluationImage(int(index), &image);
+	FreeImage(&image);
+	if (res != EVAL_OK)
+		return false;
+	mEvaluationStages[index].mbFreeSizing = false;
+	return true;
+}
+
+struct DiskResultJobData
+{
+	char mPath[1024];
+};
+
+static int WriteDiskResultJob(Image *image, void *ptr)
+{
+	const DiskResultJobData *data = (const DiskResultJobData*)ptr;
+	if (!image->mBits)
+		return EVAL_ERR;
+	DiskResultHeader header;
+	header.mMagic = DiskResultMagic;
+	header.mDataSize = image->mDataSize;
+	header.mWidth = image->mWidth;
+	header.mHeight = image->mHeight;
+	header.mNumMips = image->mNumMips;
+	header.mNumFaces = image->mNumFaces;
+	header.mFormat = image->mFormat;
+	header.mPadding = 0;
+	FILE *fp = fopen(data->mPath, "wb");
+	if (fp)
+	{
+		fwrite(&header, sizeof(DiskResultHeader), 1, fp);
+		fwrite(image->mBits, image->mDataSize, 1, fp);
+		fclose(fp);
+	}
+	else
+	{
+		Log("Unable to write result cache file %s\n", data->mPath);
+	}
+	Evaluation::FreeImage(image);
+	return EVAL_OK;
+}
+
+void Evaluation::WritePendingDiskResults()
+{
+	for (size_t i = 0; i < mPendingDiskResults.size();)
+	{
+		const uint64_t hash = mPendingDiskResults[i];
+		int stage = -1;
+		for (size_t j = 0; j < mEvaluationStages.size(); j++)
+		{
+			if (mEvaluationStages[j].mContentHash == hash)
+			{
+				stage = int(j);
+				break;
+			}
+		}
+		// result is not complete yet
+		if (stage != -1 && StageIsProcessing(stage))
+		{
+			i++;
+			continue;
+		}
+		if (stage != -1)
+		{
+			DiskResultJobData data;
+			std::string path = GetDiskResultPath(hash);
+			strncpy(data.mPath, path.c_str(), sizeof(data.mPath) - 1);
+			data.mPath[sizeof(data.mPath) - 1] = 0;
+			GetEvaluationImageAsync(stage, WriteDiskResultJob, &data, sizeof(DiskResultJobData));
+		}
+		mPendingDiskResults.erase(mPendingDiskResults.begin() + i);
+	}
+}
@@ -0,0 +1,490 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include "Evaluation.h"
+#include "TaskScheduler.h"
+#include <emmintrin.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+extern enki::TaskScheduler g_TS;
+extern int Log(const char *szFormat, ...);
+
+// Image kernels of the C API. A pixel is one SSE register, channels in RGBA order whatever the memory order.
+// Rows are split across the workers.
+
+struct KernelImage
+{
+	uint8_t *mBits;
+	int mWidth;
+	int mHeight;
+	bool mbFloat;
+	bool mbBGRA;
+
+	size_t TexelSize() const { return mbFloat ? 16 : 4; }
+	uint8_t *Texel(int x, int y) const { return mBits + (size_t(y) * mWidth + x) * TexelSize(); }
+
+	__m128 Load(int x, int y) const
+	{
+		const uint8_t *texel = Texel(x, y);
+		if (mbFloat)
+			return _mm_loadu_ps((const float*)texel);
+		int value;
+		memcpy(&value, texel, sizeof(int));
+		__m128i pixel = _mm_unpacklo_epi8(_mm_cvtsi32_si128(value), _mm_setzero_si128());
+		pixel = _mm_unpacklo_epi16(pixel, _mm_setzero_si128());
+		__m128 res = _mm_mul_ps(_mm_cvtepi32_ps(pixel), _mm_set1_ps(1.f / 255.f));
+		return mbBGRA ? _mm_shuffle_ps(res, res, _MM_SHUFFLE(3, 0, 1, 2)) : res;
+	}
+	void Store(int x, int y, __m128 value) const
+	{
+		uint8_t *texel = Texel(x, y);
+		if (mbFloat)
+		{
+			_mm_storeu_ps((float*)texel, value);
+			return;
+		}
+		if (mbBGRA)
+			value = _mm_shuffle_ps(value, value, _MM_SHUFFLE(3, 0, 1, 2));
+		value = _mm_min_ps(_mm_max_ps(value, _mm_setzero_ps()), _mm_set1_ps(1.f));
+		__m128i pixel = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(value, _mm_set1_ps(255.f)), _mm_set1_ps(0.5f)));
+		pixel = _mm_packs_epi32(pixel, pixel);
+		pixel = _mm_packus_epi16(pixel, pixel);
+		int res = _mm_cvtsi128_si32(pixel);
+		memcpy(texel, &res, sizeof(int));
+	}
+};
+
+static bool IsKernelFormat(int format)
+{
+	return format == TextureFormat::RGBA8 || format == TextureFormat::BGRA8 || format == TextureFormat::RGBA32F;
+}
+
+static bool CheckKernelFormat(const Image *image, const char *functionName)
+{
+	if (image && image->mBits && IsKernelFormat(image->mFormat))
+		return true;
+	Log("%s needs a RGBA8, BGRA8 or RGBA32F image. Use ConvertImage first.\n", functionName);
+	return false;
+}
+
+static size_t GetLevelSize(const Image *image, int format, int level)
+{
+	return size_t(image->mWidth >> level) * (image->mHeight >> level) * ((format == TextureFormat::RGBA32F) ? 16 : 4);
+}
+
+// faces are stored one after the other with their mips
+static KernelImage GetKernelImage(const Image *image, int face, int level)
+{
+	size_t faceSize = 0;
+	size_t levelOffset = 0;
+	for (int i = 0; i < image->mNumMips; i++)
+	{
+		if (i == level)
+			levelOffset = faceSize;
+		faceSize += GetLevelSize(image, image->mFormat, i);
+	}
+	KernelImage res;
+	res.mBits = (uint8_t*)image->mBits + face * faceSize + levelOffset;
+	res.mWidth = image->mWidth >> level;
+	res.mHeight = image->mHeight >> level;
+	res.mbFloat = image->mFormat == TextureFormat::RGBA32F;
+	res.mbBGRA = image->mFormat == TextureFormat::BGRA8;
+	return res;
+}
+
+// every texel of every face and mip as one row
+static KernelImage GetKernelPixels(const Image *image)
+{
+	KernelImage res = GetKernelImage(image, 0, 0);
+	res.mWidth = int(image->mDataSize / res.TexelSize());
+	res.mHeight = 1;
+	return res;
+}
+
+struct ImageRowsTaskSet : enki::ITaskSet
+{
+	ImageRowsTaskSet(int rowCount, const std::function<void(int, uint32_t)>& row) : enki::ITaskSet(rowCount, 16)
+		, mRow(row)
+	{
+	}
+	virtual void ExecuteRange(enki::TaskSetPartition range, uint32_t threadnum)
+	{
+		for (uint32_t y = range.start; y < range.end; y++)
+			mRow(int(y), threadnum);
+	}
+	const std::function<void(int, uint32_t)>& mRow;
+};
+
+// row(y, threadnum). Small images are not worth the scheduling
+static void ParallelRows(int rowCount, int width, const std::function<void(int, uint32_t)>& row)
+{
+	if (size_t(rowCount) * width < 16384)
+	{
+		for (int y = 0; y < rowCount; y++)
+			row(y, 0);
+		return;
+	}
+	ImageRowsTaskSet task(rowCount, row);
+	g_TS.AddTaskSetToPipe(&task);
+	g_TS.WaitforTask(&task);
+}
+
+// per pixel kernels on a single row of pixels, cut in spans for the workers
+static void ParallelPixels(const KernelImage& pixels, const std::function<void(int, int)>& span)
+{
+	static const int spanSize = 4096;
+	const int spanCount = (pixels.mWidth + spanSize - 1) / spanSize;
+	ParallelRows(spanCount, spanSize, [&](int index, uint32_t) {
+		span(index * spanSize, std::min(pixels.mWidth, (index + 1) * spanSize));
+	});
+}
+
+static void AllocateLike(const Image *image, Image *res, int width, int height, int mipCount, int format)
+{
+	*res = *image;
+	res->mWidth = width;
+	res->mHeight = height;
+	res->mNumMips = uint8_t(mipCount);
+	res->mFormat = uint8_t(format);
+	size_t faceSize = 0;
+	for (int i = 0; i < mipCount; i++)
+		faceSize += GetLevelSize(res, format, i);
+	res->mDataSize = int(faceSize * image->mNumFaces);
+	res->mBits = malloc(res->mDataSize);
+}
+
+static void ReplaceBits(Image *image, Image& res)
+{
+	free(image->mBits);
+	*image = res;
+}
+
+// 2x2 box, or 2x1 / 1x2 when only one side is halved
+static void Downsample(const KernelImage& source, const KernelImage& destination)
+{
+	const int stepX = (destination.mWidth < source.mWidth) ? 2 : 1;
+	const int stepY = (destination.mHeight < source.mHeight) ? 2 : 1;
+	ParallelRows(destination.mHeight, destination.mWidth, [&](int y, uint32_t) {
+		const int y0 = y * stepY;
+		const int y1 = std::min(y0 + stepY - 1, source.mHeight - 1);
+		for (int x = 0; x < destination.mWidth; x++)
+		{
+			const int x0 = x * stepX;
+			const int x1 = std::min(x0 + stepX - 1, source.mWidth - 1);
+			// x1 == x0 or y1 == y0 when that side is not halved, the texel counts twice
+			__m128 sum = _mm_add_ps(_mm_add_ps(source.Load(x0, y0), source.Load(x1, y0)), _mm_add_ps(source.Load(x0, y1), source.Load(x1, y1)));
+			destination.Store(x, y, _mm_mul_ps(sum, _mm_set1_ps(0.25f)));
+		}
+	});
+}
+
+static void Bilinear(const KernelImage& source, const KernelImage& destination)
+{
+	const float scaleX = float(source.mWidth) / float(destination.mWidth);
+	const float scaleY = float(source.mHeight) / float(destination.mHeight);
+	ParallelRows(destination.mHeight, destination.mWidth, [&](int y, uint32_t) {
+		const float v = std::max((float(y) + 0.5f) * scaleY - 0.5f, 0.f);
+		const int y0 = std::min(int(v), source.mHeight - 1);
+		const int y1 = std::min(y0 + 1, source.mHeight - 1);
+		const __m128 fy = _mm_set1_ps(v - float(y0));
+		for (int x = 0; x < destination.mWidth; x++)
+		{
+			const float u = std::max((float(x) + 0.5f) * scaleX - 0.5f, 0.f);
+			const int x0 = std::min(int(u), source.mWidth - 1);
+			const int x1 = std::min(x0 + 1, source.mWidth - 1);
+			const __m128 fx = _mm_set1_ps(u - float(x0));
+			__m128 top = source.Load(x0, y0);
+			top = _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(source.Load(x1, y0), top), fx));
+			__m128 bottom = source.Load(x0, y1);
+			bottom = _mm_add_ps(bottom, _mm_mul_ps(_mm_sub_ps(source.Load(x1, y1), bottom), fx));
+			destination.Store(x, y, _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(bottom, top), fy)));
+		}
+	});
+}
+
+int Evaluation::ResizeImage(Image *image, int width, int height)
+{
+	if (!CheckKernelFormat(image, "ResizeImage") || width < 1 || height < 1)
+		return EVAL_ERR;
+
+	// halved with a box filter while bigger than twice the size, so every source texel counts. Then bilinear.
+	// current is the caller's image until a buffer is allocated: its faces are read with their mips
+	Image current = *image;
+	bool owned = false;
+	while (current.mWidth >= width * 2 || current.mHeight >= height * 2)
+	{
+		Image half;
+		AllocateLike(&current, &half, (current.mWidth >= width * 2) ? current.mWidth / 2 : current.mWidth, (current.mHeight >= height * 2) ? current.mHeight / 2 : current.mHeight, 1, current.mFormat);
+		for (int face = 0; face < current.mNumFaces; face++)
+			Downsample(GetKernelImage(&current, face, 0), GetKernelImage(&half, face, 0));
+		if (owned)
+			free(current.mBits);
+		current = half;
+		owned = true;
+	}
+
+	if (current.mWidth != width || current.mHeight != height)
+	{
+		Image resized;
+		AllocateLike(&current, &resized, width, height, 1, current.mFormat);
+		for (int face = 0; face < current.mNumFaces; face++)
+			Bilinear(GetKernelImage(&current, face, 0), GetKernelImage(&resized, face, 0));
+		if (owned)
+			free(current.mBits);
+		current = resized;
+		owned = true;
+	}
+
+	if (!owned)
+	{
+		// same size, only the mips are removed
+		if (image->mNumMips == 1)
+			return EVAL_OK;
+		AllocateLike(image, &current, width, height, 1, image->mFormat);
+		for (int face = 0; face < image->mNumFaces; face++)
+			memcpy(GetKernelImage(&current, face, 0).mBits, GetKernelImage(image, face, 0).mBits, GetLevelSize(image, image->mFormat, 0));
+	}
+	ReplaceBits(image, current);
+	return EVAL_OK;
+}
+
+int Evaluation::GenerateMips(Image *image)
+{
+	if (!CheckKernelFormat(image, "GenerateMips"))
+		return EVAL_ERR;
+
+	// same chain as the GL textures: sizes are width >> level and height >> level
+	int mipCount = 1;
+	while ((image->mWidth >> mipCount) && (image->mHeight >> mipCount))
+		mipCount++;
+
+	Image res;
+	AllocateLike(image, &res, image->mWidth, image->mHeight, mipCount, image->mFormat);
+	for (int face = 0; face < image->mNumFaces; face++)
+	{
+		memcpy(GetKernelImage(&res, face, 0).mBits, GetKernelImage(image, face, 0).mBits, GetLevelSize(image, image->mFormat, 0));
+		for (int level = 1; level < mipCount; level++)
+			Downsample(GetKernelImage(&res, face, level - 1), GetKernelImage(&res, face, level));
+	}
+	ReplaceBits(image, res);
+	return EVAL_OK;
+}
+
+// same operations as the Blend node
+static inline __m128 BlendPixel(int operation, __m128 a, __m128 b)
+{
+	const __m128 one = _mm_set1_ps(1.f);
+	switch (operation)
+	{
+	case 0: return _mm_add_ps(a, b); // Add
+	case 1: return _mm_mul_ps(a, b); // Multiply
+	case 2: return _mm_min_ps(a, b); // Darken
+	case 3: return _mm_max_ps(a, b); // Lighten
+	case 4: return _mm_mul_ps(_mm_add_ps(a, b), _mm_set1_ps(0.5f)); // Average
+	case 5: return _mm_sub_ps(one, _mm_mul_ps(_mm_sub_ps(one, b), _mm_sub_ps(one, a))); // Screen
+	case 6: return _mm_sub_ps(one, _mm_div_ps(_mm_sub_ps(one, a), b)); // Color Burn
+	case 7: return _mm_div_ps(a, _mm_sub_ps(one, b)); // Color Dodge
+	case 8: return _mm_sub_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.f), _mm_mul_ps(a, b)), _mm_mul_ps(a, a)), _mm_mul_ps(_mm_set1_ps(2.f), _mm_mul_ps(_mm_mul_ps(a, a), b))); // Soft Light
+	case 9: return _mm_sub_ps(a, b); // Subtract
+	case 10: return _mm_andnot_ps(_mm_set1_ps(-0.f), _mm_sub_ps(b, a)); // Difference
+	case 11: return _mm_sub_ps(one, _mm_andnot_ps(_mm_set1_ps(-0.f), _mm_sub_ps(_mm_sub_ps(one, a), b))); // Inverse Difference
+	case 12: return _mm_sub_ps(_mm_add_ps(b, a), _mm_mul_ps(_mm_set1_ps(2.f), _mm_mul_ps(a, b))); // Exclusion
+	}
+	return a;
+}
+
+int Evaluation::BlendImage(Image *destination, const Image *source, int operation, float opacity)
+{
+	if (!CheckKernelFormat(destination, "BlendImage") || !CheckKernelFormat(source, "BlendImage"))
+		return EVAL_ERR;
+	if (destination->mWidth != source->mWidth || destination->mHeight != source->mHeight
+		|| destination->mNumFaces != source->mNumFaces || destination->mNumMips != source->mNumMips)
+	{
+		Log("BlendImage needs images of the same size, faces and mips.\n");
+		return EVAL_ERR;
+	}
+	if (operation < 0 || operation > 12)
+		return EVAL_ERR;
+
+	const KernelImage a = GetKernelPixels(destination);
+	const KernelImage b = GetKernelPixels(source);
+	const __m128 alpha = _mm_set1_ps(opacity);
+	ParallelPixels(a, [&](int begin, int end) {
+		for (int x = begin; x < end; x++)
+		{
+			__m128 dst = a.Load(x, 0);
+			__m128 blended = BlendPixel(operation, dst, b.Load(x, 0));
+			a.Store(x, 0, _mm_add_ps(dst, _mm_mul_ps(_mm_sub_ps(blended, dst), alpha)));
+		}
+	});
+	return EVAL_OK;
+}
+
+int Evaluation::ConvolveImage(Image *image, const float *kernel, int kernelWidth, int kernelHeight)
+{
+	if (!CheckKernelFormat(image, "ConvolveImage") || !kernel || kernelWidth < 1 || kernelHeight < 1)
+		return EVAL_ERR;
+
+	// kernel is centered, borders are clamped
+	const int halfWidth = kernelWidth / 2;
+	const int halfHeight = kernelHeight / 2;
+	Image res;
+	AllocateLike(image, &res, image->mWidth, image->mHeight, image->mNumMips, image->mFormat);
+	for (int face = 0; face < image->mNumFaces; face++)
+	{
+		for (int level = 0; level < image->mNumMips; level++)
+		{
+			const KernelImage source = GetKernelImage(image, face, level);
+			const KernelImage destination = GetKernelImage(&res, face, level);
+			ParallelRows(source.mHeight, source.mWidth * kernelWidth * kernelHeight, [&](int y, uint32_t) {
+				for (int x = 0; x < source.mWidth; x++)
+				{
+					__m128 sum = _mm_setzero_ps();
+					for (int j = 0; j < kernelHeight; j++)
+					{
+						const int sy = std::min(std::max(y + j - halfHeight, 0), source.mHeight - 1);
+						for (int i = 0; i < kernelWidth; i++)
+						{
+							const int sx = std::min(std::max(x + i - halfWidth, 0), source.mWidth - 1);
+							sum = _mm_add_ps(sum, _mm_mul_ps(source.Load(sx, sy), _mm_set1_ps(kernel[j * kernelWidth + i])));
+						}
+					}
+					destination.Store(x, y, sum);
+				}
+			});
+		}
+	}
+	ReplaceBits(image, res);
+	return EVAL_OK;
+}
+
+int Evaluation::GetImageHistogram(const Image *image, unsigned int *histogram)
+{
+	if (!CheckKernelFormat(image, "GetImageHistogram") || !histogram)
+		return EVAL_ERR;
+
+	// one histogram per worker, added at the end
+	const uint32_t threadCount = g_TS.GetNumTaskThreads();
+	std::vector<unsigned int> histograms(threadCount * 1024, 0);
+	for (int face = 0; face < image->mNumFaces; face++)
+	{
+		const KernelImage source = GetKernelImage(image, face, 0);
+		ParallelRows(source.mHeight, source.mWidth, [&](int y, uint32_t threadnum) {
+			unsigned int *bins = &histograms[threadnum * 1024];
+			for (int x = 0; x < source.mWidth; x++)
+			{
+				__m128 value = _mm_min_ps(_mm_max_ps(source.Load(x, y), _mm_setzero_ps()), _mm_set1_ps(1.f));
+				__m128i index = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(value, _mm_set1_ps(255.f)), _mm_set1_ps(0.5f)));
+				int indices[4];
+				_mm_storeu_si128((__m128i*)indices, index);
+				bins[indices[0]]++;
+				bins[256 + indices[1]]++;
+				bins[512 + indices[2]]++;
+				bins[768 + indices[3]]++;
+			}
+		});
+	}
+	memset(histogram, 0, 1024 * sizeof(unsigned int));
+	for (uint32_t thread = 0; thread < threadCount; thread++)
+	{
+		for (int i = 0; i < 1024; i++)
+			histogram[i] += histograms[thread * 1024 + i];
+	}
+	return EVAL_OK;
+}
+
+int Evaluation::PremultiplyImage(Image *image, int unpremultiply)
+{
+	if (!CheckKernelFormat(image, "PremultiplyImage"))
+		return EVAL_ERR;
+
+	const KernelImage pixels = GetKernelPixels(image);
+	// alpha keeps its value: rgb is multiplied by (a, a, a, 1)
+	const __m128 alphaLane = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+	const __m128 one = _mm_set1_ps(1.f);
+	ParallelPixels(pixels, [&](int begin, int end) {
+		for (int x = begin; x < end; x++)
+		{
+			__m128 pixel = pixels.Load(x, 0);
+			__m128 alpha = _mm_shuffle_ps(pixel, pixel, _MM_SHUFFLE(3, 3, 3, 3));
+			if (unpremultiply)
+			{
+				// transparent pixels have no color to get back
+				__m128 valid = _mm_cmpgt_ps(alpha, _mm_setzero_ps());
+				alpha = _mm_or_ps(_mm_and_ps(valid, _mm_div_ps(one, alpha)), _mm_andnot_ps(valid, one));
+			}
+			__m128 factor = _mm_or_ps(_mm_and_ps(alphaLane, one), _mm_andnot_ps(alphaLane, alpha));
+			pixels.Store(x, 0, _mm_mul_ps(pixel, factor));
+		}
+	});
+	return EVAL_OK;
+}
+
+int Evaluation::SwizzleImage(Image *image, int red, int green, int blue, int alpha)
+{
+	if (!CheckKernelFormat(image, "SwizzleImage"))
+		return EVAL_ERR;
+	const int channels[4] = { red, green, blue, alpha };
+	for (int channel : channels)
+	{
+		if (channel < 0 || channel > 5)
+			return EVAL_ERR;
+	}
+
+	// channels 0 to 3 are red, green, blue, alpha. 4 is 0 and 5 is 1
+	const KernelImage pixels = GetKernelPixels(image);
+	ParallelPixels(pixels, [&](int begin, int end) {
+		float values[8] = { 0.f, 0.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f };
+		for (int x = begin; x < end; x++)
+		{
+			_mm_storeu_ps(values, pixels.Load(x, 0));
+			pixels.Store(x, 0, _mm_setr_ps(values[red], values[green], values[blue], values[alpha]));
+		}
+	});
+	return EVAL_OK;
+}
+
+bool Evaluation::ConvertKernelImage(Image *image, int format)
+{
+	// between 4 channel formats. The others are converted by cmft
+	if (!image->mBits || !IsKernelFormat(image->mFormat) || !IsKernelFormat(format))
+		return false;
+
+	Image res;
+	AllocateLike(image, &res, image->mWidth, image->mHeight, image->mNumMips, format);
+	const KernelImage source = GetKernelPixels(image);
+	const KernelImage destination = GetKernelPixels(&res);
+	ParallelPixels(source, [&](int begin, int end) {
+		for (int x = begin; x < end; x++)
+			destination.Store(x, 0, source.Load(x, 0));
+	});
+	ReplaceBits(image, res);
+	return true;
+}
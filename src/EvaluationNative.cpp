@@ -0,0 +1,207 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include "Evaluation.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <set>
+#ifndef _WIN32
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+extern int Log(const char *szFormat, ...);
+
+#ifdef _WIN32
+
+bool Evaluation::CompileNativeC(CCompilation& compilation, const std::vector<std::pair<const char*, void*> >& apiFunctions)
+{
+	Log("%s - No native compiler on this platform, tcc is used.\n", compilation.mFilename.c_str());
+	return false;
+}
+
+#else
+
+static const char *nativeCacheDirectory = "NativeCache/";
+static const char *nativeFlags = "-O2 -march=native -fPIC -shared -w";
+// without a known host CPU, objects must run on any machine sharing the cache
+static const char *portableNativeFlags = "-O2 -fPIC -shared -w";
+// declared by Imogen.h but provided by the C library of the shared object
+static const char *nativeLibcFunctions[] = { "memmove", "strcpy", "strlen" };
+
+static uint64_t NativeHash(const std::string& text)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (unsigned char c : text)
+	{
+		hash ^= c;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// identity of the host CPU from /proc/cpuinfo: model and instruction set extensions of the first processor.
+// Empty when unknown
+static const std::string& GetHostCPU()
+{
+	static std::string hostCPU;
+	static bool read = false;
+	if (read)
+		return hostCPU;
+	read = true;
+
+	static const char *keys[] = { "vendor_id", "cpu family", "model", "model name", "stepping", "flags", "Features",
+		"CPU implementer", "CPU architecture", "CPU variant", "CPU part", "CPU revision" };
+	std::ifstream cpuinfo("/proc/cpuinfo");
+	std::string line;
+	while (std::getline(cpuinfo, line) && !line.empty())
+	{
+		size_t colon = line.find(':');
+		if (colon == std::string::npos)
+			continue;
+		std::string key = line.substr(0, colon);
+		key.erase(key.find_last_not_of(" \t") + 1);
+		for (auto *cpuKey : keys)
+		{
+			if (key == cpuKey)
+				hostCPU += line + "\n";
+		}
+	}
+	return hostCPU;
+}
+
+// contents of the quoted includes found in the include directory, and of theirs. A header change
+// (Image_t, Evaluation_t layouts) must not load an object built with the previous one
+static void AppendIncludes(const std::string& text, const std::string& includeDirectory, std::set<std::string>& visited, std::string& res)
+{
+	size_t position = 0;
+	while ((position = text.find("#include", position)) != std::string::npos)
+	{
+		position += 8;
+		size_t begin = text.find_first_not_of(" \t", position);
+		if (begin == std::string::npos || text[begin] != '"')
+			continue;
+		size_t end = text.find('"', begin + 1);
+		if (end == std::string::npos)
+			break;
+		const std::string name = text.substr(begin + 1, end - begin - 1);
+		if (!visited.insert(name).second)
+			continue;
+		std::ifstream t(includeDirectory + "/" + name);
+		if (!t.good())
+			continue;
+		std::string header((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
+		res += name + "\n" + header;
+		AppendIncludes(header, includeDirectory, visited, res);
+	}
+}
+
+bool Evaluation::CompileNativeC(CCompilation& compilation, const std::vector<std::pair<const char*, void*> >& apiFunctions)
+{
+	const std::string& filename = compilation.mFilename;
+
+	// API calls go through pointers set after loading, the same table tcc links against
+	std::string source = "#define main ImogenNativeMain\n";
+	for (auto& apiFunction : apiFunctions)
+	{
+		bool libc = false;
+		for (auto *libcFunction : nativeLibcFunctions)
+			libc |= !strcmp(apiFunction.first, libcFunction);
+		if (!libc)
+			source += std::string("#define ") + apiFunction.first + " (*ImogenAPI_" + apiFunction.first + ")\n";
+	}
+	source += "#line 1 \"" + filename + "\"\n" + compilation.mText + "\n";
+
+	const char *compiler = getenv("CC");
+	if (!compiler || !compiler[0])
+		compiler = "cc";
+	const std::string includeDirectory = compilation.mDirectory.empty() ? std::string(".") : compilation.mDirectory;
+
+	// shared objects are kept between sessions, named after the source, its headers, compiler, flags and the CPU
+	// -march=native built for. A cache shared with another machine must not load instructions it doesn't have
+	const std::string& hostCPU = GetHostCPU();
+	const char *flags = hostCPU.empty() ? portableNativeFlags : nativeFlags;
+	std::string headers;
+	std::set<std::string> visited;
+	AppendIncludes(compilation.mText, includeDirectory, visited, headers);
+	char hashString[17];
+	sprintf(hashString, "%016llx", (unsigned long long)NativeHash(source + headers + compiler + flags + includeDirectory + hostCPU));
+	std::string stem = filename.substr(0, filename.find_last_of('.'));
+	const std::string basename = nativeCacheDirectory + stem + "_" + hashString;
+	const std::string library = basename + ".so";
+
+	if (access(library.c_str(), R_OK) != 0)
+	{
+		mkdir(nativeCacheDirectory, 0755);
+		{
+			std::ofstream out(basename + ".c");
+			if (!out.good())
+			{
+				Log("%s - Unable to write %s.c, tcc is used.\n", filename.c_str(), basename.c_str());
+				return false;
+			}
+			out << source;
+		}
+		// written next to the library then renamed, so a concurrent session never loads half a file
+		const std::string temporary = basename + ".tmp.so";
+		std::string command = std::string(compiler) + " " + flags + " -I\"" + includeDirectory + "\" -o \"" + temporary + "\" \"" + basename + ".c\" -lm > \"" + basename + ".log\" 2>&1";
+		if (system(command.c_str()) != 0 || rename(temporary.c_str(), library.c_str()) != 0)
+		{
+			Log("%s - Native compilation failed, see %s.log. tcc is used.\n", filename.c_str(), basename.c_str());
+			remove(temporary.c_str());
+			return false;
+		}
+		remove((basename + ".log").c_str());
+	}
+
+	// never closed: jobs started by the previous program may still run after a reload
+	void *handle = dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (!handle)
+	{
+		Log("%s - Unable to load %s (%s), tcc is used.\n", filename.c_str(), library.c_str(), dlerror());
+		return false;
+	}
+	for (auto& apiFunction : apiFunctions)
+	{
+		void **pointer = (void**)dlsym(handle, (std::string("ImogenAPI_") + apiFunction.first).c_str());
+		if (pointer)
+			*pointer = apiFunction.second;
+	}
+	*(void**)(&compilation.mCFunction) = dlsym(handle, "ImogenNativeMain");
+	if (!compilation.mCFunction)
+	{
+		Log("%s - No main function!\n", filename.c_str());
+		dlclose(handle);
+		return false;
+	}
+	compilation.mMem = NULL;
+	return true;
+}
+
+#endif
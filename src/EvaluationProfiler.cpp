@@ -0,0 +1,146 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#include <GL/gl3w.h>
+#include "Evaluation.h"
+#include <SDL.h>
+
+extern Evaluation gEvaluation;
+
+// stage evaluated by the thread, jobs started from it take it. See JobTimer
+static thread_local int gJobStage = -1;
+
+int Evaluation::GetJobStage()
+{
+	return gJobStage;
+}
+
+void Evaluation::SetJobStage(int target)
+{
+	gJobStage = target;
+}
+
+uint64_t Evaluation::GetProfilerTicks()
+{
+	return SDL_GetPerformanceCounter();
+}
+
+float Evaluation::GetProfilerTime(uint64_t startTicks)
+{
+	return float(double(SDL_GetPerformanceCounter() - startTicks) * 1000.0 / double(SDL_GetPerformanceFrequency()));
+}
+
+Evaluation::JobTimer::JobTimer(int stage) : mStage(stage), mPreviousStage(gJobStage), mStart(0)
+{
+	gJobStage = stage;
+	if (stage >= 0 && gEvaluation.IsProfiling())
+		mStart = GetProfilerTicks();
+}
+
+Evaluation::JobTimer::~JobTimer()
+{
+	gJobStage = mPreviousStage;
+	if (mStart)
+		gEvaluation.AddJobTime(mStage, GetProfilerTime(mStart));
+}
+
+void Evaluation::SetProfiling(bool profiling)
+{
+	if (profiling == mbProfiling)
+		return;
+	mbProfiling = profiling;
+	for (auto& evaluation : mEvaluationStages)
+	{
+		if (!profiling)
+			ClearGPUTimer(evaluation);
+		evaluation.mTimings.mGPUTime = evaluation.mTimings.mCPUTime = 0.f;
+	}
+	std::lock_guard<std::mutex> lock(mJobTimesMutex);
+	mJobTimes.clear();
+}
+
+float Evaluation::GetStageJobTime(size_t target)
+{
+	std::lock_guard<std::mutex> lock(mJobTimesMutex);
+	auto iter = mJobTimes.find(target);
+	return (iter != mJobTimes.end()) ? iter->second : 0.f;
+}
+
+void Evaluation::AddJobTime(int target, float time)
+{
+	std::lock_guard<std::mutex> lock(mJobTimesMutex);
+	mJobTimes[target] += time;
+}
+
+bool Evaluation::BeginGPUTimer(EvaluationStage& evaluationStage)
+{
+	EvaluationStage::Timings& timings = evaluationStage.mTimings;
+	// query of 2 evaluations ago is not available yet. Skip this one rather than wait
+	if (timings.mbQueryPending[timings.mQueryIndex])
+		return false;
+	if (!timings.mQueries[0])
+		glGenQueries(2, timings.mQueries);
+	glBeginQuery(GL_TIME_ELAPSED, timings.mQueries[timings.mQueryIndex]);
+	return true;
+}
+
+void Evaluation::EndGPUTimer(EvaluationStage& evaluationStage)
+{
+	EvaluationStage::Timings& timings = evaluationStage.mTimings;
+	glEndQuery(GL_TIME_ELAPSED);
+	timings.mbQueryPending[timings.mQueryIndex] = true;
+	timings.mQueryIndex ^= 1;
+}
+
+void Evaluation::CollectGPUTimings()
+{
+	for (auto& evaluation : mEvaluationStages)
+	{
+		EvaluationStage::Timings& timings = evaluation.mTimings;
+		// oldest query first so the most recent result is kept
+		for (int i = 0; i < 2; i++)
+		{
+			int index = (timings.mQueryIndex + i) & 1;
+			if (!timings.mbQueryPending[index])
+				continue;
+			GLint available = 0;
+			glGetQueryObjectiv(timings.mQueries[index], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available)
+				continue;
+			GLuint64 elapsed = 0;
+			glGetQueryObjectui64v(timings.mQueries[index], GL_QUERY_RESULT, &elapsed);
+			timings.mGPUTime = float(double(elapsed) / 1000000.0);
+			timings.mbQueryPending[index] = false;
+		}
+	}
+}
+
+void Evaluation::ClearGPUTimer(EvaluationStage& evaluationStage)
+{
+	EvaluationStage::Timings& timings = evaluationStage.mTimings;
+	if (timings.mQueries[0])
+		glDeleteQueries(2, timings.mQueries);
+	timings = EvaluationStage::Timings();
+}
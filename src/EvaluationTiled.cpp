@@ -0,0 +1,277 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#include <GL/gl3w.h>
+#include "Evaluation.h"
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+
+extern Evaluation gEvaluation;
+
+// how far from its own uv a node reads its inputs, in uv. Nodes missing here read anywhere (Transform, Swirl, Tile,...)
+// or need a C part, they can't be tiled.
+typedef float(*TileHaloFunction)(const void *parameters, size_t parametersSize);
+
+// std140 offset, like the shader reads it
+static float ReadParameter(const void *parameters, size_t parametersSize, size_t offset)
+{
+	float res = 0.f;
+	if (parameters && offset + sizeof(float) <= parametersSize)
+		memcpy(&res, (const uint8_t *)parameters + offset, sizeof(float));
+	return res;
+}
+
+static float NoHalo(const void *, size_t) { return 0.f; }
+static float BlurHalo(const void *parameters, size_t parametersSize) { return fabsf(ReadParameter(parameters, parametersSize, 4)) * 5.f; }
+static float NormalMapHalo(const void *parameters, size_t parametersSize) { return fabsf(ReadParameter(parameters, parametersSize, 0)); }
+static float PixelizeHalo(const void *parameters, size_t parametersSize)
+{
+	float scale = fabsf(ReadParameter(parameters, parametersSize, 0));
+	return (scale > FLT_EPSILON) ? 1.f / scale : 1.f;
+}
+
+static const struct
+{
+	const char *mName;
+	TileHaloFunction mHalo;
+} tileHalos[] = {
+	{ "Circle", NoHalo },
+	{ "CircleSplatter", NoHalo },
+	{ "Checker", NoHalo },
+	{ "Color", NoHalo },
+	{ "Hexagon", NoHalo },
+	{ "iqnoise", NoHalo },
+	{ "Sine", NoHalo },
+	{ "Square", NoHalo },
+	{ "Blend", NoHalo },
+	{ "Clamp", NoHalo },
+	{ "Invert", NoHalo },
+	{ "MADD", NoHalo },
+	{ "NormalMapBlending", NoHalo },
+	{ "Ramp", NoHalo },
+	{ "SmoothStep", NoHalo },
+	{ "Blur", BlurHalo },
+	{ "NormalMap", NormalMapHalo },
+	{ "Pixelize", PixelizeHalo },
+};
+
+static TileHaloFunction GetTileHalo(const std::string& nodeName)
+{
+	for (auto& tileHalo : tileHalos)
+	{
+		if (nodeName == tileHalo.mName)
+			return tileHalo.mHalo;
+	}
+	return NULL;
+}
+
+// uncompressed 32 bits TGA, bottom-left origin like the GL images. Tile rows are written at their place in the file.
+struct TGATileWriter
+{
+	TGATileWriter() : mFile(NULL), mWidth(0), mHeight(0) {}
+	~TGATileWriter()
+	{
+		if (mFile)
+			fclose(mFile);
+	}
+
+	bool Open(const char *filename, int width, int height)
+	{
+		if (width > 0xFFFF || height > 0xFFFF)
+			return false;
+		mFile = fopen(filename, "wb");
+		if (!mFile)
+			return false;
+		mWidth = width;
+		mHeight = height;
+		uint8_t header[18] = { 0, 0, 2 };
+		header[12] = uint8_t(width & 0xFF);
+		header[13] = uint8_t(width >> 8);
+		header[14] = uint8_t(height & 0xFF);
+		header[15] = uint8_t(height >> 8);
+		header[16] = 32;
+		header[17] = 8; // alpha bits
+		return fwrite(header, sizeof(header), 1, mFile) == 1;
+	}
+
+	// copies a width x height block at (srcX, srcY) of an RGBA8 tile to (x, y) in the file
+	bool WriteTile(const Image& tile, int srcX, int srcY, int x, int y, int width, int height)
+	{
+		std::vector<uint8_t> row(width * 4);
+		for (int j = 0; j < height; j++)
+		{
+			const uint8_t *src = (const uint8_t *)tile.mBits + (size_t(srcY + j) * tile.mWidth + srcX) * 4;
+			for (int i = 0; i < width; i++)
+			{
+				row[i * 4 + 0] = src[i * 4 + 2];
+				row[i * 4 + 1] = src[i * 4 + 1];
+				row[i * 4 + 2] = src[i * 4 + 0];
+				row[i * 4 + 3] = src[i * 4 + 3];
+			}
+			int64_t offset = 18 + (int64_t(y + j) * mWidth + x) * 4;
+#ifdef _WIN32
+			if (_fseeki64(mFile, offset, SEEK_SET))
+#else
+			if (fseeko(mFile, off_t(offset), SEEK_SET))
+#endif
+				return false;
+			if (fwrite(row.data(), row.size(), 1, mFile) != 1)
+				return false;
+		}
+		return true;
+	}
+
+	FILE *mFile;
+	int mWidth;
+	int mHeight;
+};
+
+bool Evaluation::GetTileMargins(size_t target, const std::vector<size_t>& stages, int width, int height, int& marginX, int& marginY)
+{
+	// stages are in evaluation order. Each stage needs the margin of its inputs plus its own halo, and one more
+	// texel for bilinear filtering
+	std::vector<int> stageMarginX(mEvaluationStages.size(), 0);
+	std::vector<int> stageMarginY(mEvaluationStages.size(), 0);
+	for (auto index : stages)
+	{
+		const EvaluationStage& stage = mEvaluationStages[index];
+		const std::string& nodeName = gMetaNodes[stage.mNodeType].mName;
+		TileHaloFunction tileHalo = GetTileHalo(nodeName);
+		if (!tileHalo || stage.mEvaluationMask != EvaluationGLSL)
+		{
+			Log("%s can't be evaluated by tiles.\n", nodeName.c_str());
+			return false;
+		}
+		if (stage.mBlendingSrc != ONE || stage.mBlendingDst != ZERO)
+		{
+			Log("%s blends with its target, it can't be evaluated by tiles.\n", nodeName.c_str());
+			return false;
+		}
+
+		bool hasInput = false;
+		int inputMarginX = 0;
+		int inputMarginY = 0;
+		for (auto input : stage.mInput.mInputs)
+		{
+			if (input < 0)
+				continue;
+			hasInput = true;
+			inputMarginX = std::max(inputMarginX, stageMarginX[input]);
+			inputMarginY = std::max(inputMarginY, stageMarginY[input]);
+		}
+		if (!hasInput)
+			continue;
+		float halo = tileHalo(stage.mParameters, stage.mParametersSize);
+		stageMarginX[index] = inputMarginX + int(ceilf(halo * float(width))) + 1;
+		stageMarginY[index] = inputMarginY + int(ceilf(halo * float(height))) + 1;
+	}
+	marginX = stageMarginX[target];
+	marginY = stageMarginY[target];
+	return true;
+}
+
+int Evaluation::GetMaxTextureSize()
+{
+	return gEvaluation.mMaxTextureSize;
+}
+
+int Evaluation::EvaluateTiled(int target, int width, int height, const char *filename)
+{
+	if (target < 0 || target >= int(gEvaluation.mEvaluationStages.size()) || width <= 0 || height <= 0)
+		return EVAL_ERR;
+
+	std::vector<size_t> svgEvalList = gEvaluation.mEvaluationOrderList;
+	std::vector<size_t> usedNodes;
+	gEvaluation.RecurseGetUse(target, usedNodes);
+
+	int marginX, marginY;
+	if (!gEvaluation.GetTileMargins(target, usedNodes, width, height, marginX, marginY))
+		return EVAL_ERR;
+
+	// tile and its margins must fit in a texture
+	int tileSize = std::max(gEvaluation.mTileSize, 16);
+	if (gEvaluation.mBackend == BACKEND_GLSL)
+	{
+		tileSize = std::min(tileSize, gEvaluation.mMaxTextureSize - 2 * std::max(marginX, marginY));
+		if (tileSize < 16)
+		{
+			Log("Tile halos are bigger than a texture.\n");
+			return EVAL_ERR;
+		}
+	}
+	tileSize = std::min(tileSize, std::max(width, height));
+	const int tileWidth = std::min(tileSize, width) + 2 * marginX;
+	const int tileHeight = std::min(tileSize, height) + 2 * marginY;
+
+	TGATileWriter writer;
+	if (!writer.Open(filename, width, height))
+	{
+		Log("Unable to open %s for tiled writing.\n", filename);
+		return EVAL_ERR;
+	}
+
+	std::vector<uint8_t> dirtyStates = gEvaluation.GetDirtyStates();
+	gEvaluation.SetEvaluationOrder(usedNodes);
+	gEvaluation.SetEvaluationMemoryMode(1, tileWidth, tileHeight);
+	gEvaluation.mbTiling = true;
+
+	int res = EVAL_OK;
+	int tileCount = 0;
+	for (int y = 0; y < height && res == EVAL_OK; y += tileSize)
+	{
+		for (int x = 0; x < width && res == EVAL_OK; x += tileSize)
+		{
+			gEvaluation.mTileRect[0] = float(x - marginX) / float(width);
+			gEvaluation.mTileRect[1] = float(y - marginY) / float(height);
+			gEvaluation.mTileRect[2] = float(tileWidth) / float(width);
+			gEvaluation.mTileRect[3] = float(tileHeight) / float(height);
+			gEvaluation.RunEvaluation(tileWidth, tileHeight, true);
+
+			Image tile;
+			if (GetEvaluationImage(target, &tile) != EVAL_OK)
+			{
+				res = EVAL_ERR;
+				break;
+			}
+			// TGA keeps 8 bits per channel whatever the precision of the target
+			if (tile.mWidth != tileWidth || tile.mHeight != tileHeight || ConvertImage(&tile, TextureFormat::RGBA8) != EVAL_OK
+				|| !writer.WriteTile(tile, marginX, marginY, x, y, std::min(tileSize, width - x), std::min(tileSize, height - y)))
+				res = EVAL_ERR;
+			FreeImage(&tile);
+			tileCount++;
+		}
+	}
+
+	gEvaluation.mbTiling = false;
+	gEvaluation.mTileRect[0] = gEvaluation.mTileRect[1] = 0.f;
+	gEvaluation.mTileRect[2] = gEvaluation.mTileRect[3] = 1.f;
+	Log("Evaluate tiled %dx%d : %d tiles of %dx%d, peak memory %.1f MB\n", width, height, tileCount, tileWidth, tileHeight,
+		double(gEvaluation.mActualPeakBytes) / (1024.0 * 1024.0));
+	gEvaluation.SetEvaluationMemoryMode(0, tileWidth, tileHeight);
+	gEvaluation.SetEvaluationOrder(svgEvalList);
+	gEvaluation.SetDirtyStates(dirtyStates);
+	return res;
+}
@@ -0,0 +1,121 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include "FileWatcher.h"
+#include <sys/stat.h>
+#include <algorithm>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+static time_t GetModificationTime(const std::string& path)
+{
+	struct stat fileStat;
+	if (stat(path.c_str(), &fileStat) != 0)
+		return 0;
+	return fileStat.st_mtime;
+}
+
+FileWatcher::FileWatcher() : mNotify(-1), mLastPoll(0)
+{
+#ifdef __linux__
+	mNotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+}
+
+FileWatcher::~FileWatcher()
+{
+#ifdef __linux__
+	if (mNotify != -1)
+		close(mNotify);
+#endif
+}
+
+void FileWatcher::AddFile(const std::string& path)
+{
+	if (std::find(mFiles.begin(), mFiles.end(), path) != mFiles.end())
+		return;
+	mFiles.push_back(path);
+	mModificationTimes[path] = GetModificationTime(path);
+
+#ifdef __linux__
+	if (mNotify == -1)
+		return;
+	// directories are watched, editors often save by writing a new file and renaming it
+	size_t separator = path.find_last_of('/');
+	std::string directory = (separator == std::string::npos) ? std::string() : path.substr(0, separator + 1);
+	for (auto& watched : mWatchedDirectories)
+	{
+		if (watched.second == directory)
+			return;
+	}
+	int watch = inotify_add_watch(mNotify, directory.empty() ? "." : directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (watch != -1)
+		mWatchedDirectories[watch] = directory;
+#endif
+}
+
+void FileWatcher::GetChangedFiles(std::vector<std::string>& changedFiles)
+{
+	changedFiles.clear();
+#ifdef __linux__
+	if (mNotify != -1)
+	{
+		char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+		ssize_t length;
+		while ((length = read(mNotify, buffer, sizeof(buffer))) > 0)
+		{
+			for (char *ptr = buffer; ptr < buffer + length; ptr += sizeof(struct inotify_event) + ((struct inotify_event*)ptr)->len)
+			{
+				const struct inotify_event *event = (const struct inotify_event*)ptr;
+				auto iter = mWatchedDirectories.find(event->wd);
+				if (!event->len || iter == mWatchedDirectories.end())
+					continue;
+				std::string path = iter->second + event->name;
+				if (std::find(mFiles.begin(), mFiles.end(), path) != mFiles.end() && std::find(changedFiles.begin(), changedFiles.end(), path) == changedFiles.end())
+					changedFiles.push_back(path);
+			}
+		}
+		return;
+	}
+#endif
+	time_t now = time(NULL);
+	if (now == mLastPoll)
+		return;
+	mLastPoll = now;
+	for (auto& path : mFiles)
+	{
+		time_t modificationTime = GetModificationTime(path);
+		if (modificationTime == mModificationTimes[path])
+			continue;
+		mModificationTimes[path] = modificationTime;
+		// a file being replaced doesn't exist for a moment
+		if (modificationTime)
+			changedFiles.push_back(path);
+	}
+}
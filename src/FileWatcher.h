@@ -0,0 +1,52 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <time.h>
+
+// files written since the last GetChangedFiles. inotify on Linux, modification times are polled every second elsewhere
+struct FileWatcher
+{
+	FileWatcher();
+	~FileWatcher();
+
+	void AddFile(const std::string& path);
+	// paths as given to AddFile, each one once
+	void GetChangedFiles(std::vector<std::string>& changedFiles);
+
+protected:
+	std::vector<std::string> mFiles;
+	// inotify
+	int mNotify;
+	std::map<int, std::string> mWatchedDirectories;
+	// polling
+	std::map<std::string, time_t> mModificationTimes;
+	time_t mLastPoll;
+};
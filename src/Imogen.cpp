@@ -37,6 +37,7 @@
 #include "tinydir.h"
 #include "stb_image.h"
 #include "imgui_stdlib.h"
+#include "Trace.h"
 
 unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len);
 extern Evaluation gEvaluation;
@@ -216,7 +217,7 @@ void DebugLogText(const char *szText)
 	imguiLog.AddLog(szText);
 }
 
-void Imogen::HandleEditor(TextEditor &editor, TileNodeEditGraphDelegate &nodeGraphDelegate, Evaluation& evaluation)
+void Imogen::HandleEditor(TextEditor &editor, Evaluation& evaluation)
 {
 	static int currentShaderIndex = -1;
 
@@ -248,10 +249,7 @@ void Imogen::HandleEditor(TextEditor &editor, TileNodeEditGraphDelegate &nodeGra
 		std::ofstream t(mEvaluatorFiles[currentShaderIndex].mDirectory + mEvaluatorFiles[currentShaderIndex].mFilename, std::ofstream::out);
 		t << textToSave;
 		t.close();
-
-		// TODO
-		evaluation.SetEvaluators(mEvaluatorFiles);
-		nodeGraphDelegate.InvalidateParameters();
+		// the file watcher reloads it
 	}
 
 	ImGui::SameLine();
@@ -307,6 +305,15 @@ void RenderPreviewNode(int selNode, TileNodeEditGraphDelegate& nodeGraphDelegate
 	ImGui::PopStyleColor(3);
 	ImGui::PopStyleVar(1);
 
+	// progressive preview level
+	int resolutionShift = (selNode != -1) ? evaluation.GetStageResolutionShift(selNode) : 0;
+	if (resolutionShift)
+	{
+		char resolutionText[32];
+		sprintf(resolutionText, "1/%d resolution", 1 << resolutionShift);
+		ImGui::GetWindowDrawList()->AddText(rc.Min + ImVec2(4, 4), IM_COL32(255, 255, 255, 255), resolutionText);
+	}
+
 	if (rc.Contains(io.MousePos))
 	{
 		ImVec2 ratio((io.MousePos.x - rc.Min.x) / rc.GetSize().x, (io.MousePos.y - rc.Min.y) / rc.GetSize().y);
@@ -335,6 +342,90 @@ void NodeEdit(TileNodeEditGraphDelegate& nodeGraphDelegate, Evaluation& evaluati
 		nodeGraphDelegate.EditNode();
 }
 
+struct NodeTiming
+{
+	size_t mIndex;
+	float mTimes[4]; // GPU, CPU, jobs, total
+};
+
+void NodeProfiler(TileNodeEditGraphDelegate& nodeGraphDelegate, Evaluation& evaluation)
+{
+	bool recording = TraceIsRecording();
+	if (ImGui::Checkbox("Record trace", &recording))
+	{
+		if (recording)
+			TraceStart();
+		else
+			TraceStop();
+	}
+	ImGui::SameLine();
+	if (ImGui::Button("Save trace"))
+		TraceSave("imogen_trace.json");
+
+	ImGui::Text("Result cache: %d/%d MB, %d hits, %d misses", int(evaluation.GetResultCacheBytes() >> 20), int(evaluation.GetResultCacheBudget() >> 20)
+		, int(evaluation.GetResultCacheHits()), int(evaluation.GetResultCacheMisses()));
+
+	bool profiling = evaluation.IsProfiling();
+	if (ImGui::Checkbox("Profile nodes", &profiling))
+		evaluation.SetProfiling(profiling);
+	if (!profiling)
+		return;
+	ImGui::SameLine();
+	if (ImGui::Button("Evaluate all"))
+	{
+		for (size_t i = 0; i < nodeGraphDelegate.mNodes.size(); i++)
+			evaluation.SetTargetDirty(i);
+	}
+
+	std::vector<NodeTiming> timings(nodeGraphDelegate.mNodes.size());
+	for (size_t i = 0; i < timings.size(); i++)
+	{
+		NodeTiming& timing = timings[i];
+		timing.mIndex = i;
+		timing.mTimes[0] = evaluation.GetStageGPUTime(i);
+		timing.mTimes[1] = evaluation.GetStageCPUTime(i);
+		timing.mTimes[2] = evaluation.GetStageJobTime(i);
+		timing.mTimes[3] = timing.mTimes[0] + timing.mTimes[1] + timing.mTimes[2];
+	}
+
+	// click on a column name to sort, again to reverse
+	static int sortColumn = 4;
+	static bool sortDescending = true;
+	static const char *columnNames[] = { "Node", "GPU ms", "CPU ms", "Jobs ms", "Total ms" };
+	ImGui::Columns(5, "profilerColumns");
+	for (int i = 0; i < 5; i++)
+	{
+		if (ImGui::Selectable(columnNames[i], sortColumn == i))
+		{
+			sortDescending = (sortColumn == i) ? !sortDescending : (i != 0);
+			sortColumn = i;
+		}
+		ImGui::NextColumn();
+	}
+	ImGui::Separator();
+
+	auto lessThan = [&](const NodeTiming& a, const NodeTiming& b) {
+		if (sortColumn == 0)
+			return gMetaNodes[nodeGraphDelegate.mNodes[a.mIndex].mType].mName < gMetaNodes[nodeGraphDelegate.mNodes[b.mIndex].mType].mName;
+		return a.mTimes[sortColumn - 1] < b.mTimes[sortColumn - 1];
+	};
+	std::sort(timings.begin(), timings.end(), [&](const NodeTiming& a, const NodeTiming& b) {
+		return sortDescending ? lessThan(b, a) : lessThan(a, b);
+	});
+
+	for (auto& timing : timings)
+	{
+		ImGui::Text("%s (%d)", gMetaNodes[nodeGraphDelegate.mNodes[timing.mIndex].mType].mName.c_str(), int(timing.mIndex));
+		ImGui::NextColumn();
+		for (int i = 0; i < 4; i++)
+		{
+			ImGui::Text("%.3f", timing.mTimes[i]);
+			ImGui::NextColumn();
+		}
+	}
+	ImGui::Columns(1);
+}
+
 template <typename T, typename Ty> struct SortedResource
 {
 	SortedResource() {}
@@ -393,6 +484,7 @@ struct PinnedTaskUploadImage : enki::IPinnedTask
 
 	virtual void Execute()
 	{
+		TRACE_SCOPE("UploadImage", "upload");
 		unsigned int textureId = Evaluation::UploadImage(&mImage, 0);
 		if (mbIsThumbnail)
 		{
@@ -405,11 +497,15 @@ struct PinnedTaskUploadImage : enki::IPinnedTask
 			TileNodeEditGraphDelegate::ImogenNode *node = TileNodeEditGraphDelegate::GetInstance()->Get(mIdentifier);
 			if (node)
 			{
-				Evaluation::SetEvaluationImage(int(node->mEvaluationTarget), &mImage);
+				// the upload owns the bits
+				Evaluation::SetEvaluationImageAsync(int(node->mEvaluationTarget), &mImage);
 				gEvaluation.SetEvaluationParameters(node->mEvaluationTarget, node->mParameters, node->mParametersSize);
 				gEvaluation.StageSetProcessing(node->mEvaluationTarget, false);
 			}
-			Evaluation::FreeImage(&mImage);
+			else
+			{
+				Evaluation::FreeImage(&mImage);
+			}
 		}
 	}
 	Image mImage;
@@ -444,35 +540,32 @@ struct DecodeThumbnailTaskSet : enki::ITaskSet
 	std::vector<uint8_t> *mSrc;
 };
 
-struct EncodeImageTaskSet : enki::ITaskSet
+struct EncodeNodeImageData
 {
-	EncodeImageTaskSet(Image image, ASyncId materialIdentifier, ASyncId nodeIdentifier) : enki::ITaskSet(), mMaterialIdentifier(materialIdentifier), mNodeIdentifier(nodeIdentifier), mImage(image)
-	{
-	}
-	virtual void    ExecuteRange(enki::TaskSetPartition range, uint32_t threadnum)
+	ASyncId mMaterialIdentifier;
+	ASyncId mNodeIdentifier;
+};
+
+// readback job: node image is stored as png in the library
+static int EncodeNodeImage(Image *image, void *ptr)
+{
+	EncodeNodeImageData *data = (EncodeNodeImageData*)ptr;
+	if (!image->mBits)
+		return EVAL_ERR;
+	std::vector<unsigned char> pngImage;
+	if (Evaluation::EncodePng(image, pngImage) == EVAL_OK)
 	{
-		int outlen;
-		int components = 4;
-		unsigned char *bits = stbi_write_png_to_mem((unsigned char*)mImage.mBits, mImage.mWidth * components, mImage.mWidth, mImage.mHeight, components, &outlen);
-		if (bits)
+		Material *material = library.Get(data->mMaterialIdentifier);
+		if (material)
 		{
-			Material *material = library.Get(mMaterialIdentifier);
-			if (material)
-			{
-				MaterialNode *node = material->Get(mNodeIdentifier);
-				if (node)
-				{
-					node->mImage.resize(outlen);
-					memcpy(node->mImage.data(), bits, outlen);
-				}
-			}
+			MaterialNode *node = material->Get(data->mNodeIdentifier);
+			if (node)
+				node->mImage = pngImage;
 		}
-		delete this;
 	}
-	ASyncId mMaterialIdentifier;
-	ASyncId mNodeIdentifier;
-	Image mImage;
-};
+	Evaluation::FreeImage(image);
+	return EVAL_OK;
+}
 
 struct DecodeImageTaskSet : enki::ITaskSet
 {
@@ -622,11 +715,10 @@ void ValidateMaterial(Library& library, TileNodeEditGraphDelegate &nodeGraphDele
 		dstNode.mRuntimeUniqueId = GetRuntimeId();
 		if (metaNode.mbSaveTexture)
 		{
-			Image image;
-			if (Evaluation::GetEvaluationImage(int(i), &image) == EVAL_OK)
-			{
-				g_TS.AddTaskSetToPipe(new EncodeImageTaskSet(image, std::make_pair(materialIndex, material.mRuntimeUniqueId), std::make_pair(i, dstNode.mRuntimeUniqueId)));
-			}
+			EncodeNodeImageData data;
+			data.mMaterialIdentifier = std::make_pair(materialIndex, material.mRuntimeUniqueId);
+			data.mNodeIdentifier = std::make_pair(i, dstNode.mRuntimeUniqueId);
+			Evaluation::GetEvaluationImageAsync(int(i), EncodeNodeImage, &data, sizeof(EncodeNodeImageData));
 		}
 
 		dstNode.mType = uint32_t(srcNode.mType);
@@ -635,6 +727,7 @@ void ValidateMaterial(Library& library, TileNodeEditGraphDelegate &nodeGraphDele
 		if (srcNode.mParametersSize)
 			memcpy(&dstNode.mParameters[0], srcNode.mParameters, srcNode.mParametersSize);
 		dstNode.mInputSamplers = srcNode.mInputSamplers;
+		dstNode.mPrecision = srcNode.mPrecision;
 		ImVec2 nodePos = NodeGraphGetNodePos(i);
 		dstNode.mPosX = int32_t(nodePos.x);
 		dstNode.mPosY = int32_t(nodePos.y);
@@ -679,6 +772,9 @@ void UpdateNewlySelectedGraph(TileNodeEditGraphDelegate &nodeGraphDelegate, Eval
 		{
 			MaterialNode& node = material.mMaterialNodes[i];
 			NodeGraphAddNode(&nodeGraphDelegate, node.mType, node.mParameters.data(), node.mPosX, node.mPosY);
+			TileNodeEditGraphDelegate::ImogenNode& addedNode = nodeGraphDelegate.mNodes.back();
+			addedNode.mPrecision = int(node.mPrecision);
+			evaluation.SetEvaluationPrecision(addedNode.mEvaluationTarget, addedNode.mPrecision);
 			if (!node.mImage.empty())
 			{
 				TileNodeEditGraphDelegate::ImogenNode& lastNode = nodeGraphDelegate.mNodes.back();
@@ -772,6 +868,8 @@ void LibraryEdit(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate,
 
 void Imogen::Show(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate, Evaluation& evaluation)
 {
+	ReloadChangedEvaluators(evaluation);
+
 	ImGuiIO& io = ImGui::GetIO();
 	ImGui::SetNextWindowPos(ImVec2(0, 0));
 	ImGui::SetNextWindowSize(io.DisplaySize);
@@ -781,6 +879,8 @@ void Imogen::Show(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate
 		ImGuiID dockspace_id = ImGui::GetID("MyDockspace");
 		ImGui::DockSpace(dockspace_id, ImVec2(0.0f, 0.0f), opt_flags);
 
+		// filled again by NodeGraph when the window is shown
+		nodeGraphDelegate.mVisibleNodes.clear();
 		if (ImGui::Begin("Nodes"))
 		{
 			if (selectedMaterial != -1)
@@ -831,7 +931,7 @@ void Imogen::Show(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate
 
 		if (ImGui::Begin("Shaders"))
 		{
-			HandleEditor(editor, nodeGraphDelegate, evaluation);
+			HandleEditor(editor, evaluation);
 		}
 		ImGui::End();
 
@@ -854,6 +954,12 @@ void Imogen::Show(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate
 		}
 		ImGui::End();
 
+		if (ImGui::Begin("Profiler"))
+		{
+			NodeProfiler(nodeGraphDelegate, evaluation);
+		}
+		ImGui::End();
+
 		// view extraction
 		int index = 0;
 		int removeExtractedView = -1;
@@ -882,6 +988,30 @@ void Imogen::Show(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate
 		if (removeExtractedView != -1)
 			mExtratedViews.erase(mExtratedViews.begin() + removeExtractedView);
 
+		// what is displayed is evaluated first, then the visible thumbnails and the exports
+		std::vector<size_t> priorityTargets;
+		if (nodeGraphDelegate.mSelectedNodeIndex != -1)
+			priorityTargets.push_back(nodeGraphDelegate.mNodes[nodeGraphDelegate.mSelectedNodeIndex].mEvaluationTarget);
+		for (auto& extraction : mExtratedViews)
+			priorityTargets.push_back(nodeGraphDelegate.mNodes[extraction.mNodeIndex].mEvaluationTarget);
+		evaluation.SetPriorityTargets(priorityTargets);
+
+		std::vector<size_t> sinkTargets = priorityTargets;
+		for (auto nodeIndex : nodeGraphDelegate.mVisibleNodes)
+			sinkTargets.push_back(nodeGraphDelegate.mNodes[nodeIndex].mEvaluationTarget);
+		for (auto& node : nodeGraphDelegate.mNodes)
+		{
+			for (auto& param : gMetaNodes[node.mType].mParams)
+			{
+				if (param.mType == Con_ForceEvaluate)
+				{
+					sinkTargets.push_back(node.mEvaluationTarget);
+					break;
+				}
+			}
+		}
+		evaluation.SetSinkTargets(sinkTargets);
+
 		ImGui::End();
 		// --
 	}
@@ -928,6 +1058,27 @@ void Imogen::Init()
 	ImGui::GetIO().ConfigFlags |= ImGuiConfigFlags_DockingEnable;
 	editor.SetLanguageDefinition(TextEditor::LanguageDefinition::GLSL());
 
+	DiscoverEvaluatorFiles();
+	for (auto& file : mEvaluatorFiles)
+		mEvaluatorWatcher.AddFile(file.mDirectory + file.mFilename);
+}
+
+void Imogen::ReloadChangedEvaluators(Evaluation& evaluation)
+{
+	std::vector<std::string> changedFiles;
+	mEvaluatorWatcher.GetChangedFiles(changedFiles);
+	for (auto& path : changedFiles)
+	{
+		for (auto& file : mEvaluatorFiles)
+		{
+			if (file.mDirectory + file.mFilename == path)
+				evaluation.ReloadEvaluator(file);
+		}
+	}
+}
+
+void Imogen::DiscoverEvaluatorFiles()
+{
 	DiscoverNodes("glsl", "GLSL/", EVALUATOR_GLSL, mEvaluatorFiles);
 	DiscoverNodes("c", "C/", EVALUATOR_C, mEvaluatorFiles);
 }
@@ -29,6 +29,7 @@
 #include <string>
 #include "imgui.h"
 #include "imgui_internal.h"
+#include "FileWatcher.h"
 
 struct TileNodeEditGraphDelegate;
 struct Evaluation;
@@ -59,12 +60,17 @@ struct Imogen
 	void Show(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate, Evaluation& evaluation);
 	void ValidateCurrentMaterial(Library& library, TileNodeEditGraphDelegate &nodeGraphDelegate);
 	void DiscoverNodes(const char *extension, const char *directory, EVALUATOR_TYPE evaluatorType, std::vector<EvaluatorFile>& files);
+	void DiscoverEvaluatorFiles();
 
 	std::vector<EvaluatorFile> mEvaluatorFiles;
 	int GetCurrentMaterialIndex();
 
 protected:
-	void HandleEditor(TextEditor &editor, TileNodeEditGraphDelegate &nodeGraphDelegate, Evaluation& evaluation);
+	// evaluators saved by the editor or any other program are reloaded one by one
+	FileWatcher mEvaluatorWatcher;
+	void ReloadChangedEvaluators(Evaluation& evaluation);
+
+	void HandleEditor(TextEditor &editor, Evaluation& evaluation);
 };
 
 void DebugLogText(const char *szText);
@@ -25,6 +25,7 @@
 
 #include "Library.h"
 #include "imgui.h"
+#include "Trace.h"
 
 enum : uint32_t
 {
@@ -34,6 +35,7 @@ enum : uint32_t
 	v_nodeImage,
 	v_rugs,
 	v_nodeTypeName,
+	v_nodePrecision,
 	v_lastVersion
 };
 #define ADD(_fieldAdded, _fieldName) if (dataVersion >= _fieldAdded){ Ser(_fieldName); }
@@ -121,6 +123,7 @@ template<bool doWrite> struct Serialize
 		ADD(v_initial, materialNode->mInputSamplers);
 		ADD(v_initial, materialNode->mParameters);
 		ADD(v_nodeImage, materialNode->mImage);
+		ADD(v_nodePrecision, materialNode->mPrecision);
 	}
 	void Ser(MaterialNodeRug *materialNodeRug)
 	{
@@ -168,6 +171,7 @@ typedef Serialize<false> SerializeRead;
 
 void LoadLib(Library *library, const char *szFilename)
 {
+	TRACE_SCOPE("LoadLib", "io");
 	SerializeRead loadSer(szFilename);
 	loadSer.Ser(library);
 
@@ -188,6 +192,7 @@ void LoadLib(Library *library, const char *szFilename)
 
 void SaveLib(Library *library, const char *szFilename)
 {
+	TRACE_SCOPE("SaveLib", "io");
 	SerializeWrite(szFilename).Ser(library);
 }
 
@@ -457,8 +462,8 @@ void LoadMetaNodes()
 		,{}
 		,{ { "File name", Con_FilenameWrite },{ "Format", Con_Enum, 0.f,0.f,0.f,0.f, false, false, "JPEG\0PNG\0TGA\0BMP\0HDR\0DDS\0KTX\0" }
 		,{ "Quality", Con_Enum, 0.f,0.f,0.f,0.f, false, false, " 0 .. Best\0 1\0 2\0 3\0 4\0 5 .. Medium\0 6\0 7\0 8\0 9 .. Lowest\0" }
-		,{ "Width", Con_Enum, 0.f,0.f,0.f,0.f, false, false, "  256\0  512\0 1024\0 2048\0 4096\0" }
-		,{ "Height", Con_Enum, 0.f,0.f,0.f,0.f, false, false, "  256\0  512\0 1024\0 2048\0 4096\0" }
+		,{ "Width", Con_Enum, 0.f,0.f,0.f,0.f, false, false, "  256\0  512\0 1024\0 2048\0 4096\0 8192\0" "16384\0" "32768\0" }
+		,{ "Height", Con_Enum, 0.f,0.f,0.f,0.f, false, false, "  256\0  512\0 1024\0 2048\0 4096\0 8192\0" "16384\0" "32768\0" }
 		,{ "Export", Con_ForceEvaluate } }
 		}
 
@@ -73,6 +73,8 @@ struct MaterialNode
 	int32_t mPosY;
 	std::vector<InputSampler> mInputSamplers;
 	std::vector<uint8_t> mParameters;
+	// EvaluationPrecision of the node target, 0 is 8 bits
+	uint32_t mPrecision;
 	std::vector<uint8_t> mImage;
 
 	// runtime
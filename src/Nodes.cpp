@@ -325,6 +325,7 @@ void NodeGraph(NodeGraphDelegate *delegate, bool enabled)
 	static bool show_grid = true;
 
 	int node_selected = delegate->mSelectedNodeIndex;
+	delegate->mVisibleNodes.clear();
 
 	int node_hovered_in_list = -1;
 	int node_hovered_in_scene = -1;
@@ -430,6 +431,7 @@ void NodeGraph(NodeGraphDelegate *delegate, bool enabled)
 		if ((p1.y < 0.f && p2.y < 0.f) || (p1.y > regionRect.Max.y && p2.y > regionRect.Max.y) ||
 			(p1.x < 0.f && p2.x < 0.f) || (p1.x > regionRect.Max.x && p2.x > regionRect.Max.x))
 			continue;
+		delegate->mVisibleNodes.push_back(node_idx);
 
 		ImGui::PushID(node_idx);
 
@@ -449,6 +451,13 @@ void NodeGraph(NodeGraphDelegate *delegate, bool enabled)
 
 		draw_list->AddRectFilled(node_rect_min, ImVec2(node_rect_max.x, node_rect_min.y + 20), metaNodes[node->mType].mHeaderColor, 2.0f);
 		draw_list->AddText(node_rect_min+ImVec2(2,2), IM_COL32(0, 0, 0, 255), metaNodes[node->mType].mName.c_str());
+		float nodeTime = delegate->NodeTime(node_idx);
+		if (nodeTime >= 0.f)
+		{
+			char nodeTimeText[32];
+			sprintf(nodeTimeText, "%.2f ms", nodeTime);
+			draw_list->AddText(ImVec2(node_rect_min.x + 2, node_rect_max.y + 2), IM_COL32(200, 200, 200, 255), nodeTimeText);
+		}
 
 		// Display node box
 		draw_list->ChannelsSetCurrent(1); // Background
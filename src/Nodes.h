@@ -35,6 +35,8 @@ struct NodeGraphDelegate
 	int mBakeTargetIndex;
 	int mCategoriesCount;
 	const char ** mCategories;
+	// nodes drawn by the last NodeGraph call
+	std::vector<size_t> mVisibleNodes;
 
 	virtual void UpdateEvaluationList(const std::vector<size_t> nodeOrderList) = 0;
 	virtual void AddLink(int InputIdx, int InputSlot, int OutputIdx, int OutputSlot) = 0;
@@ -52,6 +54,8 @@ struct NodeGraphDelegate
 	virtual bool NodeHasUI(size_t nodeIndex) = 0;
 	virtual bool NodeIsProcesing(size_t nodeIndex) = 0;
 	virtual bool NodeIsCubemap(size_t nodeIndex) = 0;
+	// ms spent by the last evaluation of the node, negative when profiling is off
+	virtual float NodeTime(size_t nodeIndex) = 0;
 };
 
 struct Node
@@ -60,6 +60,7 @@ struct TileNodeEditGraphDelegate : public NodeGraphDelegate
 		size_t mParametersSize;
 		unsigned int mRuntimeUniqueId;
 		std::vector<InputSampler> mInputSamplers;
+		int mPrecision;
 	};
 
 	std::vector<ImogenNode> mNodes;
@@ -106,6 +107,7 @@ struct TileNodeEditGraphDelegate : public NodeGraphDelegate
 		memset(node.mParameters, 0, paramsSize);
 		size_t inputCount = gMetaNodes[type].mInputs.size();
 		node.mInputSamplers.resize(inputCount);
+		node.mPrecision = PRECISION_8;
 		mNodes.push_back(node);
 
 		mEvaluation.SetEvaluationParameters(node.mEvaluationTarget, node.mParameters, node.mParametersSize);
@@ -148,6 +150,27 @@ struct TileNodeEditGraphDelegate : public NodeGraphDelegate
 		ImogenNode& node = mNodes[index];
 		const MetaNode& currentMeta = metaNodes[node.mType];
 		
+		if (ImGui::CollapsingHeader("Output", 0))
+		{
+			static const char *precisions[] = { "8 bits", "16 bits float", "32 bits float" };
+			ImGui::PushItemWidth(150);
+			if (ImGui::Combo("Precision", &node.mPrecision, precisions, PRECISION_COUNT))
+			{
+				mEvaluation.SetEvaluationPrecision(node.mEvaluationTarget, node.mPrecision);
+			}
+			ImGui::PopItemWidth();
+			// memory of the target for each precision. Readback and upload move as many bytes
+			const RenderTarget *renderTarget = mEvaluation.GetRenderTarget(node.mEvaluationTarget);
+			if (renderTarget && renderTarget->mImage.mWidth)
+			{
+				const Image_t& image = renderTarget->mImage;
+				for (int precision = 0; precision < PRECISION_COUNT; precision++)
+				{
+					double bytes = double(image.mWidth) * image.mHeight * image.mNumFaces * GetTexelSize(GetPrecisionFormat(precision));
+					ImGui::Text("%s : %.1f MB at %dx%d", precisions[precision], bytes / (1024.0 * 1024.0), image.mWidth, image.mHeight);
+				}
+			}
+		}
 		if (ImGui::CollapsingHeader("Samplers", 0))
 		{
 			for (size_t i = 0; i < node.mInputSamplers.size();i++)
@@ -296,7 +319,12 @@ struct TileNodeEditGraphDelegate : public NodeGraphDelegate
 		}
 		
 		if (dirty)
+		{
+			// value is being dragged, progressive preview
+			if (ImGui::IsAnyItemActive())
+				mEvaluation.MarkInteractiveEdit();
 			mEvaluation.SetEvaluationParameters(node.mEvaluationTarget, node.mParameters, node.mParametersSize);
+		}
 		if (forceEval)
 		{
 			EvaluationInfo evaluationInfo;
@@ -429,6 +457,12 @@ struct TileNodeEditGraphDelegate : public NodeGraphDelegate
 	{
 		return mEvaluation.StageIsProcessing(nodeIndex);
 	}
+	virtual float NodeTime(size_t nodeIndex)
+	{
+		if (!mEvaluation.IsProfiling())
+			return -1.f;
+		return mEvaluation.GetStageGPUTime(nodeIndex) + mEvaluation.GetStageCPUTime(nodeIndex) + mEvaluation.GetStageJobTime(nodeIndex);
+	}
 	virtual bool NodeIsCubemap(size_t nodeIndex)
 	{
 		RenderTarget *target = mEvaluation.GetRenderTarget(nodeIndex);
@@ -0,0 +1,256 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <GL/gl3w.h>
+#include "ProgramCache.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <map>
+
+extern int Log(const char *szFormat, ...);
+
+struct ProgramCacheHeader
+{
+	uint32_t mMagic;
+	uint32_t mSession;
+	uint64_t mDriverHash;
+	uint32_t mEntryCount;
+	uint32_t mPadding;
+};
+
+struct ProgramCacheEntryHeader
+{
+	uint64_t mHash;
+	uint32_t mLastSession;
+	uint32_t mFormat;
+	uint32_t mSize;
+	uint32_t mPadding;
+};
+
+struct ProgramCacheEntry
+{
+	uint32_t mLastSession;
+	uint32_t mFormat;
+	std::vector<uint8_t> mBinary;
+};
+
+static const uint32_t ProgramCacheMagic = 0x31504D49; // IMP1
+// entries not used by that many sessions are not written back. Keeps edited shaders from piling up
+static const uint32_t ProgramCacheSessions = 16;
+
+static std::string gProgramCacheFilename;
+static std::map<uint64_t, ProgramCacheEntry> gProgramCacheEntries;
+static uint64_t gProgramCacheDriverHash = 0;
+static uint32_t gProgramCacheSession = 0;
+static bool gbProgramCacheDirty = false;
+static int gProgramCacheHits = 0;
+
+static uint64_t HashBytes(uint64_t hash, const void *data, size_t size)
+{
+	// FNV-1a
+	const uint8_t *bytes = (const uint8_t*)data;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+static const uint64_t HashSeed = 0xCBF29CE484222325ULL;
+
+bool ProgramCacheOpen(const char *filename)
+{
+	gProgramCacheEntries.clear();
+	gProgramCacheFilename.clear();
+	gbProgramCacheDirty = false;
+	gProgramCacheHits = 0;
+
+	// no binary format, nothing to cache
+	GLint formatCount = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+	if (formatCount <= 0)
+		return false;
+
+	gProgramCacheDriverHash = HashSeed;
+	const GLenum driverStrings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+	for (auto name : driverStrings)
+	{
+		const char *str = (const char*)glGetString(name);
+		if (str)
+			gProgramCacheDriverHash = HashBytes(gProgramCacheDriverHash, str, strlen(str) + 1);
+	}
+	gProgramCacheFilename = filename;
+	gProgramCacheSession = 1;
+
+	FILE *fp = fopen(filename, "rb");
+	if (!fp)
+		return true;
+	ProgramCacheHeader header;
+	if (fread(&header, sizeof(ProgramCacheHeader), 1, fp) == 1 && header.mMagic == ProgramCacheMagic && header.mDriverHash == gProgramCacheDriverHash)
+	{
+		gProgramCacheSession = header.mSession + 1;
+		for (uint32_t i = 0; i < header.mEntryCount; i++)
+		{
+			ProgramCacheEntryHeader entryHeader;
+			if (fread(&entryHeader, sizeof(ProgramCacheEntryHeader), 1, fp) != 1)
+				break;
+			ProgramCacheEntry& entry = gProgramCacheEntries[entryHeader.mHash];
+			entry.mLastSession = entryHeader.mLastSession;
+			entry.mFormat = entryHeader.mFormat;
+			entry.mBinary.resize(entryHeader.mSize);
+			if (!entryHeader.mSize || fread(entry.mBinary.data(), entryHeader.mSize, 1, fp) != 1)
+			{
+				// truncated file, the entries read so far are good
+				gProgramCacheEntries.erase(entryHeader.mHash);
+				gbProgramCacheDirty = true;
+				break;
+			}
+		}
+	}
+	else
+	{
+		// other driver or other file format, it's written again when closing
+		gbProgramCacheDirty = true;
+	}
+	fclose(fp);
+	return true;
+}
+
+void ProgramCacheClose()
+{
+	if (gProgramCacheFilename.empty())
+		return;
+	for (auto iter = gProgramCacheEntries.begin(); iter != gProgramCacheEntries.end();)
+	{
+		if (gProgramCacheSession - iter->second.mLastSession >= ProgramCacheSessions)
+		{
+			iter = gProgramCacheEntries.erase(iter);
+			gbProgramCacheDirty = true;
+		}
+		else
+			++iter;
+	}
+	if (gbProgramCacheDirty)
+	{
+		FILE *fp = fopen(gProgramCacheFilename.c_str(), "wb");
+		if (fp)
+		{
+			ProgramCacheHeader header;
+			header.mMagic = ProgramCacheMagic;
+			header.mSession = gProgramCacheSession;
+			header.mDriverHash = gProgramCacheDriverHash;
+			header.mEntryCount = uint32_t(gProgramCacheEntries.size());
+			header.mPadding = 0;
+			fwrite(&header, sizeof(ProgramCacheHeader), 1, fp);
+			for (auto& entry : gProgramCacheEntries)
+			{
+				ProgramCacheEntryHeader entryHeader;
+				entryHeader.mHash = entry.first;
+				entryHeader.mLastSession = entry.second.mLastSession;
+				entryHeader.mFormat = entry.second.mFormat;
+				entryHeader.mSize = uint32_t(entry.second.mBinary.size());
+				entryHeader.mPadding = 0;
+				fwrite(&entryHeader, sizeof(ProgramCacheEntryHeader), 1, fp);
+				fwrite(entry.second.mBinary.data(), entry.second.mBinary.size(), 1, fp);
+			}
+			fclose(fp);
+		}
+		else
+		{
+			Log("Unable to write program cache %s.\n", gProgramCacheFilename.c_str());
+		}
+	}
+	gProgramCacheEntries.clear();
+	gProgramCacheFilename.clear();
+	gbProgramCacheDirty = false;
+}
+
+uint64_t ProgramCacheHash(const std::string& source, bool layered)
+{
+	uint64_t hash = HashBytes(HashSeed, source.c_str(), source.size());
+	return HashBytes(hash, &layered, sizeof(layered));
+}
+
+unsigned int ProgramCacheLoad(uint64_t hash)
+{
+	if (gProgramCacheFilename.empty())
+		return 0;
+	auto iter = gProgramCacheEntries.find(hash);
+	if (iter == gProgramCacheEntries.end())
+		return 0;
+
+	ProgramCacheEntry& entry = iter->second;
+	unsigned int program = glCreateProgram();
+	glProgramBinary(program, entry.mFormat, entry.mBinary.data(), GLsizei(entry.mBinary.size()));
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (!linked)
+	{
+		// the driver can refuse its own binaries, after an update for instance. Sources are compiled instead
+		glDeleteProgram(program);
+		gProgramCacheEntries.erase(iter);
+		gbProgramCacheDirty = true;
+		return 0;
+	}
+	if (entry.mLastSession != gProgramCacheSession)
+	{
+		entry.mLastSession = gProgramCacheSession;
+		gbProgramCacheDirty = true;
+	}
+	gProgramCacheHits++;
+	return program;
+}
+
+void ProgramCacheStore(uint64_t hash, unsigned int program)
+{
+	if (gProgramCacheFilename.empty())
+		return;
+	GLint size = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+	if (size <= 0)
+		return;
+	ProgramCacheEntry& entry = gProgramCacheEntries[hash];
+	entry.mLastSession = gProgramCacheSession;
+	entry.mBinary.resize(size);
+	GLenum format = 0;
+	GLsizei length = 0;
+	glGetProgramBinary(program, size, &length, &format, entry.mBinary.data());
+	if (length <= 0)
+	{
+		gProgramCacheEntries.erase(hash);
+		return;
+	}
+	entry.mBinary.resize(length);
+	entry.mFormat = format;
+	gbProgramCacheDirty = true;
+}
+
+int ProgramCacheGetHits()
+{
+	return gProgramCacheHits;
+}
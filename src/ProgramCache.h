@@ -0,0 +1,44 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+// GL program binaries kept in one file between sessions. Entries are found by a hash of the program sources,
+// the whole file is dropped when the GL vendor, renderer or version changes. Entries not used by the last
+// sessions are not written back. Needs the GL context.
+bool ProgramCacheOpen(const char *filename);
+// writes the file when entries were added or dropped
+void ProgramCacheClose();
+uint64_t ProgramCacheHash(const std::string& source, bool layered);
+// linked program, 0 when the entry is missing or rejected by the driver. A rejected entry is dropped
+unsigned int ProgramCacheLoad(uint64_t hash);
+// program must be linked with GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+void ProgramCacheStore(uint64_t hash, unsigned int program);
+// programs loaded from the cache since it was opened
+int ProgramCacheGetHits();
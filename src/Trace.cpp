@@ -0,0 +1,168 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include "Trace.h"
+#include <SDL.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <mutex>
+
+extern int Log(const char *szFormat, ...);
+
+std::atomic<bool> gTraceRecording(false);
+
+struct TraceEvent
+{
+	char mName[48];
+	const char *mCategory; // literals only
+	int mTarget;
+	int mThread;
+	uint64_t mStart;
+	uint64_t mEnd;
+};
+
+static const size_t TraceRingSize = 1 << 16;
+static std::vector<TraceEvent> gTraceEvents;
+static size_t gTraceEventCount = 0; // total recorded, ring index is count % TraceRingSize
+static std::mutex gTraceMutex;
+static uint64_t gTraceOrigin = 0;
+static std::atomic<int> gTraceThreadCount(0);
+static int gTraceMainThread = -1;
+
+// small sequential ids read better than native thread ids in the viewer
+static int TraceGetThread()
+{
+	static thread_local int thread = gTraceThreadCount++;
+	return thread;
+}
+
+uint64_t TraceGetTicks()
+{
+	return SDL_GetPerformanceCounter();
+}
+
+void TraceStart()
+{
+	std::lock_guard<std::mutex> lock(gTraceMutex);
+	if (gTraceEvents.empty())
+		gTraceEvents.resize(TraceRingSize);
+	gTraceEventCount = 0;
+	gTraceOrigin = SDL_GetPerformanceCounter();
+	gTraceMainThread = TraceGetThread();
+	gTraceRecording = true;
+}
+
+void TraceStop()
+{
+	gTraceRecording = false;
+}
+
+bool TraceIsRecording()
+{
+	return gTraceRecording;
+}
+
+void TraceRecord(const char *name, const char *category, int target, uint64_t startTicks)
+{
+	uint64_t endTicks = SDL_GetPerformanceCounter();
+	int thread = TraceGetThread();
+	std::lock_guard<std::mutex> lock(gTraceMutex);
+	// scope started before a TraceStart
+	if (gTraceEvents.empty() || startTicks < gTraceOrigin)
+		return;
+	TraceEvent& event = gTraceEvents[gTraceEventCount % TraceRingSize];
+	strncpy(event.mName, name ? name : "", sizeof(event.mName) - 1);
+	event.mName[sizeof(event.mName) - 1] = 0;
+	event.mCategory = category;
+	event.mTarget = target;
+	event.mThread = thread;
+	event.mStart = startTicks;
+	event.mEnd = endTicks;
+	gTraceEventCount++;
+}
+
+static void WriteJSONString(FILE *fp, const char *str)
+{
+	fputc('"', fp);
+	for (; *str; str++)
+	{
+		if (*str == '"' || *str == '\\')
+			fputc('\\', fp);
+		if (*str >= ' ')
+			fputc(*str, fp);
+	}
+	fputc('"', fp);
+}
+
+bool TraceSave(const char *filename)
+{
+	std::vector<TraceEvent> events;
+	uint64_t origin;
+	int mainThread;
+	{
+		std::lock_guard<std::mutex> lock(gTraceMutex);
+		size_t count = (gTraceEventCount < TraceRingSize) ? gTraceEventCount : TraceRingSize;
+		events.reserve(count);
+		for (size_t i = gTraceEventCount - count; i < gTraceEventCount; i++)
+			events.push_back(gTraceEvents[i % TraceRingSize]);
+		origin = gTraceOrigin;
+		mainThread = gTraceMainThread;
+	}
+
+	FILE *fp = fopen(filename, "wt");
+	if (!fp)
+	{
+		Log("Unable to write trace %s\n", filename);
+		return false;
+	}
+	const double microSecondsPerTick = 1000000.0 / double(SDL_GetPerformanceFrequency());
+	fprintf(fp, "{\"traceEvents\":[\n");
+	int threadCount = gTraceThreadCount;
+	for (int i = 0; i < threadCount; i++)
+	{
+		fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", i ? ",\n" : "", i);
+		if (i == mainThread)
+			fprintf(fp, "\"Main\"}}");
+		else
+			fprintf(fp, "\"Thread %d\"}}", i);
+	}
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		const TraceEvent& event = events[i];
+		fprintf(fp, "%s{\"name\":", (threadCount || i) ? ",\n" : "");
+		WriteJSONString(fp, event.mName);
+		fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d", event.mCategory
+			, double(event.mStart - origin) * microSecondsPerTick, double(event.mEnd - event.mStart) * microSecondsPerTick, event.mThread);
+		if (event.mTarget >= 0)
+			fprintf(fp, ",\"args\":{\"target\":%d}", event.mTarget);
+		fprintf(fp, "}");
+	}
+	fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	fclose(fp);
+	Log("Trace with %d events saved to %s\n", int(events.size()), filename);
+	return true;
+}
@@ -0,0 +1,70 @@
+// https://github.com/CedricGuillemet/Imogen
+//
+// The MIT License(MIT)
+// 
+// Copyright(c) 2018 Cedric Guillemet
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+// frame, evaluation, job and io events recorded to a ring and saved for chrome://tracing.
+// The oldest events are overwritten when the ring is full. With recording off, a scope costs a test.
+void TraceStart();
+void TraceStop();
+bool TraceIsRecording();
+// chrome://tracing JSON of the events in the ring. Recording goes on
+bool TraceSave(const char *filename);
+
+extern std::atomic<bool> gTraceRecording;
+uint64_t TraceGetTicks();
+void TraceRecord(const char *name, const char *category, int target, uint64_t startTicks);
+
+// event covering the scope. name is copied, target (the evaluation stage) is shown as an argument when >= 0
+struct TraceScope
+{
+	TraceScope(const char *name, const char *category, int target = -1) : mStart(0)
+	{
+		if (gTraceRecording.load(std::memory_order_relaxed))
+		{
+			mName = name;
+			mCategory = category;
+			mTarget = target;
+			mStart = TraceGetTicks();
+		}
+	}
+	~TraceScope()
+	{
+		if (mStart)
+			TraceRecord(mName, mCategory, mTarget, mStart);
+	}
+	const char *mName;
+	const char *mCategory;
+	int mTarget;
+	uint64_t mStart;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(...) TraceScope TRACE_CONCAT(traceScope, __LINE__)(__VA_ARGS__)
@@ -33,14 +33,20 @@
 #include "NodesDelegate.h"
 #include "Evaluation.h"
 #include "Imogen.h"
+#include "Bake.h"
 #include "TaskScheduler.h"
+#include "Trace.h"
 #include "stb_image.h"
 #include "stb_image_write.h"
+#include <mutex>
 
 TileNodeEditGraphDelegate *TileNodeEditGraphDelegate::mInstance = NULL;
 unsigned int gCPUCount = 1;
 int Log(const char *szFormat, ...)
 {
+	// nodes can log from job threads
+	static std::mutex logMutex;
+	std::lock_guard<std::mutex> lock(logMutex);
 	va_list ptr_arg;
 	va_start(ptr_arg, szFormat);
 
@@ -115,13 +121,106 @@ Library library;
 Imogen imogen;
 enki::TaskScheduler g_TS;
 
-int main(int, char**)
+int RunBake(const BakeOptions& bakeOptions)
+{
+	// CPU only bake doesn't need any video driver
+	const bool needsGL = !bakeOptions.mbCPU || bakeOptions.mbCompare || bakeOptions.mBenchPrecisionSize || bakeOptions.mBenchBindingsDrawCount;
+	if (SDL_Init(needsGL ? (SDL_INIT_VIDEO | SDL_INIT_TIMER) : SDL_INIT_TIMER) != 0)
+	{
+		printf("Error: %s\n", SDL_GetError());
+		return -1;
+	}
+
+	SDL_Window* window = NULL;
+	SDL_GLContext gl_context = NULL;
+	if (needsGL)
+	{
+		// evaluators are #version 430. Core profile is needed to get it from Mesa (llvmpipe with LIBGL_ALWAYS_SOFTWARE=1)
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+
+		// the window is never shown, it's only there to own the GL context
+		window = SDL_CreateWindow("Imogen bake", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 64, 64, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+		gl_context = window ? SDL_GL_CreateContext(window) : NULL;
+		if (!gl_context || gl3wInit() != 0)
+		{
+			fprintf(stderr, "Unable to create an OpenGL 4.3 context: %s\n", SDL_GetError());
+			return 1;
+		}
+		printf("Baking %s using %s\n", bakeOptions.mLibraryFilename.c_str(), glGetString(GL_RENDERER));
+	}
+
+	gCPUCount = SDL_GetCPUCount();
+	if (!needsGL)
+		printf("Baking %s using CPU evaluation (%d threads)\n", bakeOptions.mLibraryFilename.c_str(), int(g_TS.GetNumTaskThreads()));
+
+	LoadLib(&library, bakeOptions.mLibraryFilename.c_str());
+	imogen.DiscoverEvaluatorFiles();
+
+	// GLSL programs are compiled when there is a context, BakeLibrary picks the backend for each pass
+	gEvaluation.SetBackend(needsGL ? BACKEND_GLSL : BACKEND_CPU);
+	gEvaluation.Init();
+	gEvaluation.SetEvaluators(imogen.mEvaluatorFiles);
+
+	int ret;
+	if (bakeOptions.mBenchPrecisionSize)
+		ret = Evaluation::BenchmarkPrecisions(bakeOptions.mBenchPrecisionSize);
+	else if (bakeOptions.mBenchBindingsDrawCount)
+		ret = Evaluation::BenchmarkGLSLBindings(bakeOptions.mBenchBindingsDrawCount);
+	else
+		ret = BakeLibrary(library, gEvaluation, bakeOptions);
+
+	gEvaluation.Finish();
+	if (gl_context)
+		SDL_GL_DeleteContext(gl_context);
+	if (window)
+		SDL_DestroyWindow(window);
+	SDL_Quit();
+
+	g_TS.WaitforAllAndShutdown();
+	return ret;
+}
+
+int main(int argc, char** argv)
 {
 	g_TS.Initialize();
 	LoadMetaNodes();
 
 	stbi_set_flip_vertically_on_load(1);
 	stbi_flip_vertically_on_write(1);
+
+	// -trace file : events are recorded from the start and saved when leaving
+	const char *traceFilename = NULL;
+	// -resultcache directory : results of slow C nodes are kept on disk between sessions
+	const char *resultCacheDirectory = NULL;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-resultcache") && (i + 1) < argc)
+			resultCacheDirectory = argv[i + 1];
+		if (!strcmp(argv[i], "-trace") && (i + 1) < argc)
+		{
+			traceFilename = argv[i + 1];
+			TraceStart();
+		}
+		if (!strcmp(argv[i], "-benchdirty"))
+			return Evaluation::BenchmarkDirtyPropagation(((i + 1) < argc) ? atoi(argv[i + 1]) : 800);
+		if (!strcmp(argv[i], "-benchparallel"))
+			return Evaluation::BenchmarkParallelEvaluation(((i + 1) < argc) ? atoi(argv[i + 1]) : 16, ((i + 2) < argc) ? atoi(argv[i + 2]) : 256);
+		if (!strcmp(argv[i], "-benchnative"))
+			return Evaluation::BenchmarkNativeC(((i + 1) < argc) ? atoi(argv[i + 1]) : 1024);
+		if (!strcmp(argv[i], "-benchimage"))
+			return Evaluation::BenchmarkImageKernels(((i + 1) < argc) ? atoi(argv[i + 1]) : 2048);
+	}
+
+	BakeOptions bakeOptions;
+	if (ParseBakeOptions(argc, argv, bakeOptions))
+	{
+		int ret = RunBake(bakeOptions);
+		if (traceFilename)
+			TraceSave(traceFilename);
+		return ret;
+	}
 	// Setup SDL
 	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) != 0)
 	{
@@ -202,6 +301,11 @@ int main(int, char**)
 	
 	gEvaluation.Init();
 	gEvaluation.SetEvaluators(imogen.mEvaluatorFiles);
+	if (resultCacheDirectory)
+		gEvaluation.SetResultCacheDirectory(resultCacheDirectory);
+	// dirty stages left after that are evaluated in the next frames
+	gEvaluation.SetEvaluationBudget(8.f);
+	gEvaluation.SetDemandEvaluation(true);
 
 	TileNodeEditGraphDelegate nodeGraphDelegate(gEvaluation);
 
@@ -211,6 +315,7 @@ int main(int, char**)
 	bool done = false;
 	while (!done)
 	{
+		TRACE_SCOPE("Frame", "frame");
 		SDL_Event event;
 		while (SDL_PollEvent(&event))
 		{
@@ -229,6 +334,8 @@ int main(int, char**)
 
 		imogen.Show(library, nodeGraphDelegate, gEvaluation);
 
+		gEvaluation.ProcessReadbacks(false);
+		gEvaluation.ProcessUploads(4);
 		gEvaluation.RunEvaluation(256, 256, false);
 
 		// render everything
@@ -244,8 +351,13 @@ int main(int, char**)
 	}
 	
 	imogen.ValidateCurrentMaterial(library, nodeGraphDelegate);
+	// node images are encoded by readback jobs
+	gEvaluation.ProcessReadbacks(true);
+	g_TS.WaitforAll();
 	SaveLib(&library, libraryFilename);
 	gEvaluation.Finish();
+	if (traceFilename)
+		TraceSave(traceFilename);
 
 	// Cleanup
 	ImGui_ImplOpenGL3_Shutdown();